@@ -0,0 +1,296 @@
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "cbor.h"
+
+/*
+ * Compact CBOR (RFC 8949) reader and writer, just enough for events and commands.
+ * The reader never reads past end, malformed input makes the calls return false or NULL.
+ * Fields of an unexpected type read as missing, like json-c does for JSON.
+ */
+
+static uint64_t cbor_read_be (const uint8_t* p, int length) {
+    uint64_t value = 0;
+    for (int i = 0; i < length; i++)
+        value = value << 8 | p[i];
+    return value;
+}
+
+static double cbor_half (uint16_t half) {
+    int exponent = half >> 10 & 0x1f;
+    int mantissa = half & 0x3ff;
+    double value;
+    if (exponent == 0)
+        value = mantissa / 16777216.0;
+    else if (exponent == 31)
+        value = mantissa == 0 ? INFINITY : NAN;
+    else {
+        // the same bits widened to a float
+        uint32_t bits = (uint32_t)(exponent - 15 + 127) << 23 | (uint32_t)mantissa << 13;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        value = f;
+    }
+    return half & 0x8000 ? -value : value;
+}
+
+static bool cbor_read_head (cbor_reader_t* reader, int* major, int* info, uint64_t* value) {
+    if (reader->pos >= reader->end)
+        return false;
+    uint8_t initial = *reader->pos++;
+    *major = initial >> 5;
+    *info = initial & 0x1f;
+    if (*info < 24) {
+        *value = *info;
+        return true;
+    }
+    if (*info == 31) {
+        *value = 0;
+        return true;
+    }
+    if (*info > 27)
+        return false;
+    int length = 1 << (*info - 24);
+    if (reader->end - reader->pos < length)
+        return false;
+    *value = cbor_read_be(reader->pos, length);
+    reader->pos += length;
+    return true;
+}
+
+bool cbor_read_item (cbor_reader_t* reader, cbor_item_t* item) {
+    int info;
+    do {
+        if (!cbor_read_head(reader, &item->major, &info, &item->value))
+            return false;
+    } while (item->major == CBOR_TAG && info != 31);
+
+    item->indefinite = info == 31;
+    item->number = 0;
+    switch (item->major) {
+        case CBOR_UINT:
+            item->number = (double)item->value;
+            return !item->indefinite;
+        case CBOR_NEGINT:
+            item->number = -1 - (double)item->value;
+            return !item->indefinite;
+        case CBOR_BYTES:
+        case CBOR_TEXT:
+            return item->indefinite || item->value <= (uint64_t)(reader->end - reader->pos);
+        case CBOR_SIMPLE:
+            if (info == 25)
+                item->number = cbor_half((uint16_t)item->value);
+            else if (info == 26) {
+                uint32_t bits = (uint32_t)item->value;
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                item->number = f;
+            }
+            else if (info == 27) {
+                uint64_t bits = item->value;
+                memcpy(&item->number, &bits, sizeof(item->number));
+            }
+            // keeps floats from looking like simple values
+            if (info >= 25 && info <= 27)
+                item->value = 0;
+            return true;
+        case CBOR_TAG:
+            return false;
+    }
+    return true;
+}
+
+static bool cbor_at_break (cbor_reader_t* reader) {
+    if (reader->pos < reader->end && *reader->pos == CBOR_BREAK) {
+        reader->pos++;
+        return true;
+    }
+    return false;
+}
+
+static bool cbor_is_break (cbor_item_t* item) {
+    return item->major == CBOR_SIMPLE && item->indefinite;
+}
+
+bool cbor_skip (cbor_reader_t* reader, int depth) {
+    cbor_item_t item;
+    if (depth > CBOR_MAX_DEPTH || !cbor_read_item(reader, &item))
+        return false;
+    switch (item.major) {
+        case CBOR_BYTES:
+        case CBOR_TEXT:
+            if (!item.indefinite) {
+                reader->pos += item.value;
+                return true;
+            }
+            // chunks are definite strings of the same type
+            while (!cbor_at_break(reader)) {
+                cbor_item_t chunk;
+                if (!cbor_read_item(reader, &chunk) || chunk.major != item.major || chunk.indefinite)
+                    return false;
+                reader->pos += chunk.value;
+            }
+            return true;
+        case CBOR_ARRAY:
+        case CBOR_MAP: {
+            uint64_t items = item.major == CBOR_MAP ? item.value * 2 : item.value;
+            if (item.indefinite) {
+                while (!cbor_at_break(reader))
+                    if (!cbor_skip(reader, depth + 1))
+                        return false;
+                return true;
+            }
+            for (uint64_t i = 0; i < items; i++)
+                if (!cbor_skip(reader, depth + 1))
+                    return false;
+            return true;
+        }
+        case CBOR_SIMPLE:
+            return !cbor_is_break(&item);
+    }
+    return true;
+}
+
+/* Calls member for every key with pos at its value, anything but a map has no members */
+bool cbor_read_map (cbor_reader_t* reader, int depth, cbor_member_fun member, void* data) {
+    const uint8_t* start = reader->pos;
+    cbor_item_t map;
+    if (!cbor_read_item(reader, &map))
+        return false;
+    if (map.major != CBOR_MAP) {
+        reader->pos = start;
+        return cbor_skip(reader, depth);
+    }
+    for (uint64_t i = 0; map.indefinite || i < map.value; i++) {
+        if (map.indefinite && cbor_at_break(reader))
+            break;
+        const uint8_t* key_start = reader->pos;
+        cbor_item_t key;
+        if (!cbor_read_item(reader, &key))
+            return false;
+        const char* name = NULL;
+        if (key.major == CBOR_TEXT && !key.indefinite) {
+            name = (const char*)reader->pos;
+            reader->pos += key.value;
+        }
+        else {
+            reader->pos = key_start;
+            if (!cbor_skip(reader, depth + 1))
+                return false;
+        }
+        if (!member(reader, name, name != NULL ? key.value : 0, data))
+            return false;
+    }
+    return true;
+}
+
+static bool cbor_skip_other (cbor_reader_t* reader, const uint8_t* start) {
+    reader->pos = start;
+    return cbor_skip(reader, 1);
+}
+
+/* Same conversions as json_object_get_int */
+bool cbor_read_int (cbor_reader_t* reader, int* value) {
+    const uint8_t* start = reader->pos;
+    cbor_item_t item;
+    if (!cbor_read_item(reader, &item))
+        return false;
+    double d = item.number;
+    *value = 0;
+    if (item.major == CBOR_UINT)
+        *value = item.value >= INT_MAX ? INT_MAX : (int)item.value;
+    else if (item.major == CBOR_NEGINT)
+        *value = item.value >= INT_MAX ? INT_MIN : -1 - (int)item.value;
+    else if (item.major == CBOR_SIMPLE && item.value == CBOR_TRUE && !item.indefinite)
+        *value = 1;
+    else if (item.major == CBOR_SIMPLE && d == d && d != 0)
+        *value = d <= INT_MIN ? INT_MIN : d >= INT_MAX ? INT_MAX : (int)d;
+    else if (item.major != CBOR_SIMPLE)
+        return cbor_skip_other(reader, start);
+    return !cbor_is_break(&item);
+}
+
+bool cbor_read_bool (cbor_reader_t* reader, bool* value) {
+    const uint8_t* start = reader->pos;
+    cbor_item_t item;
+    if (!cbor_read_item(reader, &item))
+        return false;
+    *value = item.major == CBOR_SIMPLE && item.value == CBOR_TRUE;
+    if (item.major != CBOR_SIMPLE)
+        return cbor_skip_other(reader, start);
+    return !cbor_is_break(&item);
+}
+
+/* Copies a text string into the arena, other types read as "" and NULL means malformed */
+char* cbor_read_text (cbor_reader_t* reader, arena_t* arena) {
+    const uint8_t* start = reader->pos;
+    cbor_item_t item;
+    if (!cbor_read_item(reader, &item))
+        return NULL;
+    if (item.major != CBOR_TEXT)
+        return cbor_skip_other(reader, start) ? arena_strdup(arena, "") : NULL;
+    if (!item.indefinite) {
+        char* text = arena_alloc(arena, item.value + 1);
+        memcpy(text, reader->pos, item.value);
+        text[item.value] = '\0';
+        reader->pos += item.value;
+        return text;
+    }
+    // measure the chunks first, then join them
+    const uint8_t* chunks = reader->pos;
+    size_t length = 0;
+    while (!cbor_at_break(reader)) {
+        cbor_item_t chunk;
+        if (!cbor_read_item(reader, &chunk) || chunk.major != CBOR_TEXT || chunk.indefinite)
+            return NULL;
+        reader->pos += chunk.value;
+        length += chunk.value;
+    }
+    char* text = arena_alloc(arena, length + 1);
+    reader->pos = chunks;
+    size_t offset = 0;
+    while (!cbor_at_break(reader)) {
+        cbor_item_t chunk;
+        cbor_read_item(reader, &chunk);
+        memcpy(text + offset, reader->pos, chunk.value);
+        reader->pos += chunk.value;
+        offset += chunk.value;
+    }
+    text[length] = '\0';
+    return text;
+}
+
+void cbor_write_head (string_builder_t* builder, int major, uint64_t value) {
+    char head[9];
+    int length;
+    if (value < 24) {
+        head[0] = (char)(major << 5 | value);
+        length = 0;
+    }
+    else {
+        int info = value <= 0xff ? 24 : value <= 0xffff ? 25 : value <= 0xffffffff ? 26 : 27;
+        length = 1 << (info - 24);
+        head[0] = (char)(major << 5 | info);
+        for (int i = 0; i < length; i++)
+            head[1 + i] = (char)(value >> (8 * (length - 1 - i)));
+    }
+    string_builder_append_string(builder, head, 1 + length);
+}
+
+void cbor_write_int (string_builder_t* builder, int64_t value) {
+    if (value < 0)
+        cbor_write_head(builder, CBOR_NEGINT, (uint64_t)(-1 - value));
+    else
+        cbor_write_head(builder, CBOR_UINT, (uint64_t)value);
+}
+
+void cbor_write_bool (string_builder_t* builder, bool value) {
+    char simple = (char)(CBOR_SIMPLE << 5 | (value ? CBOR_TRUE : CBOR_FALSE));
+    string_builder_append_string(builder, &simple, 1);
+}
+
+void cbor_write_text (string_builder_t* builder, const char* text) {
+    size_t length = strlen(text);
+    cbor_write_head(builder, CBOR_TEXT, length);
+    string_builder_append_string(builder, text, length);
+}
@@ -0,0 +1,53 @@
+#ifndef NOTIFIER_CBOR_H_HEADER
+#define NOTIFIER_CBOR_H_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "util.h"
+
+#define CBOR_UINT       0
+#define CBOR_NEGINT     1
+#define CBOR_BYTES      2
+#define CBOR_TEXT       3
+#define CBOR_ARRAY      4
+#define CBOR_MAP        5
+#define CBOR_TAG        6
+#define CBOR_SIMPLE     7
+
+#define CBOR_FALSE      20
+#define CBOR_TRUE       21
+#define CBOR_NULL       22
+#define CBOR_BREAK      0xff
+
+#define CBOR_MAX_DEPTH  64
+
+typedef struct cbor_reader {
+    const uint8_t* pos;
+    const uint8_t* end;
+} cbor_reader_t;
+
+/* Head of a data item, tags are skipped. value is the length of strings and containers */
+typedef struct cbor_item {
+    int major;
+    uint64_t value;
+    bool indefinite;
+    double number;
+} cbor_item_t;
+
+/* key is NULL for keys that are not plain text strings */
+typedef bool(*cbor_member_fun)(cbor_reader_t* reader, const char* key, size_t key_length, void* data);
+
+bool cbor_read_item (cbor_reader_t* reader, cbor_item_t* item);
+bool cbor_skip (cbor_reader_t* reader, int depth);
+bool cbor_read_map (cbor_reader_t* reader, int depth, cbor_member_fun member, void* data);
+bool cbor_read_int (cbor_reader_t* reader, int* value);
+bool cbor_read_bool (cbor_reader_t* reader, bool* value);
+char* cbor_read_text (cbor_reader_t* reader, arena_t* arena);
+
+void cbor_write_head (string_builder_t* builder, int major, uint64_t value);
+void cbor_write_int (string_builder_t* builder, int64_t value);
+void cbor_write_bool (string_builder_t* builder, bool value);
+void cbor_write_text (string_builder_t* builder, const char* text);
+
+#endif
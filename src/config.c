@@ -18,6 +18,19 @@ const char* config_get_value (config_t* config, const char* value_name) {
         return pair->value;
 }
 
+long config_get_long (config_t* config, const char* value_name, long default_value) {
+    const char* value = config_get_value(config, value_name);
+    if (value == NULL || *value == '\0')
+        return default_value;
+    char* end;
+    long result = strtol(value, &end, 10);
+    if (*end != '\0') {
+        printf("config parameter \"%s\" is not a number, using %ld\n", value_name, default_value);
+        return default_value;
+    }
+    return result;
+}
+
 void config_set_value (config_t* config, char* name, char* value) {
     config_pair_t* pair = config_get_pair(config, name);
     if (pair != NULL) {
@@ -20,6 +20,7 @@ typedef struct config {
 config_t* config_read (const char* file_name);
 void config_rewrite (config_t* config);
 const char* config_get_value (config_t* config, const char* value_name);
+long config_get_long (config_t* config, const char* value_name, long default_value);
 void config_set_value (config_t* config, char* name, char* value);
 void config_print_all (config_t* config);
 
@@ -0,0 +1,373 @@
+#include "eso-cbor.h"
+
+/*
+ * Events and commands in CBOR, with the same maps and keys as the JSON form.
+ * Strings are copied straight from the body into the event arena.
+ */
+
+typedef struct eso_cbor_event {
+    eso_event_t* event;
+    const uint8_t* event_data;
+} eso_cbor_event_t;
+
+static bool cbor_key_equals (const char* key, size_t length, const char* name) {
+    return key != NULL && strlen(name) == length && memcmp(key, name, length) == 0;
+}
+
+static bool eso_cbor_read_text (cbor_reader_t* reader, arena_t* arena, char** text) {
+    *text = cbor_read_text(reader, arena);
+    return *text != NULL;
+}
+
+static bool eso_cbor_game_data_member (cbor_reader_t* reader, const char* key, size_t length, void* data) {
+    eso_event_t* event = ((eso_cbor_event_t*)data)->event;
+    if (cbor_key_equals(key, length, "node"))
+        return eso_cbor_read_text(reader, event->arena, &event->game_data.node);
+    return cbor_skip(reader, 3);
+}
+
+static bool eso_cbor_actor_member (cbor_reader_t* reader, const char* key, size_t length, void* data) {
+    eso_event_t* event = ((eso_cbor_event_t*)data)->event;
+    if (cbor_key_equals(key, length, "id"))
+        return cbor_read_int(reader, &event->actor.id);
+    if (cbor_key_equals(key, length, "name"))
+        return eso_cbor_read_text(reader, event->arena, &event->actor.name);
+    return cbor_skip(reader, 3);
+}
+
+static bool eso_cbor_data_member (cbor_reader_t* reader, const char* key, size_t length, void* data) {
+    eso_cbor_event_t* ctx = data;
+    if (cbor_key_equals(key, length, "gameData"))
+        return cbor_read_map(reader, 2, eso_cbor_game_data_member, ctx);
+    if (cbor_key_equals(key, length, "actor"))
+        return cbor_read_map(reader, 2, eso_cbor_actor_member, ctx);
+    if (cbor_key_equals(key, length, "eventData")) {
+        // the event type may only be known later, eventData is read after the root
+        ctx->event_data = reader->pos;
+        return cbor_skip(reader, 2);
+    }
+    return cbor_skip(reader, 2);
+}
+
+static bool eso_cbor_root_member (cbor_reader_t* reader, const char* key, size_t length, void* data) {
+    eso_cbor_event_t* ctx = data;
+    if (cbor_key_equals(key, length, "code"))
+        return eso_cbor_read_text(reader, ctx->event->arena, &ctx->event->event_code);
+    if (cbor_key_equals(key, length, "data"))
+        return cbor_read_map(reader, 1, eso_cbor_data_member, ctx);
+    return cbor_skip(reader, 1);
+}
+
+static bool eso_cbor_track_member (cbor_reader_t* reader, const char* key, size_t length, void* data) {
+    eso_event_t* event = data;
+    eso_media_track_t* track = event->data;
+    if (cbor_key_equals(key, length, "id"))
+        return eso_cbor_read_text(reader, event->arena, &track->id);
+    if (cbor_key_equals(key, length, "type"))
+        return eso_cbor_read_text(reader, event->arena, &track->type);
+    return cbor_skip(reader, 4);
+}
+
+static bool eso_cbor_dice_member (cbor_reader_t* reader, const char* key, size_t length, void* data) {
+    eso_dice_t* dice = data;
+    if (cbor_key_equals(key, length, "num"))
+        return cbor_read_int(reader, &dice->num);
+    if (cbor_key_equals(key, length, "sides"))
+        return cbor_read_int(reader, &dice->sides);
+    return cbor_skip(reader, 5);
+}
+
+static bool eso_cbor_read_rolls (cbor_reader_t* reader, eso_event_t* event) {
+    list_t* dice_list = ((eso_event_dice_t*)event->data)->list;
+    const uint8_t* start = reader->pos;
+    cbor_item_t rolls;
+    if (!cbor_read_item(reader, &rolls))
+        return false;
+    if (rolls.major != CBOR_ARRAY) {
+        reader->pos = start;
+        return cbor_skip(reader, 3);
+    }
+    // an indefinite array is counted before anything is allocated
+    size_t length = rolls.value;
+    const uint8_t* items = reader->pos;
+    if (rolls.indefinite) {
+        for (length = 0; !(reader->pos < reader->end && *reader->pos == CBOR_BREAK); length++)
+            if (!cbor_skip(reader, 4))
+                return false;
+        reader->pos = items;
+    }
+    else if (length > (size_t)(reader->end - reader->pos))
+        return false;
+    eso_dice_t* memory = arena_alloc(event->arena, sizeof(eso_dice_t) * length);
+    dice_list->values = arena_alloc(event->arena, sizeof(eso_dice_t*) * length);
+    dice_list->size = 0;
+    dice_list->length = length;
+    for (size_t i = 0; i < length; i++) {
+        eso_dice_t* dice = memory + i;
+        dice->num = 0;
+        dice->sides = 0;
+        if (!cbor_read_map(reader, 4, eso_cbor_dice_member, dice))
+            return false;
+        list_push(dice_list, dice);
+    }
+    if (rolls.indefinite)
+        reader->pos++;
+    return true;
+}
+
+/* Only the fields of the event type are read, the rest is skipped */
+static bool eso_cbor_event_data_member (cbor_reader_t* reader, const char* key, size_t length, void* data) {
+    eso_event_t* event = data;
+    switch (event->event_type) {
+        case ESO_EVENT_CHAT:
+            if (cbor_key_equals(key, length, "message"))
+                return eso_cbor_read_text(reader, event->arena, &((eso_event_chat_t*)event->data)->message);
+            break;
+        case ESO_EVENT_BROADCAST:
+            if (cbor_key_equals(key, length, "message"))
+                return eso_cbor_read_text(reader, event->arena, &((eso_event_broadcast_t*)event->data)->message);
+            break;
+        case ESO_EVENT_TRY:
+            if (cbor_key_equals(key, length, "message"))
+                return eso_cbor_read_text(reader, event->arena, &((eso_event_try_t*)event->data)->message);
+            if (cbor_key_equals(key, length, "success"))
+                return cbor_read_bool(reader, &((eso_event_try_t*)event->data)->success);
+            break;
+        case ESO_EVENT_ROLL:
+            if (cbor_key_equals(key, length, "num"))
+                return cbor_read_int(reader, &((eso_event_roll_t*)event->data)->num);
+            break;
+        case ESO_EVENT_MEDIA_TRACK:
+            if (cbor_key_equals(key, length, "track"))
+                return cbor_read_map(reader, 3, eso_cbor_track_member, event);
+            break;
+        case ESO_EVENT_DICE:
+            if (cbor_key_equals(key, length, "rolls"))
+                return eso_cbor_read_rolls(reader, event);
+            break;
+    }
+    return cbor_skip(reader, 3);
+}
+
+/* The type's structure with every field missing, eventData fills it in */
+static void* eso_cbor_event_data_create (eso_event_t* event) {
+    char* empty = arena_strdup(event->arena, "");
+    switch (event->event_type) {
+        case ESO_EVENT_CHAT: {
+            eso_event_chat_t* chat = arena_alloc(event->arena, sizeof(eso_event_chat_t));
+            chat->message = empty;
+            return chat;
+        }
+        case ESO_EVENT_BROADCAST: {
+            eso_event_broadcast_t* broadcast = arena_alloc(event->arena, sizeof(eso_event_broadcast_t));
+            broadcast->message = empty;
+            return broadcast;
+        }
+        case ESO_EVENT_TRY: {
+            eso_event_try_t* try = arena_alloc(event->arena, sizeof(eso_event_try_t));
+            try->message = empty;
+            try->success = false;
+            return try;
+        }
+        case ESO_EVENT_ROLL: {
+            eso_event_roll_t* roll = arena_alloc(event->arena, sizeof(eso_event_roll_t));
+            roll->num = 0;
+            return roll;
+        }
+        case ESO_EVENT_MEDIA_TRACK: {
+            eso_media_track_t* track = arena_alloc(event->arena, sizeof(eso_media_track_t));
+            track->id = empty;
+            track->type = empty;
+            return track;
+        }
+        case ESO_EVENT_DICE: {
+            eso_event_dice_t* dices = arena_alloc(event->arena, sizeof(eso_event_dice_t));
+            list_t* dice_list = arena_alloc(event->arena, sizeof(list_t));
+            dice_list->values = NULL;
+            dice_list->size = 0;
+            dice_list->value_size = sizeof(eso_dice_t*);
+            dice_list->length = 0;
+            dices->list = dice_list;
+            return dices;
+        }
+    }
+    return NULL;
+}
+
+/* Reads the event map at the reader position, NULL when it is malformed or not a map */
+eso_event_t* eso_cbor_parse_event (cbor_reader_t* reader) {
+    cbor_reader_t peek = *reader;
+    cbor_item_t root;
+    if (!cbor_read_item(&peek, &root) || root.major != CBOR_MAP)
+        return NULL;
+
+    eso_event_t* event = eso_event_create();
+    char* empty = arena_strdup(event->arena, "");
+    event->event_code = empty;
+    event->actor.id = 0;
+    event->actor.name = empty;
+    event->game_data.node = empty;
+    eso_cbor_event_t ctx = {event, NULL};
+    if (!cbor_read_map(reader, 0, eso_cbor_root_member, &ctx)) {
+        eso_event_free(event);
+        return NULL;
+    }
+    event->event_type = match_event_name_to_constant(event->event_code);
+    event->data = eso_cbor_event_data_create(event);
+    if (ctx.event_data != NULL && event->data != NULL) {
+        cbor_reader_t event_data = {ctx.event_data, reader->end};
+        if (!cbor_read_map(&event_data, 1, eso_cbor_event_data_member, event)) {
+            eso_event_free(event);
+            return NULL;
+        }
+    }
+    return event;
+}
+
+eso_event_t* parse_eso_event_cbor (const char* data, size_t length) {
+    cbor_reader_t reader = {(const uint8_t*)data, (const uint8_t*)data + length};
+    eso_event_t* event = eso_cbor_parse_event(&reader);
+    if (event != NULL && reader.pos != reader.end) {
+        eso_event_release(event);
+        return NULL;
+    }
+    return event;
+}
+
+/*
+ * Accepts an array of events or a sequence of them (RFC 8742).
+ * Items that are not event maps are NULL, a malformed item ends the batch with a NULL.
+ */
+list_t* parse_eso_event_batch_cbor (const char* data, size_t length) {
+    list_t* events = list_create(eso_event_t*);
+    cbor_reader_t reader = {(const uint8_t*)data, (const uint8_t*)data + length};
+    cbor_reader_t peek = reader;
+    cbor_item_t array;
+    bool indefinite = false;
+    uint64_t count = UINT64_MAX;
+    if (cbor_read_item(&peek, &array) && array.major == CBOR_ARRAY) {
+        reader = peek;
+        indefinite = array.indefinite;
+        count = indefinite ? UINT64_MAX : array.value;
+    }
+    for (uint64_t i = 0; i < count && reader.pos < reader.end; i++) {
+        if (indefinite && *reader.pos == CBOR_BREAK)
+            break;
+        const uint8_t* start = reader.pos;
+        eso_event_t* event = eso_cbor_parse_event(&reader);
+        list_push(events, event);
+        if (event != NULL)
+            continue;
+        reader.pos = start;
+        if (!cbor_skip(&reader, 1))
+            break;
+    }
+    return events;
+}
+
+static void eso_cbor_write_event_data (string_builder_t* out, eso_event_t* event) {
+    switch (event->data != NULL ? event->event_type : ESO_EVENT_UNEXPECTED) {
+        case ESO_EVENT_CHAT:
+            cbor_write_head(out, CBOR_MAP, 1);
+            cbor_write_text(out, "message");
+            cbor_write_text(out, ((eso_event_chat_t*)event->data)->message);
+            return;
+        case ESO_EVENT_BROADCAST:
+            cbor_write_head(out, CBOR_MAP, 1);
+            cbor_write_text(out, "message");
+            cbor_write_text(out, ((eso_event_broadcast_t*)event->data)->message);
+            return;
+        case ESO_EVENT_TRY: {
+            eso_event_try_t* try = event->data;
+            cbor_write_head(out, CBOR_MAP, 2);
+            cbor_write_text(out, "message");
+            cbor_write_text(out, try->message);
+            cbor_write_text(out, "success");
+            cbor_write_bool(out, try->success);
+            return;
+        }
+        case ESO_EVENT_ROLL:
+            cbor_write_head(out, CBOR_MAP, 1);
+            cbor_write_text(out, "num");
+            cbor_write_int(out, ((eso_event_roll_t*)event->data)->num);
+            return;
+        case ESO_EVENT_MEDIA_TRACK: {
+            eso_media_track_t* track = event->data;
+            cbor_write_head(out, CBOR_MAP, 1);
+            cbor_write_text(out, "track");
+            cbor_write_head(out, CBOR_MAP, 2);
+            cbor_write_text(out, "id");
+            cbor_write_text(out, track->id);
+            cbor_write_text(out, "type");
+            cbor_write_text(out, track->type);
+            return;
+        }
+        case ESO_EVENT_DICE: {
+            list_t* dice_list = ((eso_event_dice_t*)event->data)->list;
+            cbor_write_head(out, CBOR_MAP, 1);
+            cbor_write_text(out, "rolls");
+            cbor_write_head(out, CBOR_ARRAY, list_size(dice_list));
+            for (size_t i = 0; i < list_size(dice_list); i++) {
+                eso_dice_t* dice = list_get(dice_list, i, eso_dice_t*);
+                cbor_write_head(out, CBOR_MAP, 2);
+                cbor_write_text(out, "num");
+                cbor_write_int(out, dice->num);
+                cbor_write_text(out, "sides");
+                cbor_write_int(out, dice->sides);
+            }
+            return;
+        }
+    }
+    cbor_write_head(out, CBOR_MAP, 0);
+}
+
+/* The event map eso_cbor_parse_event reads, only the fields the event type keeps survive */
+void eso_event_to_cbor (string_builder_t* out, eso_event_t* event) {
+    cbor_write_head(out, CBOR_MAP, 2);
+    cbor_write_text(out, "code");
+    cbor_write_text(out, event->event_code);
+    cbor_write_text(out, "data");
+    cbor_write_head(out, CBOR_MAP, 3);
+    cbor_write_text(out, "gameData");
+    cbor_write_head(out, CBOR_MAP, 1);
+    cbor_write_text(out, "node");
+    cbor_write_text(out, event->game_data.node);
+    cbor_write_text(out, "actor");
+    cbor_write_head(out, CBOR_MAP, 2);
+    cbor_write_text(out, "id");
+    cbor_write_int(out, event->actor.id);
+    cbor_write_text(out, "name");
+    cbor_write_text(out, event->actor.name);
+    cbor_write_text(out, "eventData");
+    eso_cbor_write_event_data(out, event);
+}
+
+/* {"commands":[...]} with the layout of eso_command_list_to_json */
+string_builder_t* eso_command_list_to_cbor (eso_command_t* commands) {
+    size_t count = 0;
+    for (eso_command_t* cmd = commands; cmd != NULL; cmd = cmd->next)
+        if (cmd->type == ESO_CMD_SEND_MESSAGE || cmd->type == ESO_CMD_RECONNECT)
+            count++;
+    string_builder_t* result = string_builder_create(64);
+    cbor_write_head(result, CBOR_MAP, 1);
+    cbor_write_text(result, "commands");
+    cbor_write_head(result, CBOR_ARRAY, count);
+    for (eso_command_t* cmd = commands; cmd != NULL; cmd = cmd->next) {
+        if (cmd->type == ESO_CMD_SEND_MESSAGE) {
+            eso_send_message_command_t* msg = (eso_send_message_command_t*) cmd->data;
+            cbor_write_head(result, CBOR_MAP, 2);
+            cbor_write_text(result, "type");
+            cbor_write_text(result, ESO_CMD_SEND_MESSAGE_NAME);
+            cbor_write_text(result, "data");
+            cbor_write_head(result, CBOR_MAP, 1);
+            cbor_write_text(result, "text");
+            cbor_write_text(result, msg->text);
+        }
+        else if (cmd->type == ESO_CMD_RECONNECT) {
+            cbor_write_head(result, CBOR_MAP, 1);
+            cbor_write_text(result, "type");
+            cbor_write_text(result, ESO_CMD_RECONNECT_NAME);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,13 @@
+#ifndef NOTIFIER_ESO_CBOR_H_HEADER
+#define NOTIFIER_ESO_CBOR_H_HEADER
+
+#include "eso.h"
+#include "cbor.h"
+
+eso_event_t* eso_cbor_parse_event (cbor_reader_t* reader);
+eso_event_t* parse_eso_event_cbor (const char* data, size_t length);
+list_t* parse_eso_event_batch_cbor (const char* data, size_t length);
+void eso_event_to_cbor (string_builder_t* out, eso_event_t* event);
+string_builder_t* eso_command_list_to_cbor (eso_command_t* commands);
+
+#endif
@@ -0,0 +1,572 @@
+#include <limits.h>
+#include "eso-json.h"
+
+/*
+ * Reads events of the known schema straight from the request text, without a json-c tree.
+ * Strings are only located while scanning and are unescaped once, directly into the event
+ * arena. Anything this parser is not sure about (syntax errors, unexpected value types,
+ * escaped keys) makes it give up and return NULL, the caller then falls back to json-c.
+ */
+
+typedef struct eso_json {
+    const char* pos;
+    const char* end;
+} eso_json_t;
+
+typedef struct eso_json_string {
+    const char* start; // NULL for a missing field or null
+    const char* end;
+    bool escaped;
+} eso_json_string_t;
+
+typedef struct eso_json_fields {
+    eso_json_string_t code;
+    eso_json_string_t node;
+    eso_json_string_t name;
+    int actor_id;
+    const char* event_data;
+} eso_json_fields_t;
+
+typedef struct eso_json_event_data {
+    int type;
+    eso_json_string_t message;
+    bool success;
+    int num;
+    int sides;
+    eso_json_string_t track_id;
+    eso_json_string_t track_type;
+    const char* track;
+    const char* rolls;
+} eso_json_event_data_t;
+
+typedef bool(*eso_json_member_fun)(eso_json_t* json, eso_json_string_t* key, void* data);
+
+static void json_skip_space (eso_json_t* json) {
+    while (json->pos < json->end && (*json->pos == ' ' || *json->pos == '\t' || *json->pos == '\n' || *json->pos == '\r'))
+        json->pos++;
+}
+
+static bool json_peek (eso_json_t* json, char c) {
+    json_skip_space(json);
+    return json->pos < json->end && *json->pos == c;
+}
+
+static bool json_literal (eso_json_t* json, const char* literal, size_t length) {
+    if ((size_t)(json->end - json->pos) < length || memcmp(json->pos, literal, length) != 0)
+        return false;
+    json->pos += length;
+    return true;
+}
+
+static int json_hex (char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static long json_hex4 (const char* p) {
+    long value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = json_hex(p[i]);
+        if (digit < 0)
+            return -1;
+        value = value << 4 | digit;
+    }
+    return value;
+}
+
+/* Expects the opening quote at pos, leaves pos after the closing one */
+static bool json_scan_string (eso_json_t* json, eso_json_string_t* string) {
+    const char* p = json->pos + 1;
+    string->start = p;
+    string->escaped = false;
+    while (p < json->end) {
+        unsigned char c = *p;
+        if (c == '"') {
+            string->end = p;
+            json->pos = p + 1;
+            return true;
+        }
+        if (c < 0x20)
+            return false;
+        if (c == '\\') {
+            if (p + 1 >= json->end)
+                return false;
+            string->escaped = true;
+            char e = p[1];
+            if (e == 'u') {
+                if (json->end - p < 6 || json_hex4(p + 2) < 0)
+                    return false;
+                p += 6;
+                continue;
+            }
+            if (strchr("\"\\/bfnrt", e) == NULL || e == '\0')
+                return false;
+            p += 2;
+            continue;
+        }
+        p++;
+    }
+    return false;
+}
+
+static const char* json_scan_number (const char* p, const char* end, bool* fraction) {
+    *fraction = false;
+    if (p < end && *p == '-')
+        p++;
+    if (p >= end || *p < '0' || *p > '9')
+        return NULL;
+    if (*p == '0')
+        p++;
+    else
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+    if (p < end && *p == '.') {
+        *fraction = true;
+        p++;
+        if (p >= end || *p < '0' || *p > '9')
+            return NULL;
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        *fraction = true;
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+            p++;
+        if (p >= end || *p < '0' || *p > '9')
+            return NULL;
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+    }
+    return p;
+}
+
+static bool json_skip_value (eso_json_t* json, int depth);
+
+static bool json_skip_member (eso_json_t* json, eso_json_string_t* key, void* data) {
+    return json_skip_value(json, *(int*)data);
+}
+
+/* Calls member for every key with pos at its value, member has to consume the value */
+static bool json_parse_object (eso_json_t* json, eso_json_member_fun member, void* data) {
+    json->pos++;
+    if (json_peek(json, '}')) {
+        json->pos++;
+        return true;
+    }
+    while (true) {
+        eso_json_string_t key;
+        if (!json_peek(json, '"') || !json_scan_string(json, &key))
+            return false;
+        // an escaped key could still name a schema field
+        if (key.escaped && member != json_skip_member)
+            return false;
+        if (!json_peek(json, ':'))
+            return false;
+        json->pos++;
+        json_skip_space(json);
+        if (json->pos >= json->end || !member(json, &key, data))
+            return false;
+        json_skip_space(json);
+        if (json->pos >= json->end)
+            return false;
+        char c = *json->pos++;
+        if (c == '}')
+            return true;
+        if (c != ',')
+            return false;
+    }
+}
+
+static bool json_skip_value (eso_json_t* json, int depth) {
+    json_skip_space(json);
+    if (depth > ESO_JSON_MAX_DEPTH || json->pos >= json->end)
+        return false;
+    eso_json_string_t string;
+    bool fraction;
+    int inner = depth + 1;
+    switch (*json->pos) {
+        case '"':
+            return json_scan_string(json, &string);
+        case '{':
+            return json_parse_object(json, json_skip_member, &inner);
+        case '[':
+            json->pos++;
+            if (json_peek(json, ']')) {
+                json->pos++;
+                return true;
+            }
+            while (true) {
+                if (!json_skip_value(json, inner))
+                    return false;
+                json_skip_space(json);
+                if (json->pos >= json->end)
+                    return false;
+                char c = *json->pos++;
+                if (c == ']')
+                    return true;
+                if (c != ',')
+                    return false;
+            }
+        case 't':
+            return json_literal(json, "true", 4);
+        case 'f':
+            return json_literal(json, "false", 5);
+        case 'n':
+            return json_literal(json, "null", 4);
+        default:
+            json->pos = json_scan_number(json->pos, json->end, &fraction);
+            return json->pos != NULL;
+    }
+}
+
+static bool json_key_equals (eso_json_string_t* key, const char* name) {
+    size_t length = key->end - key->start;
+    return !key->escaped && strlen(name) == length && memcmp(key->start, name, length) == 0;
+}
+
+static bool json_read_string (eso_json_t* json, eso_json_string_t* string) {
+    if (*json->pos == '"')
+        return json_scan_string(json, string);
+    string->start = NULL;
+    return json_literal(json, "null", 4);
+}
+
+/* Same conversions as json_object_get_int, strings are left to json-c */
+static bool json_read_int (eso_json_t* json, int* value) {
+    bool fraction;
+    switch (*json->pos) {
+        case 'n':
+            *value = 0;
+            return json_literal(json, "null", 4);
+        case 't':
+            *value = 1;
+            return json_literal(json, "true", 4);
+        case 'f':
+            *value = 0;
+            return json_literal(json, "false", 5);
+    }
+    const char* number_end = json_scan_number(json->pos, json->end, &fraction);
+    if (number_end == NULL)
+        return false;
+    // the text is NUL terminated and a number is always followed by a delimiter
+    if (fraction) {
+        double d = strtod(json->pos, NULL);
+        *value = d <= INT_MIN ? INT_MIN : d >= INT_MAX ? INT_MAX : (int)d;
+    }
+    else {
+        long long ll = strtoll(json->pos, NULL, 10);
+        *value = ll <= INT_MIN ? INT_MIN : ll >= INT_MAX ? INT_MAX : (int)ll;
+    }
+    json->pos = number_end;
+    return true;
+}
+
+static bool json_read_bool (eso_json_t* json, bool* value) {
+    *value = *json->pos == 't';
+    return json_literal(json, "true", 4) || json_literal(json, "false", 5) || json_literal(json, "null", 4);
+}
+
+/* Containers of another type are skipped, json-c finds no fields in them either */
+static bool json_read_object (eso_json_t* json, eso_json_member_fun member, void* data) {
+    if (*json->pos != '{')
+        return json_skip_value(json, 1);
+    return json_parse_object(json, member, data);
+}
+
+static void json_utf8 (char** out, long cp) {
+    char* o = *out;
+    if (cp < 0x80)
+        *o++ = (char)cp;
+    else if (cp < 0x800) {
+        *o++ = (char)(0xC0 | cp >> 6);
+        *o++ = (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000) {
+        *o++ = (char)(0xE0 | cp >> 12);
+        *o++ = (char)(0x80 | (cp >> 6 & 0x3F));
+        *o++ = (char)(0x80 | (cp & 0x3F));
+    }
+    else {
+        *o++ = (char)(0xF0 | cp >> 18);
+        *o++ = (char)(0x80 | (cp >> 12 & 0x3F));
+        *o++ = (char)(0x80 | (cp >> 6 & 0x3F));
+        *o++ = (char)(0x80 | (cp & 0x3F));
+    }
+    *out = o;
+}
+
+/* Unescapes into the arena, an escape is never shorter than its UTF-8 */
+static char* json_copy_string (arena_t* arena, eso_json_string_t* string) {
+    if (string->start == NULL)
+        return arena_strdup(arena, "");
+    size_t length = string->end - string->start;
+    char* copy = arena_alloc(arena, length + 1);
+    if (!string->escaped) {
+        memcpy(copy, string->start, length);
+        copy[length] = '\0';
+        return copy;
+    }
+    char* out = copy;
+    for (const char* p = string->start; p < string->end; p++) {
+        if (*p != '\\') {
+            *out++ = *p;
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                long cp = json_hex4(p + 1);
+                p += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    // the low half has to follow, lone surrogates are left to json-c
+                    long low = string->end - p > 6 && p[1] == '\\' && p[2] == 'u' ? json_hex4(p + 3) : -1;
+                    if (low < 0xDC00 || low > 0xDFFF)
+                        return NULL;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                else if (cp == 0 || (cp >= 0xDC00 && cp <= 0xDFFF))
+                    return NULL;
+                json_utf8(&out, cp);
+                break;
+            }
+            default:
+                *out++ = *p;
+        }
+    }
+    *out = '\0';
+    return copy;
+}
+
+static bool json_game_data_member (eso_json_t* json, eso_json_string_t* key, void* data) {
+    eso_json_fields_t* fields = data;
+    if (json_key_equals(key, "node"))
+        return json_read_string(json, &fields->node);
+    return json_skip_value(json, 2);
+}
+
+static bool json_actor_member (eso_json_t* json, eso_json_string_t* key, void* data) {
+    eso_json_fields_t* fields = data;
+    if (json_key_equals(key, "id"))
+        return json_read_int(json, &fields->actor_id);
+    if (json_key_equals(key, "name"))
+        return json_read_string(json, &fields->name);
+    return json_skip_value(json, 2);
+}
+
+static bool json_data_member (eso_json_t* json, eso_json_string_t* key, void* data) {
+    eso_json_fields_t* fields = data;
+    // a repeated key replaces the whole value, as it does in json-c
+    if (json_key_equals(key, "gameData")) {
+        fields->node.start = NULL;
+        return json_read_object(json, json_game_data_member, fields);
+    }
+    if (json_key_equals(key, "actor")) {
+        fields->actor_id = 0;
+        fields->name.start = NULL;
+        return json_read_object(json, json_actor_member, fields);
+    }
+    if (json_key_equals(key, "eventData")) {
+        // the event type may only be known later, eventData is read after the root
+        fields->event_data = *json->pos == '{' ? json->pos : NULL;
+        return json_skip_value(json, 1);
+    }
+    return json_skip_value(json, 1);
+}
+
+static bool json_root_member (eso_json_t* json, eso_json_string_t* key, void* data) {
+    eso_json_fields_t* fields = data;
+    if (json_key_equals(key, "code"))
+        return json_read_string(json, &fields->code);
+    if (json_key_equals(key, "data")) {
+        fields->node.start = NULL;
+        fields->name.start = NULL;
+        fields->actor_id = 0;
+        fields->event_data = NULL;
+        return json_read_object(json, json_data_member, fields);
+    }
+    return json_skip_value(json, 0);
+}
+
+static bool json_track_member (eso_json_t* json, eso_json_string_t* key, void* data) {
+    eso_json_event_data_t* event_data = data;
+    if (json_key_equals(key, "id"))
+        return json_read_string(json, &event_data->track_id);
+    if (json_key_equals(key, "type"))
+        return json_read_string(json, &event_data->track_type);
+    return json_skip_value(json, 4);
+}
+
+static bool json_dice_member (eso_json_t* json, eso_json_string_t* key, void* data) {
+    eso_json_event_data_t* event_data = data;
+    if (json_key_equals(key, "num"))
+        return json_read_int(json, &event_data->num);
+    if (json_key_equals(key, "sides"))
+        return json_read_int(json, &event_data->sides);
+    return json_skip_value(json, 5);
+}
+
+/* Only the fields of the event type are read, the rest is skipped like json-c ignores it */
+static bool json_event_data_member (eso_json_t* json, eso_json_string_t* key, void* data) {
+    eso_json_event_data_t* event_data = data;
+    switch (event_data->type) {
+        case ESO_EVENT_CHAT:
+        case ESO_EVENT_BROADCAST:
+            if (json_key_equals(key, "message"))
+                return json_read_string(json, &event_data->message);
+            break;
+        case ESO_EVENT_TRY:
+            if (json_key_equals(key, "message"))
+                return json_read_string(json, &event_data->message);
+            if (json_key_equals(key, "success"))
+                return json_read_bool(json, &event_data->success);
+            break;
+        case ESO_EVENT_ROLL:
+            if (json_key_equals(key, "num"))
+                return json_read_int(json, &event_data->num);
+            break;
+        case ESO_EVENT_MEDIA_TRACK:
+            if (json_key_equals(key, "track")) {
+                event_data->track = *json->pos == '{' ? json->pos : NULL;
+                return json_skip_value(json, 3);
+            }
+            break;
+        case ESO_EVENT_DICE:
+            if (json_key_equals(key, "rolls")) {
+                event_data->rolls = *json->pos == '[' ? json->pos : NULL;
+                return json_skip_value(json, 3);
+            }
+            break;
+    }
+    return json_skip_value(json, 3);
+}
+
+static bool json_parse_dices (eso_json_t* json, eso_event_t* event, eso_json_event_data_t* event_data) {
+    eso_event_dice_t* dices = arena_alloc(event->arena, sizeof(eso_event_dice_t));
+    // the rolls were already validated while skipping, the first pass only counts them
+    size_t length = 0;
+    if (event_data->rolls != NULL) {
+        json->pos = event_data->rolls + 1;
+        while (!json_peek(json, ']')) {
+            json_skip_value(json, 4);
+            length++;
+            if (json_peek(json, ','))
+                json->pos++;
+        }
+    }
+    eso_dice_t* memory = arena_alloc(event->arena, sizeof(eso_dice_t) * length);
+    list_t* dice_list = arena_alloc(event->arena, sizeof(list_t));
+    dice_list->values = arena_alloc(event->arena, sizeof(eso_dice_t*) * length);
+    dice_list->size = 0;
+    dice_list->value_size = sizeof(eso_dice_t*);
+    dice_list->length = length;
+    if (length > 0)
+        json->pos = event_data->rolls + 1;
+    for (size_t i = 0; i < length; i++) {
+        event_data->num = 0;
+        event_data->sides = 0;
+        json_skip_space(json);
+        if (!json_read_object(json, json_dice_member, event_data))
+            return false;
+        eso_dice_t* dice = memory + i;
+        dice->num = event_data->num;
+        dice->sides = event_data->sides;
+        list_push(dice_list, dice);
+        if (json_peek(json, ','))
+            json->pos++;
+    }
+    dices->list = dice_list;
+    event->data = dices;
+    return true;
+}
+
+static bool json_parse_event_data (eso_json_t* json, eso_event_t* event, const char* start) {
+    eso_json_event_data_t event_data = {.type = event->event_type};
+    if (start != NULL) {
+        json->pos = start;
+        if (!json_parse_object(json, json_event_data_member, &event_data))
+            return false;
+    }
+    switch (event->event_type) {
+        case ESO_EVENT_CHAT: {
+            eso_event_chat_t* chat = arena_alloc(event->arena, sizeof(eso_event_chat_t));
+            chat->message = json_copy_string(event->arena, &event_data.message);
+            event->data = chat;
+            return chat->message != NULL;
+        }
+        case ESO_EVENT_BROADCAST: {
+            eso_event_broadcast_t* broadcast = arena_alloc(event->arena, sizeof(eso_event_broadcast_t));
+            broadcast->message = json_copy_string(event->arena, &event_data.message);
+            event->data = broadcast;
+            return broadcast->message != NULL;
+        }
+        case ESO_EVENT_TRY: {
+            eso_event_try_t* try = arena_alloc(event->arena, sizeof(eso_event_try_t));
+            try->message = json_copy_string(event->arena, &event_data.message);
+            try->success = event_data.success;
+            event->data = try;
+            return try->message != NULL;
+        }
+        case ESO_EVENT_ROLL: {
+            eso_event_roll_t* roll = arena_alloc(event->arena, sizeof(eso_event_roll_t));
+            roll->num = event_data.num;
+            event->data = roll;
+            return true;
+        }
+        case ESO_EVENT_MEDIA_TRACK: {
+            if (event_data.track != NULL) {
+                json->pos = event_data.track;
+                if (!json_parse_object(json, json_track_member, &event_data))
+                    return false;
+            }
+            eso_media_track_t* track = arena_alloc(event->arena, sizeof(eso_media_track_t));
+            track->id = json_copy_string(event->arena, &event_data.track_id);
+            track->type = json_copy_string(event->arena, &event_data.track_type);
+            event->data = track;
+            return track->id != NULL && track->type != NULL;
+        }
+        case ESO_EVENT_DICE:
+            return json_parse_dices(json, event, &event_data);
+    }
+    return true;
+}
+
+/*
+ * Parses the event object at *text and moves *text past it.
+ * Returns NULL without moving when the text has to go through json-c.
+ */
+eso_event_t* eso_json_parse_event (const char** text, const char* end) {
+    eso_json_t json = {*text, end};
+    eso_json_fields_t fields = {0};
+    if (!json_peek(&json, '{') || !json_parse_object(&json, json_root_member, &fields))
+        return NULL;
+    const char* object_end = json.pos;
+
+    eso_event_t* event = eso_event_create();
+    event->event_code = json_copy_string(event->arena, &fields.code);
+    event->actor.name = json_copy_string(event->arena, &fields.name);
+    event->game_data.node = json_copy_string(event->arena, &fields.node);
+    if (event->event_code == NULL || event->actor.name == NULL || event->game_data.node == NULL) {
+        eso_event_free(event);
+        return NULL;
+    }
+    event->event_type = match_event_name_to_constant(event->event_code);
+    event->actor.id = fields.actor_id;
+    if (!json_parse_event_data(&json, event, fields.event_data)) {
+        eso_event_free(event);
+        return NULL;
+    }
+    *text = object_end;
+    return event;
+}
@@ -0,0 +1,10 @@
+#ifndef NOTIFIER_ESO_JSON_H_HEADER
+#define NOTIFIER_ESO_JSON_H_HEADER
+
+#include "eso.h"
+
+#define ESO_JSON_MAX_DEPTH 64
+
+eso_event_t* eso_json_parse_event (const char** text, const char* end);
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include "eso.h"
+
+/*
+ * Registry of the known event types. Names resolve through a perfect hash: the seed is
+ * searched once at startup so that every registered name gets a slot of its own, a lookup
+ * is then one hash and one strcmp. A new type only needs a constant and a row below.
+ */
+
+#define ESO_TYPE_HASH_SIZE 64
+#define ESO_TYPE_SEED_TRIES 4096
+
+/* Formatters append to out, the file saver reuses one buffer for every line */
+void eso_format_chat (string_builder_t* out, eso_event_t* event) {
+    eso_event_chat_t* chat = (eso_event_chat_t*) event->data;
+    string_builder_append_printf(out, "[%d] %s: %s", event->actor.id, event->actor.name, chat->message);
+}
+
+void eso_format_broadcast (string_builder_t* out, eso_event_t* event) {
+    eso_event_broadcast_t* broadcast = (eso_event_broadcast_t*) event->data;
+    string_builder_append_printf(out, "Блютекст: %s", broadcast->message);
+}
+
+void eso_format_try (string_builder_t* out, eso_event_t* event) {
+    eso_event_try_t* try = (eso_event_try_t*) event->data;
+    string_builder_append_printf(out, "[%d] [try] %s: %s %s",
+                                 event->actor.id, event->actor.name, try->success ? "успешно" : "безуспешно",
+                                 try->message);
+}
+
+void eso_format_roll (string_builder_t* out, eso_event_t* event) {
+    eso_event_roll_t* roll = (eso_event_roll_t*) event->data;
+    string_builder_append_printf(out, "[%d] [roll] %s rolled %d", event->actor.id, event->actor.name, roll->num);
+}
+
+void eso_format_dice (string_builder_t* out, eso_event_t* event) {
+    eso_event_dice_t* dice_data = (eso_event_dice_t*)event->data;
+    string_builder_append_printf(out, "[%d] [dice] %s rolled ", event->actor.id, event->actor.name);
+    for (size_t i = 0; i < list_size(dice_data->list); i++) {
+        eso_dice_t* dice = list_get(dice_data->list, i, eso_dice_t*);
+        string_builder_append_printf(out, "%d/%d ", dice->num, dice->sides);
+    }
+}
+
+void eso_format_media_track (string_builder_t* out, eso_event_t* event) {
+    eso_media_track_t* media_event = (eso_media_track_t*) event->data;
+    string_builder_append_printf(out, "[%d] [yt-play] %s played ", event->actor.id, event->actor.name);
+    if (STREQUAL(media_event->type, "youtube"))
+        string_builder_append(out, "https://www.youtube.com/watch?v=");
+    string_builder_append(out, media_event->id);
+}
+
+void eso_format_disconnect (string_builder_t* out, eso_event_t* event) {
+    string_builder_append(out, "DISCONNECT");
+}
+
+static const eso_event_type_t eso_event_types[] = {
+    {ESO_EVENT_CHAT,        ESO_EVENT_NAME_CHAT,        &eso_parse_chat_event,          &eso_format_chat},
+    {ESO_EVENT_BROADCAST,   ESO_EVENT_NAME_BROADCAST,   &eso_parse_broadcast_event,     &eso_format_broadcast},
+    {ESO_EVENT_TRY,         ESO_EVENT_NAME_TRY,         &eso_parse_try_event,           &eso_format_try},
+    {ESO_EVENT_ROLL,        ESO_EVENT_NAME_ROLL,        &eso_parse_roll_event,          &eso_format_roll},
+    {ESO_EVENT_DICE,        ESO_EVENT_NAME_DICE,        &eso_parse_dice_event,          &eso_format_dice},
+    {ESO_EVENT_MEDIA_TRACK, ESO_EVENT_NAME_MEDIA_TRACK, &eso_parse_media_track_event,   &eso_format_media_track},
+    {ESO_EVENT_DISCONNECT,  ESO_EVENT_NAME_DISCONNECT,  NULL,                           &eso_format_disconnect},
+};
+#define ESO_EVENT_TYPES_COUNT (sizeof(eso_event_types) / sizeof(eso_event_types[0]))
+
+static const eso_event_type_t* eso_type_slots[ESO_TYPE_HASH_SIZE];
+static const eso_event_type_t* eso_type_by_id[ESO_EVENT_TYPES_MAX];
+static uint32_t eso_type_seed;
+
+/* FNV-1a with the seed as the offset basis */
+static uint32_t eso_type_hash (const char* name, uint32_t seed) {
+    uint32_t hash = seed;
+    for (; *name != '\0'; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash & (ESO_TYPE_HASH_SIZE - 1);
+}
+
+int eso_event_types_init () {
+    for (size_t i = 0; i < ESO_EVENT_TYPES_COUNT; i++) {
+        int type = eso_event_types[i].type;
+        if (type <= 0 || type >= ESO_EVENT_TYPES_MAX || eso_type_by_id[type] != NULL) {
+            printf("event type %d of \"%s\" does not fit the registry\n", type, eso_event_types[i].name);
+            return -1;
+        }
+        eso_type_by_id[type] = &eso_event_types[i];
+    }
+    for (uint32_t seed = 2166136261u; seed < 2166136261u + ESO_TYPE_SEED_TRIES; seed++) {
+        memset(eso_type_slots, 0, sizeof(eso_type_slots));
+        size_t placed = 0;
+        for (; placed < ESO_EVENT_TYPES_COUNT; placed++) {
+            uint32_t slot = eso_type_hash(eso_event_types[placed].name, seed);
+            if (eso_type_slots[slot] != NULL)
+                break;
+            eso_type_slots[slot] = &eso_event_types[placed];
+        }
+        if (placed == ESO_EVENT_TYPES_COUNT) {
+            eso_type_seed = seed;
+            return 0;
+        }
+    }
+    printf("no perfect hash for %zu event types, grow ESO_TYPE_HASH_SIZE\n", ESO_EVENT_TYPES_COUNT);
+    return -1;
+}
+
+const eso_event_type_t* eso_event_type_get (int type) {
+    if (type <= 0 || type >= ESO_EVENT_TYPES_MAX)
+        return NULL;
+    return eso_type_by_id[type];
+}
+
+int match_event_name_to_constant (const char* name) {
+    const eso_event_type_t* type = eso_type_slots[eso_type_hash(name, eso_type_seed)];
+    if (type != NULL && STREQUAL(type->name, name))
+        return type->type;
+    return ESO_EVENT_UNEXPECTED;
+}
+
+/* "[node] " followed by the type's own format */
+void eso_event_format_append (string_builder_t* out, eso_event_t* event) {
+    string_builder_append_printf(out, "[%s] ", event->game_data.node);
+    const eso_event_type_t* type = eso_event_type_get(event->event_type);
+    if (type != NULL && type->format != NULL)
+        type->format(out, event);
+    else
+        string_builder_append_printf(out, "unimplemented event \'%s\'", event->event_code);
+}
+
+string_builder_t* eso_event_format (eso_event_t* event) {
+    string_builder_t* result = string_builder_create(128);
+    eso_event_format_append(result, event);
+    return result;
+}
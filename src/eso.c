@@ -1,30 +1,46 @@
+#include <ctype.h>
 #include <json.h>
 #include "eso.h"
+#include "eso-json.h"
 
-eso_command_t* eso_command_create (int command_type, void* data, ref_counter_t* ref_counter) {
-    eso_command_t* command = MALLOC_STRUCT(eso_command_t);
+/* Missing fields become empty strings, handlers never see NULL names */
+char* json_object_dup_string (arena_t* arena, json_object* obj) {
+    const char* value = json_object_get_string(obj);
+    return arena_strdup(arena, value != NULL ? value : "");
+}
+
+/* The command lives in the arena holding its data, NULL creates a new one */
+eso_command_t* eso_command_create (int command_type, void* data, arena_t* arena) {
+    if (arena == NULL)
+        arena = arena_create();
+    eso_command_t* command = arena_alloc(arena, sizeof(eso_command_t));
     command->type = command_type;
     command->data = data;
-    command->ref = ref_counter;
+    command->arena = arena;
+    command->next = NULL;
     return command;
 }
 
 void eso_command_free (eso_command_t* command) {
-    if (command->ref != NULL)
-        ref_counter_free(command->ref);
-    free(command);
+    arena_release(command->arena);
 }
 
-void eso_command_list_free (list_t* command_list) {
-    for (size_t i = 0; i < list_size(command_list); i++)
-        eso_command_free(list_get(command_list, i, eso_command_t*));
+/* Frees a whole chain linked through next */
+void eso_command_list_free (eso_command_t* commands) {
+    while (commands != NULL) {
+        eso_command_t* next = commands->next;
+        eso_command_free(commands);
+        commands = next;
+    }
 }
 
-string_builder_t* eso_command_list_to_json (list_t* command_list) {
+string_builder_t* eso_command_list_to_json (eso_command_t* commands) {
+    // the usual answer to a poll, no need for a json tree
+    if (commands == NULL)
+        return string_builder_copy("{\"commands\":[]}");
     json_object* list_obj = json_object_new_array();
-    for (size_t i = 0; i < list_size(command_list); i++) {
+    for (eso_command_t* cmd = commands; cmd != NULL; cmd = cmd->next) {
         json_object* cmd_obj = json_object_new_object();
-        eso_command_t* cmd = list_get(command_list, i, eso_command_t*);
         if (cmd->type == ESO_CMD_SEND_MESSAGE) {
             eso_send_message_command_t* msg = (eso_send_message_command_t*) cmd->data;
             json_object_object_add(cmd_obj, "type", json_object_new_string(ESO_CMD_SEND_MESSAGE_NAME));
@@ -34,8 +50,10 @@ string_builder_t* eso_command_list_to_json (list_t* command_list) {
         }
         else if (cmd->type == ESO_CMD_RECONNECT)
             json_object_object_add(cmd_obj, "type", json_object_new_string(ESO_CMD_RECONNECT_NAME));
-        else
+        else {
             json_object_put(cmd_obj);
+            continue;
+        }
         json_object_array_add(list_obj, cmd_obj);
     }
     json_object* root = json_object_new_object();
@@ -47,65 +65,52 @@ string_builder_t* eso_command_list_to_json (list_t* command_list) {
 }
 
 
+/* Everything of an event, the event itself included, is allocated from its arena */
 eso_event_t* eso_event_create () {
-    eso_event_t* event = MALLOC_STRUCT(eso_event_t);
+    arena_t* arena = arena_create();
+    eso_event_t* event = arena_alloc(arena, sizeof(eso_event_t));
     event->event_code = NULL;
     event->event_type = ESO_EVENT_UNEXPECTED;
     event->data = NULL;
-    event->rc = ref_counter_create();
+    event->arena = arena;
+    atomic_init(&event->refs, 1);
     return event;
 }
 
 void eso_event_free (eso_event_t* event) {
-    ref_counter_free(event->rc);
-    free(event);
-}
-
-int match_event_name_to_constant (const char* name) {
-    if (STREQUAL(name, ESO_EVENT_NAME_CHAT))
-        return ESO_EVENT_CHAT;
-    else if (STREQUAL(name, ESO_EVENT_NAME_BROADCAST))
-        return ESO_EVENT_BROADCAST;
-    else if (STREQUAL(name, ESO_EVENT_NAME_TRY))
-        return ESO_EVENT_TRY;
-    else if (STREQUAL(name, ESO_EVENT_NAME_ROLL))
-        return ESO_EVENT_ROLL;
-    else if (STREQUAL(name, ESO_EVENT_NAME_DICE))
-        return ESO_EVENT_DICE;
-    else if (STREQUAL(name, ESO_EVENT_NAME_MEDIA_TRACK))
-        return ESO_EVENT_MEDIA_TRACK;
-    else if (STREQUAL(name, ESO_EVENT_NAME_DISCONNECT))
-        return ESO_EVENT_DISCONNECT;
-    else
-        return ESO_EVENT_UNEXPECTED;
+    arena_release(event->arena);
+}
+
+/* Events are shared by the handler queues, the last release frees them */
+void eso_event_retain (eso_event_t* event) {
+    atomic_fetch_add(&event->refs, 1);
+}
+
+void eso_event_release (eso_event_t* event) {
+    if (atomic_fetch_sub(&event->refs, 1) == 1)
+        eso_event_free(event);
 }
 
 void* eso_parse_chat_event (eso_event_t* event, json_object* event_data) {
     json_object* message_obj = json_object_object_get(event_data, "message");
-    eso_event_chat_t* chat = MALLOC_STRUCT(eso_event_chat_t);
-    chat->message = strdup(json_object_get_string(message_obj));
-    ref_counter_add(event->rc, chat);
-    ref_counter_add(event->rc, chat->message);
+    eso_event_chat_t* chat = arena_alloc(event->arena, sizeof(eso_event_chat_t));
+    chat->message = json_object_dup_string(event->arena, message_obj);
     return (void*)chat;
 }
 
 void* eso_parse_try_event (eso_event_t* event, json_object* event_data) {
     json_object* message_obj = json_object_object_get(event_data, "message");
     json_object* success_obj = json_object_object_get(event_data, "success");
-    eso_event_try_t* try = MALLOC_STRUCT(eso_event_try_t);
-    try->message = strdup(json_object_get_string(message_obj));
+    eso_event_try_t* try = arena_alloc(event->arena, sizeof(eso_event_try_t));
+    try->message = json_object_dup_string(event->arena, message_obj);
     try->success = json_object_get_boolean(success_obj);
-    ref_counter_add(event->rc, try);
-    ref_counter_add(event->rc, try->message);
     return (void*)try;
 }
 
 void* eso_parse_broadcast_event (eso_event_t* event, json_object* event_data) {
     json_object* message_obj = json_object_object_get(event_data, "message");
-    eso_event_broadcast_t* broadcast = MALLOC_STRUCT(eso_event_broadcast_t);
-    broadcast->message = strdup(json_object_get_string(message_obj));
-    ref_counter_add(event->rc, broadcast);
-    ref_counter_add(event->rc, broadcast->message);
+    eso_event_broadcast_t* broadcast = arena_alloc(event->arena, sizeof(eso_event_broadcast_t));
+    broadcast->message = json_object_dup_string(event->arena, message_obj);
     return (void*)broadcast;
 }
 
@@ -113,71 +118,54 @@ void* eso_parse_media_track_event (eso_event_t* event, json_object* event_data)
     json_object* track_obj = json_object_object_get(event_data, "track");
     json_object* id_obj = json_object_object_get(track_obj, "id");
     json_object* type_obj = json_object_object_get(track_obj, "type");
-    eso_media_track_t* track = MALLOC_STRUCT(eso_media_track_t);
-    track->id = strdup(json_object_get_string(id_obj));
-    track->type = strdup(json_object_get_string(type_obj));
-    ref_counter_add(event->rc, track);
-    ref_counter_add(event->rc, track->type);
-    ref_counter_add(event->rc, track->id);
+    eso_media_track_t* track = arena_alloc(event->arena, sizeof(eso_media_track_t));
+    track->id = json_object_dup_string(event->arena, id_obj);
+    track->type = json_object_dup_string(event->arena, type_obj);
     return (void*)track;
 }
 
 void* eso_parse_roll_event (eso_event_t* event, json_object* event_data) {
     json_object* message_obj = json_object_object_get(event_data, "num");
-    eso_event_roll_t* roll = MALLOC_STRUCT(eso_event_roll_t);
+    eso_event_roll_t* roll = arena_alloc(event->arena, sizeof(eso_event_roll_t));
     roll->num = json_object_get_int(message_obj);
-    ref_counter_add(event->rc, roll);
     return (void*)roll;
 }
 
 void* eso_parse_dice_event (eso_event_t* event, json_object* event_data) {
     json_object* dices_obj = json_object_object_get(event_data, "rolls");
-    eso_event_dice_t* dices = MALLOC_STRUCT(eso_event_dice_t);
-    size_t length = json_object_array_length(dices_obj);
-    void* memory = malloc(sizeof(eso_dice_t) * length);
-    list_t* dice_list = list_create_sized(eso_dice_t*, length);
+    eso_event_dice_t* dices = arena_alloc(event->arena, sizeof(eso_event_dice_t));
+    // json_object_array_length asserts on anything but an array
+    size_t length = json_object_is_type(dices_obj, json_type_array) ? json_object_array_length(dices_obj) : 0;
+    eso_dice_t* memory = arena_alloc(event->arena, sizeof(eso_dice_t) * length);
+    // a fixed list over arena memory, nothing is pushed to it later
+    list_t* dice_list = arena_alloc(event->arena, sizeof(list_t));
+    dice_list->values = arena_alloc(event->arena, sizeof(eso_dice_t*) * length);
+    dice_list->size = 0;
+    dice_list->value_size = sizeof(eso_dice_t*);
+    dice_list->length = length;
     for (size_t i = 0; i < length; i++) {
         json_object* dice_obj = json_object_array_get_idx(dices_obj, i);
         json_object* num_obj = json_object_object_get(dice_obj, "num");
         json_object* sides_obj = json_object_object_get(dice_obj, "sides");
 
-        eso_dice_t* dice = memory + i * sizeof(eso_dice_t);
+        eso_dice_t* dice = memory + i;
         dice->num = json_object_get_int(num_obj);
         dice->sides = json_object_get_int(sides_obj);
         list_push(dice_list, dice);
     }
     dices->list = dice_list;
-
-    ref_counter_add(event->rc, dices);
-    ref_counter_add(event->rc, dice_list->values);
-    ref_counter_add(event->rc, dice_list);
-    ref_counter_add(event->rc, memory);
     return (void*)dices;
 }
 
 void* parse_event_data (eso_event_t* event, json_object* event_data) {
-    switch (event->event_type) {
-        case ESO_EVENT_CHAT:
-            return eso_parse_chat_event(event, event_data);
-        case ESO_EVENT_TRY:
-            return eso_parse_try_event(event, event_data);
-        case ESO_EVENT_BROADCAST:
-            return eso_parse_broadcast_event(event, event_data);
-        case ESO_EVENT_MEDIA_TRACK:
-            return eso_parse_media_track_event(event, event_data);
-        case ESO_EVENT_ROLL:
-            return eso_parse_roll_event(event, event_data);
-        case ESO_EVENT_DICE:
-            return eso_parse_dice_event(event, event_data);
-        case ESO_EVENT_DISCONNECT:
-            return NULL;
-    }
-    return NULL;
+    const eso_event_type_t* type = eso_event_type_get(event->event_type);
+    if (type == NULL || type->parse == NULL)
+        return NULL;
+    return type->parse(event, event_data);
 }
 
-eso_event_t* parse_eso_event (char* text) {
-    json_object *root = json_tokener_parse(text);
-    if (!root)
+eso_event_t* eso_event_from_json (json_object* root) {
+    if (!json_object_is_type(root, json_type_object))
         return NULL;
 
     eso_event_t* event = eso_event_create();
@@ -191,19 +179,139 @@ eso_event_t* parse_eso_event (char* text) {
     json_object* actor_name_obj = json_object_object_get(actor_obj, "name");
     json_object* event_data_obj = json_object_object_get(data_obj, "eventData");
 
-    const char* event_code = strdup(json_object_get_string(code_obj));
-    event->event_type = match_event_name_to_constant(event_code);
+    event->event_code = json_object_dup_string(event->arena, code_obj);
+    event->event_type = match_event_name_to_constant(event->event_code);
     event->actor.id = json_object_get_int(actor_id_obj);
-    event->actor.name = strdup(json_object_get_string(actor_name_obj));
-    event->game_data.node = strdup(json_object_get_string(node_code_obj));
-
-    ref_counter_add(event->rc, event_code);
-    ref_counter_add(event->rc, event->actor.name);
-    ref_counter_add(event->rc, event->game_data.node);
+    event->actor.name = json_object_dup_string(event->arena, actor_name_obj);
+    event->game_data.node = json_object_dup_string(event->arena, node_code_obj);
 
     event->data = parse_event_data(event, event_data_obj);
 
-    json_object_put(root);
+    return event;
+}
+
+/* Known events take the schema parser, anything else goes through a json-c tree */
+eso_event_t* parse_eso_event (char* text) {
+    const char* end = text + strlen(text);
+    const char* pos = text;
+    eso_event_t* event = eso_json_parse_event(&pos, end);
+    if (event != NULL) {
+        while (pos < end && isspace((unsigned char)*pos))
+            pos++;
+        if (pos == end)
+            return event;
+        eso_event_release(event);
+    }
 
+    json_object *root = json_tokener_parse(text);
+    if (!root)
+        return NULL;
+    event = eso_event_from_json(root);
+    json_object_put(root);
     return event;
-}
\ No newline at end of file
+}
+
+/* Fills events from a JSON array with the schema parser, false leaves the list empty */
+bool parse_eso_event_array (const char* text, const char* end, list_t* events) {
+    const char* pos = text + 1;
+    while (pos < end) {
+        while (pos < end && isspace((unsigned char)*pos))
+            pos++;
+        if (pos < end && *pos == ']' && list_size(events) == 0)
+            return true;
+        eso_event_t* event = eso_json_parse_event(&pos, end);
+        if (event == NULL)
+            break;
+        list_push(events, event);
+        while (pos < end && isspace((unsigned char)*pos))
+            pos++;
+        if (pos < end && *pos == ',') {
+            pos++;
+            continue;
+        }
+        if (pos < end && *pos == ']') {
+            pos++;
+            while (pos < end && isspace((unsigned char)*pos))
+                pos++;
+            if (pos == end)
+                return true;
+        }
+        break;
+    }
+    for (size_t i = 0; i < list_size(events); i++)
+        eso_event_release(list_get(events, i, eso_event_t*));
+    list_clear(events);
+    return false;
+}
+
+/*
+ * Accepts a JSON array of events or one event per line.
+ * The list keeps the order of the input, items that failed to parse are NULL.
+ */
+list_t* parse_eso_event_batch (char* text, size_t length) {
+    list_t* events = list_create(eso_event_t*);
+    size_t start = 0;
+    while (start < length && isspace((unsigned char)text[start]))
+        start++;
+
+    if (start < length && text[start] == '[') {
+        if (parse_eso_event_array(text + start, text + length, events))
+            return events;
+        json_object* root = json_tokener_parse(text + start);
+        if (!json_object_is_type(root, json_type_array)) {
+            // the whole batch is unreadable
+            json_object_put(root);
+            list_push(events, NULL);
+            return events;
+        }
+        for (size_t i = 0; i < json_object_array_length(root); i++)
+            list_push(events, eso_event_from_json(json_object_array_get_idx(root, i)));
+        json_object_put(root);
+        return events;
+    }
+
+    char* line = text + start;
+    char* end = text + length;
+    while (line < end) {
+        char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL)
+            line_end = end;
+        *line_end = '\0';
+        char* c = line;
+        while (c < line_end && isspace((unsigned char)*c))
+            c++;
+        if (c < line_end)
+            list_push(events, parse_eso_event(line));
+        line = line_end + 1;
+    }
+    return events;
+}
+
+void eso_event_list_free (list_t* events) {
+    for (size_t i = 0; i < list_size(events); i++) {
+        eso_event_t* event = list_get(events, i, eso_event_t*);
+        if (event != NULL)
+            eso_event_release(event);
+    }
+    list_free(events);
+}
+
+/* {"accepted":2,"failed":1,"status":["ok","error","ok"]} in the order of the batch */
+string_builder_t* eso_event_batch_status_to_json (list_t* events) {
+    json_object* status_obj = json_object_new_array();
+    int accepted = 0;
+    for (size_t i = 0; i < list_size(events); i++) {
+        bool ok = list_get(events, i, eso_event_t*) != NULL;
+        if (ok)
+            accepted++;
+        json_object_array_add(status_obj, json_object_new_string(ok ? "ok" : "error"));
+    }
+    json_object* root = json_object_new_object();
+    json_object_object_add(root, "accepted", json_object_new_int(accepted));
+    json_object_object_add(root, "failed", json_object_new_int((int)list_size(events) - accepted));
+    json_object_object_add(root, "status", status_obj);
+    const char* export = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN);
+    string_builder_t* result = string_builder_copy(export);
+    json_object_put(root);
+    return result;
+}
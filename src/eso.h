@@ -1,6 +1,7 @@
 #ifndef NOTIFIER_ESO_H_HEADER
 #define NOTIFIER_ESO_H_HEADER
 
+#include <stdatomic.h>
 #include "util.h"
 #include "main.h"
 
@@ -21,6 +22,11 @@
 #define ESO_EVENT_MEDIA_TRACK   6
 #define ESO_EVENT_DISCONNECT    7
 
+/* Type constants index a 32 bit subscription mask, unexpected events take bit 0 */
+#define ESO_EVENT_TYPES_MAX     32
+#define ESO_EVENT_MASK(type)    ((type) > 0 && (type) < ESO_EVENT_TYPES_MAX ? 1u << (type) : 1u)
+#define ESO_EVENT_MASK_ALL      0xffffffffu
+
 #define ESO_CMD_SEND_MESSAGE    1
 #define ESO_CMD_RECONNECT       2
 
@@ -30,7 +36,8 @@
 typedef struct eso_command {
     int type;
     void* data;
-    ref_counter_t* ref;
+    arena_t* arena;
+    eso_command_t* next;
 } eso_command_t;
 
 typedef struct eso_send_message_command {
@@ -52,7 +59,8 @@ typedef struct eso_event {
     void* data;
     eso_event_game_data_t game_data;
     eso_event_actor_t actor;
-    ref_counter_t* rc;
+    arena_t* arena;
+    atomic_int refs;
 } eso_event_t;
 
 typedef struct eso_media_track {
@@ -88,15 +96,45 @@ typedef struct eso_event_broadcast {
 
 typedef struct eso_event_disconnect eso_event_disconnect_t;
 
-eso_command_t* eso_command_create (int command_type, void* data, ref_counter_t* ref_counter);
+struct json_object;
+typedef void*(*eso_event_parse_fun)(eso_event_t* event, struct json_object* event_data);
+typedef void(*eso_event_format_fun)(string_builder_t* out, eso_event_t* event);
+
+typedef struct eso_event_type {
+    int type;
+    const char* name;
+    eso_event_parse_fun parse;
+    eso_event_format_fun format;
+} eso_event_type_t;
+
+int eso_event_types_init ();
+const eso_event_type_t* eso_event_type_get (int type);
+int match_event_name_to_constant (const char* name);
+void eso_event_format_append (string_builder_t* out, eso_event_t* event);
+string_builder_t* eso_event_format (eso_event_t* event);
+
+void* eso_parse_chat_event (eso_event_t* event, struct json_object* event_data);
+void* eso_parse_try_event (eso_event_t* event, struct json_object* event_data);
+void* eso_parse_broadcast_event (eso_event_t* event, struct json_object* event_data);
+void* eso_parse_media_track_event (eso_event_t* event, struct json_object* event_data);
+void* eso_parse_roll_event (eso_event_t* event, struct json_object* event_data);
+void* eso_parse_dice_event (eso_event_t* event, struct json_object* event_data);
+
+eso_command_t* eso_command_create (int command_type, void* data, arena_t* arena);
 void eso_command_free (eso_command_t* command);
-void eso_command_list_free (list_t* command_list);
-string_builder_t* eso_command_list_to_json (list_t* command_list);
+void eso_command_list_free (eso_command_t* commands);
+string_builder_t* eso_command_list_to_json (eso_command_t* commands);
 
 eso_event_t* eso_event_create ();
 void eso_event_free (eso_event_t* event);
+void eso_event_retain (eso_event_t* event);
+void eso_event_release (eso_event_t* event);
 
+eso_event_t* eso_event_from_json (struct json_object* root);
 eso_event_t* parse_eso_event (char* text);
+list_t* parse_eso_event_batch (char* text, size_t length);
+void eso_event_list_free (list_t* events);
+string_builder_t* eso_event_batch_status_to_json (list_t* events);
 
 /*typedef struct eso_event_media_player {
     eso_media_track_t track;
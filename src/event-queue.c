@@ -0,0 +1,177 @@
+#include "event-queue.h"
+#include "eso.h"
+#include "config.h"
+
+/* name also prefixes the config keys: <name>_queue_depth, <name>_queue_policy and <name>_events */
+event_handler_t* event_handler_create (const char* name, event_handler_fun event, uint32_t subscriptions,
+                                       int default_policy) {
+    event_handler_t* handler = MALLOC_STRUCT(event_handler_t);
+    handler->event = event;
+    handler->name = name;
+    handler->subscriptions = subscriptions;
+    handler->policy = default_policy;
+    handler->queue = NULL;
+    handler->queue_depth = 0;
+    handler->queue_head = 0;
+    handler->queue_count = 0;
+    handler->dropped = 0;
+    handler->enqueued = 0;
+    handler->running = false;
+    handler->global_ctx = NULL;
+    mutex_init(&handler->mutex);
+    pthread_cond_init(&handler->not_empty, NULL);
+    pthread_cond_init(&handler->not_full, NULL);
+    return handler;
+}
+
+void event_handler_free (event_handler_t* handler) {
+    free(handler->queue);
+    mutex_free(&handler->mutex);
+    pthread_cond_destroy(&handler->not_empty);
+    pthread_cond_destroy(&handler->not_full);
+    free(handler);
+}
+
+void* event_handler_worker (void* _handler) {
+    event_handler_t* handler = (event_handler_t*)_handler;
+    while (true) {
+        mutex_lock(&handler->mutex);
+        while (handler->queue_count == 0 && handler->running)
+            pthread_cond_wait(&handler->not_empty, &handler->mutex);
+        // stopping still drains whatever was queued
+        if (handler->queue_count == 0) {
+            mutex_unlock(&handler->mutex);
+            break;
+        }
+        eso_event_t* event = handler->queue[handler->queue_head];
+        handler->queue_head = (handler->queue_head + 1) % handler->queue_depth;
+        handler->queue_count--;
+        pthread_cond_signal(&handler->not_full);
+        mutex_unlock(&handler->mutex);
+
+        handler->event(handler->global_ctx, event);
+        eso_event_release(event);
+    }
+    return NULL;
+}
+
+/* "chat, tryMessage" subscribes to just these types */
+uint32_t event_handler_parse_subscriptions (const char* handler_name, const char* value) {
+    uint32_t mask = 0;
+    char name[64];
+    while (*value != '\0') {
+        size_t length = strcspn(value, ", ");
+        if (length > 0 && length < sizeof(name)) {
+            memcpy(name, value, length);
+            name[length] = '\0';
+            int type = match_event_name_to_constant(name);
+            if (type == ESO_EVENT_UNEXPECTED)
+                printf("\"%s\" handler: unknown event type \"%s\"\n", handler_name, name);
+            else
+                mask |= ESO_EVENT_MASK(type);
+        }
+        value += length;
+        value += strspn(value, ", ");
+    }
+    return mask;
+}
+
+int event_handler_start (global_ctx_t* ctx, event_handler_t* handler) {
+    char key[64];
+    snprintf(key, sizeof(key), "%s_events", handler->name);
+    const char* events = config_get_value(ctx->config, key);
+    if (events != NULL)
+        handler->subscriptions = event_handler_parse_subscriptions(handler->name, events);
+    snprintf(key, sizeof(key), "%s_queue_depth", handler->name);
+    long depth = config_get_long(ctx->config, key, EVENT_QUEUE_DEFAULT_DEPTH);
+    snprintf(key, sizeof(key), "%s_queue_policy", handler->name);
+    const char* policy = config_get_value(ctx->config, key);
+    if (policy != NULL && STREQUAL(policy, "drop"))
+        handler->policy = EVENT_POLICY_DROP;
+    else if (policy != NULL && STREQUAL(policy, "block"))
+        handler->policy = EVENT_POLICY_BLOCK;
+
+    handler->global_ctx = ctx;
+    handler->queue_depth = depth < 1 ? 1 : depth;
+    handler->queue = malloc(sizeof(eso_event_t*) * handler->queue_depth);
+    handler->running = true;
+    if (pthread_create(&handler->thread, NULL, &event_handler_worker, (void*)handler) != 0) {
+        printf("couldn't start \"%s\" event handler\n", handler->name);
+        handler->running = false;
+        return -1;
+    }
+    return 0;
+}
+
+/* Takes over one reference of the event, a full queue blocks the caller or drops the event */
+void event_handler_enqueue (event_handler_t* handler, eso_event_t* event) {
+    mutex_lock(&handler->mutex);
+    while (handler->queue_count == handler->queue_depth && handler->running
+           && handler->policy == EVENT_POLICY_BLOCK)
+        pthread_cond_wait(&handler->not_full, &handler->mutex);
+    if (!handler->running) {
+        mutex_unlock(&handler->mutex);
+        eso_event_release(event);
+        return;
+    }
+    if (handler->queue_count == handler->queue_depth) {
+        size_t dropped = ++handler->dropped;
+        mutex_unlock(&handler->mutex);
+        if (dropped == 1 || dropped % 100 == 0)
+            printf("\"%s\" event queue is full, %ld events dropped\n", handler->name, dropped);
+        eso_event_release(event);
+        return;
+    }
+    handler->queue[(handler->queue_head + handler->queue_count) % handler->queue_depth] = event;
+    handler->queue_count++;
+    handler->enqueued++;
+    pthread_cond_signal(&handler->not_empty);
+    mutex_unlock(&handler->mutex);
+}
+
+uint64_t event_handler_enqueued (event_handler_t* handler) {
+    mutex_lock(&handler->mutex);
+    uint64_t enqueued = handler->enqueued;
+    mutex_unlock(&handler->mutex);
+    return enqueued;
+}
+
+/* Returns once every queued event was handled */
+void event_handler_stop (event_handler_t* handler) {
+    mutex_lock(&handler->mutex);
+    bool was_running = handler->running;
+    handler->running = false;
+    pthread_cond_broadcast(&handler->not_empty);
+    pthread_cond_broadcast(&handler->not_full);
+    mutex_unlock(&handler->mutex);
+    if (was_running)
+        pthread_join(handler->thread, NULL);
+}
+
+/* Handlers not subscribed to the type never see the event */
+void event_handlers_eso_event (global_ctx_t* ctx, eso_event_t* eso_event) {
+    uint32_t mask = ESO_EVENT_MASK(eso_event->event_type);
+    for (size_t i = 0; i < list_size(ctx->event_handlers); i++) {
+        event_handler_t* handler = list_get(ctx->event_handlers, i, event_handler_t*);
+        if ((handler->subscriptions & mask) == 0)
+            continue;
+        eso_event_retain(eso_event);
+        event_handler_enqueue(handler, eso_event);
+    }
+}
+
+int event_handlers_start (global_ctx_t* ctx) {
+    for (size_t i = 0; i < list_size(ctx->event_handlers); i++)
+        if (event_handler_start(ctx, list_get(ctx->event_handlers, i, event_handler_t*)) != 0)
+            return -1;
+    return 0;
+}
+
+void event_handlers_stop (global_ctx_t* ctx) {
+    for (size_t i = 0; i < list_size(ctx->event_handlers); i++) {
+        event_handler_t* handler = list_get(ctx->event_handlers, i, event_handler_t*);
+        event_handler_stop(handler);
+        event_handler_free(handler);
+    }
+    list_clear(ctx->event_handlers);
+}
@@ -0,0 +1,14 @@
+#ifndef NOTIFIER_EVENT_QUEUE_H_HEADER
+#define NOTIFIER_EVENT_QUEUE_H_HEADER
+
+#include "main.h"
+
+event_handler_t* event_handler_create (const char* name, event_handler_fun event, uint32_t subscriptions,
+                                       int default_policy);
+void event_handler_free (event_handler_t* handler);
+int event_handler_start (global_ctx_t* ctx, event_handler_t* handler);
+void event_handler_enqueue (event_handler_t* handler, eso_event_t* event);
+uint64_t event_handler_enqueued (event_handler_t* handler);
+void event_handler_stop (event_handler_t* handler);
+
+#endif
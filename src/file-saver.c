@@ -1,9 +1,13 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include "file-saver.h"
-#include "telegram.h"
+#include "eso.h"
 #include "util.h"
 #include "config.h"
+#include "event-queue.h"
+
+void* file_saver_writer (void* _ctx);
 
 int file_saver_init (file_saver_ctx_t* ctx, global_ctx_t* global) {
     ctx->global_ctx = global;
@@ -34,54 +38,619 @@ int file_saver_init (file_saver_ctx_t* ctx, global_ctx_t* global) {
     }
 
     ctx->log_dir = log_dir;
+    ctx->handler = NULL;
+
+    const char* sync = config_get_value(global->config, "file_sync");
+    if (sync == NULL || STREQUAL(sync, "group"))
+        ctx->sync_mode = FILE_SYNC_GROUP;
+    else if (STREQUAL(sync, "strict"))
+        ctx->sync_mode = FILE_SYNC_STRICT;
+    else if (STREQUAL(sync, "none"))
+        ctx->sync_mode = FILE_SYNC_NONE;
+    else {
+        printf("unknown file_sync mode \"%s\"\n", sync);
+        return -1;
+    }
+    ctx->sync_window = config_get_long(global->config, "file_sync_window", FILE_SYNC_DEFAULT_WINDOW);
+    ctx->sync_events = config_get_long(global->config, "file_sync_events", FILE_SYNC_DEFAULT_EVENTS);
+    if (ctx->sync_window < 0)
+        ctx->sync_window = 0;
+    if (ctx->sync_events < 1)
+        ctx->sync_events = 1;
+
+    const char* compress = config_get_value(global->config, "file_compress");
+    ctx->archive = NULL;
+    if (compress == NULL || STREQUAL(compress, "gzip"))
+        ctx->archive = log_archive_create(string_builder_as_cstring(log_dir));
+    else if (!STREQUAL(compress, "none")) {
+        printf("unknown file_compress mode \"%s\"\n", compress);
+        return -1;
+    }
+    const char* partition = config_get_value(global->config, "file_partition");
+    if (partition == NULL || STREQUAL(partition, "none"))
+        ctx->partition = FILE_PARTITION_NONE;
+    else if (STREQUAL(partition, "node"))
+        ctx->partition = FILE_PARTITION_NODE;
+    else if (STREQUAL(partition, "actor"))
+        ctx->partition = FILE_PARTITION_ACTOR;
+    else {
+        printf("unknown file_partition mode \"%s\"\n", partition);
+        return -1;
+    }
+    ctx->part_fds_max = config_get_long(global->config, "file_partition_fds", FILE_PARTITION_DEFAULT_FDS);
+    if (ctx->part_fds_max < 1)
+        ctx->part_fds_max = 1;
+    ctx->part_fds = list_create(file_saver_fd_t*);
+    ctx->part_clock = 0;
+    const char* io = config_get_value(global->config, "file_io");
+    ctx->uring = NULL;
+    if (io == NULL || STREQUAL(io, "uring")) {
+        ctx->uring = file_uring_create(FILE_URING_ENTRIES);
+        if (ctx->uring == NULL && io != NULL)
+            printf("io_uring is not available, log files are written with write()\n");
+    }
+    else if (!STREQUAL(io, "sync")) {
+        printf("unknown file_io mode \"%s\"\n", io);
+        return -1;
+    }
+    ctx->ops = list_create(file_uring_op_t);
+    ctx->journal = config_get_long(global->config, "file_journal", 1) != 0;
+    // numbering goes on from the newest journal
+    ctx->journal_seq = ctx->journal ? journal_recover(string_builder_as_cstring(log_dir)) : 0;
+    ctx->history = ctx->journal ? history_create(string_builder_as_cstring(log_dir)) : NULL;
+    ctx->search = NULL;
+    if (ctx->journal && config_get_long(global->config, "search_index", 1) != 0)
+        ctx->search = search_index_open(string_builder_as_cstring(log_dir));
+
+    ctx->day_end = 0;
+    ctx->minute_end = 0;
+    ctx->minute[0] = '\0';
+    ctx->day[0] = '\0';
+    ctx->fd = -1;
+    ctx->journal_fd = -1;
+    ctx->journal_size = 0;
+    ctx->fd_day_end = 0;
+    for (int i = 0; i < 2; i++) {
+        ctx->buffers[i].lines = string_builder_create(FILE_SAVER_LINE_SIZE);
+        ctx->buffers[i].records = string_builder_create(FILE_SAVER_LINE_SIZE);
+        ctx->buffers[i].parts = list_create(file_saver_part_t*);
+        ctx->buffers[i].events = 0;
+    }
+    ctx->active = &ctx->buffers[0];
+    ctx->appended = 0;
+    ctx->durable = 0;
+    ctx->failed = 0;
+    ctx->notify = NULL;
+    ctx->notify_arg = NULL;
+    ctx->notify_asked = false;
+    ctx->flush_now = false;
+    ctx->running = true;
+    mutex_init(&ctx->mutex);
+    // the window and the durability waits are timed on the monotonic clock
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->lines_ready, &cond_attr);
+    pthread_cond_init(&ctx->durable_changed, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_cond_init(&ctx->swapped, NULL);
+
+    if (pthread_create(&ctx->writer, NULL, &file_saver_writer, (void*)ctx) != 0) {
+        printf("couldn't start the log writer\n");
+        return -1;
+    }
     return 0;
 }
 
+void file_saver_clear_parts (file_saver_buffer_t* buffer) {
+    for (size_t i = 0; i < list_size(buffer->parts); i++) {
+        file_saver_part_t* part = list_get(buffer->parts, i, file_saver_part_t*);
+        free(part->dir);
+        string_builder_free(part->lines);
+        free(part);
+    }
+    list_clear(buffer->parts);
+}
+
+/* Writer thread */
+void file_saver_close_parts (file_saver_ctx_t* ctx) {
+    for (size_t i = 0; i < list_size(ctx->part_fds); i++) {
+        file_saver_fd_t* part_fd = list_get(ctx->part_fds, i, file_saver_fd_t*);
+        close(part_fd->fd);
+        free(part_fd->path);
+        free(part_fd);
+    }
+    list_clear(ctx->part_fds);
+}
+
+/* Call once the file handler is stopped, returns after the writer wrote every line */
+void file_saver_stop (file_saver_ctx_t* ctx) {
+    mutex_lock(&ctx->mutex);
+    bool was_running = ctx->running;
+    ctx->running = false;
+    pthread_cond_signal(&ctx->lines_ready);
+    mutex_unlock(&ctx->mutex);
+    if (was_running)
+        pthread_join(ctx->writer, NULL);
+}
+
 void file_saver_free (file_saver_ctx_t* ctx) {
+    file_saver_stop(ctx);
+    if (ctx->fd >= 0)
+        close(ctx->fd);
+    file_saver_close_parts(ctx);
+    list_free(ctx->part_fds);
+    if (ctx->uring != NULL)
+        file_uring_free(ctx->uring);
+    list_free(ctx->ops);
+    if (ctx->journal_fd >= 0)
+        close(ctx->journal_fd);
+    if (ctx->archive != NULL)
+        log_archive_free(ctx->archive);
+    if (ctx->search != NULL)
+        search_index_free(ctx->search);
+    if (ctx->history != NULL)
+        history_free(ctx->history);
+    for (int i = 0; i < 2; i++) {
+        string_builder_free(ctx->buffers[i].lines);
+        string_builder_free(ctx->buffers[i].records);
+        file_saver_clear_parts(&ctx->buffers[i]);
+        list_free(ctx->buffers[i].parts);
+    }
     string_builder_free(ctx->log_dir);
+    mutex_free(&ctx->mutex);
+    pthread_cond_destroy(&ctx->lines_ready);
+    pthread_cond_destroy(&ctx->swapped);
+    pthread_cond_destroy(&ctx->durable_changed);
 }
 
-void file_saver_handle_event (global_ctx_t* ctx, eso_event_t* eso_event) {
-    char* file_name = get_format_time("%d-%m-%Y");
-    string_builder_t* file_path = string_builder_copy(ctx->file_saver_ctx->log_dir->value);
-    string_builder_append(file_path, file_name);
-    string_builder_append(file_path, ".txt");
-    free(file_name);
-
-    FILE* file = fopen(string_builder_as_cstring(file_path), "ab");
-    if (file == NULL) {
+struct timespec file_saver_deadline (long long ms) {
+    struct timespec deadline;
+    deadline.tv_sec = ms / 1000;
+    deadline.tv_nsec = (ms % 1000) * 1000000;
+    return deadline;
+}
+
+bool file_saver_write (int fd, const char* data, size_t left) {
+    while (left > 0) {
+        ssize_t wrote_bytes = write(fd, data, left);
+        if (wrote_bytes < 0 && errno == EINTR)
+            continue;
+        if (wrote_bytes < 0) {
+            printf("err %d, cannot write the log lines\n", errno);
+            return false;
+        }
+        data += wrote_bytes;
+        left -= wrote_bytes;
+    }
+    return true;
+}
+
+int file_saver_open (file_saver_ctx_t* ctx, const char* day, const char* suffix) {
+    string_builder_t* file_path = string_builder_copy(ctx->log_dir->value);
+    string_builder_append(file_path, day);
+    string_builder_append(file_path, suffix);
+    int fd = open(string_builder_as_cstring(file_path), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
         printf("err %d, cannot open or create file \"%s\"\n", errno, string_builder_as_cstring(file_path));
-        string_builder_free(file_path);
+    string_builder_free(file_path);
+    return fd;
+}
+
+/* Where the next records of the journal land, the search postings point there */
+void file_saver_journal_size (file_saver_ctx_t* ctx) {
+    struct stat journal_stat;
+    ctx->journal_size = fstat(ctx->journal_fd, &journal_stat) == 0 ? journal_stat.st_size : 0;
+}
+
+/* A new journal starts with the file header */
+void file_saver_open_journal (file_saver_ctx_t* ctx, file_saver_buffer_t* buffer) {
+    if (ctx->journal_fd >= 0)
+        close(ctx->journal_fd);
+    ctx->journal_fd = file_saver_open(ctx, buffer->day, JOURNAL_SUFFIX);
+    if (ctx->journal_fd < 0)
         return;
+    file_saver_journal_size(ctx);
+    if (ctx->journal_size == 0) {
+        journal_file_header_t header;
+        journal_file_header_fill(&header);
+        file_saver_write(ctx->journal_fd, (const char*)&header, sizeof(header));
+        file_saver_journal_size(ctx);
     }
+}
 
-    char* time = get_format_time("%H:%M");
-    string_builder_t* eso_format = tg_format_eso_event(eso_event);
-    string_builder_t* formatted = string_builder_printf("%s %s", time, string_builder_as_cstring(eso_format));
-    string_builder_append(formatted, "\n");
-    free(time);
+/* Writer thread, switches to the day files the buffer belongs to */
+void file_saver_open_day (file_saver_ctx_t* ctx, file_saver_buffer_t* buffer) {
+    bool opened = true;
+    if (ctx->partition == FILE_PARTITION_NONE) {
+        if (ctx->fd >= 0)
+            close(ctx->fd);
+        ctx->fd = file_saver_open(ctx, buffer->day, ".txt");
+        opened = ctx->fd >= 0;
+    }
+    else
+        file_saver_close_parts(ctx);
+    // on failure fd_day_end stays behind, the next buffer tries again
+    if (opened) {
+        // the previous day is complete now
+        if (ctx->fd_day_end != 0 && ctx->archive != NULL)
+            log_archive_notify(ctx->archive);
+        ctx->fd_day_end = buffer->day_end;
+    }
+    if (ctx->journal)
+        file_saver_open_journal(ctx, buffer);
+}
+
+/* The directories of a partition are made on its first line */
+int file_saver_open_part (file_saver_ctx_t* ctx, const char* path, const char* dir) {
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        string_builder_t* dir_path = string_builder_copy(string_builder_as_cstring(ctx->log_dir));
+        for (const char* part = dir; *part != '\0';) {
+            size_t length = strcspn(part, FILE_SEP_S) + 1;
+            string_builder_append_string(dir_path, part, length);
+            mkdir(string_builder_as_cstring(dir_path), S_IRWXU | S_IRWXG | S_IRWXO);
+            part += length;
+        }
+        string_builder_free(dir_path);
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    }
+    if (fd < 0)
+        printf("err %d, cannot open or create file \"%s\"\n", errno, path);
+    return fd;
+}
 
-    size_t wrote_bytes = fwrite(string_builder_as_cstring(formatted), sizeof(char), string_builder_size(formatted), file);
-    int fd = fileno(file);
+/* Writer thread, at most part_fds_max partition files stay open */
+int file_saver_part_fd (file_saver_ctx_t* ctx, const char* day, const char* dir) {
+    string_builder_t* path = string_builder_copy(string_builder_as_cstring(ctx->log_dir));
+    string_builder_append(path, dir);
+    string_builder_append(path, day);
+    string_builder_append(path, ".txt");
+    const char* path_s = string_builder_as_cstring(path);
+    file_saver_fd_t* oldest = NULL;
+    for (size_t i = 0; i < list_size(ctx->part_fds); i++) {
+        file_saver_fd_t* part_fd = list_get(ctx->part_fds, i, file_saver_fd_t*);
+        if (STREQUAL(part_fd->path, path_s)) {
+            part_fd->used = ++ctx->part_clock;
+            string_builder_free(path);
+            return part_fd->fd;
+        }
+        if (oldest == NULL || part_fd->used < oldest->used)
+            oldest = part_fd;
+    }
+    int fd = file_saver_open_part(ctx, path_s, dir);
     if (fd < 0) {
-        printf("cannot obtain file descriptor, err %d\nwrote bytes: %ld", errno, wrote_bytes);
-        string_builder_free(file_path);
-        string_builder_free(formatted);
+        string_builder_free(path);
+        return -1;
+    }
+    file_saver_fd_t* part_fd;
+    if ((long)list_size(ctx->part_fds) >= ctx->part_fds_max) {
+        part_fd = oldest;
+        close(part_fd->fd);
+        free(part_fd->path);
+    }
+    else {
+        part_fd = MALLOC_STRUCT(file_saver_fd_t);
+        list_push(ctx->part_fds, part_fd);
+    }
+    part_fd->path = strdup(path_s);
+    part_fd->fd = fd;
+    part_fd->used = ++ctx->part_clock;
+    string_builder_free(path);
+    return fd;
+}
+
+/* Queues data for file_saver_write_ops, returns its index */
+size_t file_saver_add_op (file_saver_ctx_t* ctx, int fd, string_builder_t* data) {
+    file_uring_op_t op;
+    memset(&op, 0, sizeof(op));
+    op.fd = fd;
+    op.data = string_builder_as_cstring(data);
+    op.length = string_builder_size(data);
+    op.sync = ctx->sync_mode != FILE_SYNC_NONE;
+    list_push_value(ctx->ops, &op);
+    return list_size(ctx->ops) - 1;
+}
+
+/* The ops and their fdatasyncs go to the ring at once, whatever it left is done one by one */
+bool file_saver_run_ops (file_saver_ctx_t* ctx, file_uring_op_t* ops, size_t count) {
+    if (ctx->uring != NULL && !file_uring_run(ctx->uring, ops, count)) {
+        file_uring_free(ctx->uring);
+        ctx->uring = NULL;
+    }
+    bool done = true;
+    for (size_t i = 0; i < count; i++) {
+        file_uring_op_t* op = &ops[i];
+        if (op->written < op->length && file_saver_write(op->fd, op->data + op->written, op->length - op->written))
+            op->written = op->length;
+        if (op->sync && !op->synced && op->written == op->length && op->length > 0) {
+            op->synced = fdatasync(op->fd) == 0;
+            if (!op->synced)
+                printf("err %d, cannot sync the log file\n", errno);
+        }
+        if (op->written < op->length || (op->sync && !op->synced && op->length > 0))
+            done = false;
+    }
+    return done;
+}
+
+/*
+ * The writes queued from first on, a barrier op is written and synced before the ones after it
+ * start, short writes included. False when anything could not be written or synced.
+ */
+bool file_saver_write_ops (file_saver_ctx_t* ctx, size_t first) {
+    file_uring_op_t* ops = (file_uring_op_t*)ctx->ops->values + first;
+    size_t count = list_size(ctx->ops) - first;
+    bool done = true;
+    size_t start = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!ops[i].barrier)
+            continue;
+        if (i > start)
+            done &= file_saver_run_ops(ctx, ops + start, i - start);
+        done &= file_saver_run_ops(ctx, ops + i, 1);
+        start = i + 1;
+    }
+    if (start < count)
+        done &= file_saver_run_ops(ctx, ops + start, count - start);
+    return done;
+}
+
+/* A burst grew the buffer, don't keep it */
+string_builder_t* file_saver_reset (string_builder_t* data) {
+    if (data->length <= FILE_SAVER_LINE_SIZE * 64) {
+        string_builder_clear(data);
+        return data;
+    }
+    string_builder_free(data);
+    return string_builder_create(FILE_SAVER_LINE_SIZE);
+}
+
+/*
+ * Every file of the buffer is written and synced in one go, the journal, the log and the partitions.
+ * False when any of them could not be opened, written or synced.
+ */
+bool file_saver_flush (file_saver_ctx_t* ctx, file_saver_buffer_t* buffer) {
+    if (ctx->fd_day_end != buffer->day_end || (ctx->partition == FILE_PARTITION_NONE && ctx->fd < 0))
+        file_saver_open_day(ctx, buffer);
+    else if (ctx->journal && ctx->journal_fd < 0)
+        file_saver_open_journal(ctx, buffer);
+    bool done = (ctx->partition != FILE_PARTITION_NONE || ctx->fd >= 0) && (!ctx->journal || ctx->journal_fd >= 0);
+    list_clear(ctx->ops);
+    size_t journal_op = ctx->journal && ctx->journal_fd >= 0
+        ? file_saver_add_op(ctx, ctx->journal_fd, buffer->records)
+        : SIZE_MAX;
+    // the journal is written and synced before the logs, a line never gets to disk ahead of its record
+    if (journal_op != SIZE_MAX)
+        (list_get(ctx->ops, journal_op, file_uring_op_t)).barrier = true;
+    if (ctx->fd >= 0)
+        file_saver_add_op(ctx, ctx->fd, buffer->lines);
+    size_t opened = 0, first = 0;
+    for (size_t i = 0; i < list_size(buffer->parts); i++) {
+        // the files of a batch have to stay open until it is written
+        if (opened == (size_t)ctx->part_fds_max) {
+            done &= file_saver_write_ops(ctx, first);
+            first = list_size(ctx->ops);
+            opened = 0;
+        }
+        file_saver_part_t* part = list_get(buffer->parts, i, file_saver_part_t*);
+        int fd = file_saver_part_fd(ctx, buffer->day, part->dir);
+        if (fd >= 0) {
+            file_saver_add_op(ctx, fd, part->lines);
+            opened++;
+        }
+        else
+            done = false;
+    }
+    done &= file_saver_write_ops(ctx, first);
+
+    if (journal_op != SIZE_MAX) {
+        const file_uring_op_t* op = &list_get(ctx->ops, journal_op, file_uring_op_t);
+        if (op->written == op->length) {
+            if (ctx->search != NULL)
+                search_index_add_records(ctx->search, buffer->day, ctx->journal_size, op->data, op->length);
+            ctx->journal_size += op->length;
+        }
+        // a torn write is cut off, the records after it would be past the point readers stop at
+        else if (ftruncate(ctx->journal_fd, (off_t)ctx->journal_size) != 0) {
+            printf("err %d, cannot cut a torn write off the journal\n", errno);
+            file_saver_journal_size(ctx);
+        }
+    }
+    file_saver_clear_parts(buffer);
+    buffer->lines = file_saver_reset(buffer->lines);
+    buffer->records = file_saver_reset(buffer->records);
+    buffer->events = 0;
+    return done;
+}
+
+/*
+ * In the group mode the first line of a buffer opens a window, the buffer is taken when the
+ * window closes or sync_events lines have gathered, whichever comes first. The other modes
+ * take whatever is there. Stopping writes the rest without waiting for the window.
+ */
+void* file_saver_writer (void* _ctx) {
+    file_saver_ctx_t* ctx = (file_saver_ctx_t*)_ctx;
+    mutex_lock(&ctx->mutex);
+    while (ctx->running || ctx->active->events > 0) {
+        file_saver_buffer_t* full = ctx->active;
+        if (full->events == 0) {
+            pthread_cond_wait(&ctx->lines_ready, &ctx->mutex);
+            continue;
+        }
+        if (ctx->sync_mode == FILE_SYNC_GROUP && ctx->running && !ctx->flush_now
+            && full->events < (size_t)ctx->sync_events) {
+            long long window_end = full->since + ctx->sync_window;
+            if (get_monotonic_ms() < window_end) {
+                struct timespec deadline = file_saver_deadline(window_end);
+                pthread_cond_timedwait(&ctx->lines_ready, &ctx->mutex, &deadline);
+                continue;
+            }
+        }
+        ctx->active = full == &ctx->buffers[0] ? &ctx->buffers[1] : &ctx->buffers[0];
+        ctx->flush_now = false;
+        uint64_t appended = ctx->appended;
+        pthread_cond_signal(&ctx->swapped);
+        mutex_unlock(&ctx->mutex);
+
+        bool flushed = file_saver_flush(ctx, full);
+
+        mutex_lock(&ctx->mutex);
+        // waiters for lines that could not be written learn it now instead of waiting forever
+        if (flushed)
+            ctx->durable = appended;
+        else
+            ctx->failed = appended;
+        pthread_cond_broadcast(&ctx->durable_changed);
+        if (ctx->notify_asked && ctx->notify != NULL)
+            ctx->notify(ctx->notify_arg);
+        ctx->notify_asked = false;
+    }
+    mutex_unlock(&ctx->mutex);
+    return NULL;
+}
+
+/* The local time is only looked up once a minute, and the file name once a day */
+void file_saver_update_clock (file_saver_ctx_t* ctx) {
+    time_t now = time(NULL);
+    if (now < ctx->minute_end && now < ctx->day_end)
+        return;
+    struct tm local_time;
+    localtime_r(&now, &local_time);
+    strftime(ctx->minute, sizeof(ctx->minute), "%H:%M", &local_time);
+    ctx->minute_end = now - local_time.tm_sec + 60;
+    if (now < ctx->day_end)
         return;
+    strftime(ctx->day, sizeof(ctx->day), "%d-%m-%Y", &local_time);
+    struct tm midnight = local_time;
+    midnight.tm_hour = 0;
+    midnight.tm_min = 0;
+    midnight.tm_sec = 0;
+    midnight.tm_mday++;
+    midnight.tm_isdst = -1;
+    ctx->day_end = mktime(&midnight);
+}
+
+/* A node name as a path component, '_' for what a file system would not take or read as a path */
+size_t file_saver_part_name (char* out, const char* name) {
+    size_t length = 0;
+    for (; name[length] != '\0' && length < FILE_PARTITION_NAME_MAX; length++) {
+        unsigned char c = (unsigned char)name[length];
+        out[length] = c < 0x20 || strchr("/\\:*?\"<>|", c) != NULL ? '_' : (char)c;
     }
-    fsync(fd);
-    fflush(file);
-    fclose(file);
-    string_builder_free(file_path);
-    string_builder_free(formatted);
+    // a cut UTF-8 character is dropped
+    while (length > 0 && ((unsigned char)name[length] & 0xc0) == 0x80)
+        length--;
+    out[length] = '\0';
+    if (length == 0 || STREQUAL(out, ".") || STREQUAL(out, ".."))
+        return (size_t)sprintf(out, "_");
+    return length;
 }
 
-event_handler_t* file_saver_event_handler_create () {
-    event_handler_t* event_handler = MALLOC_STRUCT(event_handler_t);
-    event_handler->event = &file_saver_handle_event;
-    return event_handler;
+/* The lines of the event's partition in the buffer, created with its first line */
+string_builder_t* file_saver_part_lines (file_saver_ctx_t* ctx, file_saver_buffer_t* buffer, eso_event_t* eso_event) {
+    char name[FILE_PARTITION_NAME_MAX + 1];
+    char dir[FILE_PARTITION_NAME_MAX + 48];
+    file_saver_part_name(name, eso_event->game_data.node != NULL ? eso_event->game_data.node : "");
+    if (ctx->partition == FILE_PARTITION_ACTOR)
+        snprintf(dir, sizeof(dir), FILE_PARTITION_DIR FILE_SEP_S "%s" FILE_SEP_S "%d" FILE_SEP_S, name, eso_event->actor.id);
+    else
+        snprintf(dir, sizeof(dir), FILE_PARTITION_DIR FILE_SEP_S "%s" FILE_SEP_S, name);
+    for (size_t i = list_size(buffer->parts); i > 0; i--) {
+        file_saver_part_t* part = list_get(buffer->parts, i - 1, file_saver_part_t*);
+        if (STREQUAL(part->dir, dir))
+            return part->lines;
+    }
+    file_saver_part_t* part = MALLOC_STRUCT(file_saver_part_t);
+    part->dir = strdup(dir);
+    part->lines = string_builder_create(FILE_SAVER_LINE_SIZE);
+    list_push(buffer->parts, part);
+    return part->lines;
+}
+
+/* Waits until the events appended so far are durable, false when that takes too long. Called locked */
+bool file_saver_wait_appended (file_saver_ctx_t* ctx, uint64_t target) {
+    struct timespec deadline = file_saver_deadline(get_monotonic_ms() + FILE_SYNC_WAIT_MAX);
+    int wait_result = 0;
+    while (ctx->durable < target && ctx->failed < target && wait_result == 0)
+        wait_result = pthread_cond_timedwait(&ctx->durable_changed, &ctx->mutex, &deadline);
+    return ctx->durable >= target && ctx->failed < target;
+}
+
+/* Runs on the file handler thread, the disk is only touched by the writer */
+void file_saver_handle_event (global_ctx_t* ctx, eso_event_t* eso_event) {
+    file_saver_ctx_t* fs_ctx = ctx->file_saver_ctx;
+    file_saver_update_clock(fs_ctx);
+
+    mutex_lock(&fs_ctx->mutex);
+    file_saver_buffer_t* active = fs_ctx->active;
+    // the lines of the day that just ended have to reach its file first
+    if (active->events > 0 && active->day_end != fs_ctx->day_end) {
+        fs_ctx->flush_now = true;
+        pthread_cond_signal(&fs_ctx->lines_ready);
+        while (fs_ctx->active->events > 0)
+            pthread_cond_wait(&fs_ctx->swapped, &fs_ctx->mutex);
+        active = fs_ctx->active;
+    }
+    if (active->events == 0) {
+        active->since = get_monotonic_ms();
+        active->day_end = fs_ctx->day_end;
+        memcpy(active->day, fs_ctx->day, sizeof(active->day));
+    }
+    string_builder_t* lines = fs_ctx->partition == FILE_PARTITION_NONE
+        ? active->lines
+        : file_saver_part_lines(fs_ctx, active, eso_event);
+    string_builder_append(lines, fs_ctx->minute);
+    string_builder_append(lines, " ");
+    eso_event_format_append(lines, eso_event);
+    string_builder_append(lines, "\n");
+    if (fs_ctx->journal)
+        journal_append(active->records, ++fs_ctx->journal_seq, journal_now(), eso_event);
+    active->events++;
+    uint64_t appended = ++fs_ctx->appended;
+    if (active->events == 1 || active->events >= (size_t)fs_ctx->sync_events)
+        pthread_cond_signal(&fs_ctx->lines_ready);
+    // every line gets its own write and fdatasync, like the logs always had
+    if (fs_ctx->sync_mode == FILE_SYNC_STRICT)
+        file_saver_wait_appended(fs_ctx, appended);
+    mutex_unlock(&fs_ctx->mutex);
+}
+
+/* What file_saver_is_durable has to reach for every event queued for the file so far */
+uint64_t file_saver_durable_target (file_saver_ctx_t* ctx) {
+    return ctx->handler != NULL ? event_handler_enqueued(ctx->handler) : 0;
+}
+
+/*
+ * Does not block, notify is called after the next flush while it is FILE_DURABLE_WAIT.
+ * A failed flush fails every target up to it, also one a later flush got past.
+ */
+int file_saver_durable (file_saver_ctx_t* ctx, uint64_t target) {
+    mutex_lock(&ctx->mutex);
+    int state = ctx->failed >= target && target > 0 ? FILE_DURABLE_FAILED
+        : ctx->durable >= target ? FILE_DURABLE_OK
+        : FILE_DURABLE_WAIT;
+    if (state == FILE_DURABLE_WAIT)
+        ctx->notify_asked = true;
+    mutex_unlock(&ctx->mutex);
+    return state;
+}
+
+void file_saver_set_notify (file_saver_ctx_t* ctx, file_saver_notify_fun notify, void* arg) {
+    mutex_lock(&ctx->mutex);
+    ctx->notify = notify;
+    ctx->notify_arg = arg;
+    mutex_unlock(&ctx->mutex);
+}
+
+event_handler_t* file_saver_event_handler_create (file_saver_ctx_t* ctx) {
+    // losing log lines is worse than slowing the extension down
+    event_handler_t* handler = event_handler_create("file", &file_saver_handle_event, ESO_EVENT_MASK_ALL,
+                                                    EVENT_POLICY_BLOCK);
+    ctx->handler = handler;
+    return handler;
 }
 
 void file_saver_event_handler_free (event_handler_t* handler) {
-    free(handler);
-}
\ No newline at end of file
+    event_handler_free(handler);
+}
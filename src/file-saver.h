@@ -2,16 +2,126 @@
 #define NOTIFIER_FILE_SAVER_H_HEADER
 
 #include "main.h"
+#include "log-archive.h"
+#include "journal.h"
+#include "search-index.h"
+#include "history.h"
+#include "file-uring.h"
+
+#include <time.h>
+
+#define FILE_SAVER_LINE_SIZE 1024
+
+#define FILE_SYNC_NONE      0   // write every line, leave flushing to the OS
+#define FILE_SYNC_GROUP     1   // one fdatasync for all the lines of a window
+#define FILE_SYNC_STRICT    2   // fdatasync after every line
+
+#define FILE_PARTITION_NONE     0   // one text log for everything
+#define FILE_PARTITION_NODE     1   // nodes/<node>/dd-mm-YYYY.txt
+#define FILE_PARTITION_ACTOR    2   // nodes/<node>/<actor id>/dd-mm-YYYY.txt
+
+#define FILE_PARTITION_DIR          LOG_ARCHIVE_PARTITION_DIR
+#define FILE_PARTITION_NAME_MAX     64  // bytes of a node name in a path
+#define FILE_PARTITION_DEFAULT_FDS  64
+
+#define FILE_SYNC_DEFAULT_WINDOW    50  // ms
+#define FILE_SYNC_DEFAULT_EVENTS    256
+#define FILE_SYNC_WAIT_MAX          5000 // ms
+
+/* What file_saver_durable tells about the events up to a target */
+#define FILE_DURABLE_WAIT       0
+#define FILE_DURABLE_OK         1
+#define FILE_DURABLE_FAILED     2
+
+/* Lines of one partition, dir is relative to the log dir and ends with FILE_SEP */
+typedef struct file_saver_part {
+    char* dir;
+    string_builder_t* lines;
+} file_saver_part_t;
+
+/* An open partition file, the least recently used one is closed first */
+typedef struct file_saver_fd {
+    char* path;
+    int fd;
+    uint64_t used;
+} file_saver_fd_t;
+
+/* Lines and journal records of one day waiting for the writer */
+typedef struct file_saver_buffer {
+    string_builder_t* lines;
+    list_t* parts;          // file_saver_part_t*, the lines when partitioned
+    string_builder_t* records;
+    size_t events;
+    long long since;        // monotonic ms of the first line
+    time_t day_end;
+    char day[12];           // "dd-mm-YYYY"
+} file_saver_buffer_t;
+
+/*
+ * The handler thread formats lines into the active buffer, the writer thread owns the day files:
+ * it swaps the buffers and writes the full one with one write per file while the next lines gather.
+ * The journal next to the text log keeps the events themselves, see journal.h.
+ */
+/* Told from the writer thread that durable moved */
+typedef void(*file_saver_notify_fun)(void* arg);
 
 typedef struct file_saver_ctx {
     global_ctx_t* global_ctx;
+    event_handler_t* handler;
     string_builder_t* log_dir;
+    int sync_mode;
+    long sync_window;
+    long sync_events;
+    bool journal;           // file_journal
+    int partition;          // FILE_PARTITION_*
+
+    // handler thread
+    time_t day_end;         // local midnight, lines after it go to the next file
+    time_t minute_end;
+    char minute[8];         // "HH:MM" stamp of the current minute
+    char day[12];           // "dd-mm-YYYY" of the current day
+    uint64_t journal_seq;   // of the last record
+
+    // writer thread
+    int fd;                 // -1 until the first write, unused when partitioned
+    list_t* part_fds;       // file_saver_fd_t*
+    long part_fds_max;
+    uint64_t part_clock;
+    file_uring_t* uring;    // NULL when file_io is sync or io_uring is not there
+    list_t* ops;            // file_uring_op_t, the writes of a flush
+    int journal_fd;
+    off_t journal_size;     // where the next records land
+    time_t fd_day_end;
+    pthread_t writer;
+    log_archive_t* archive; // NULL when file_compress is none
+    search_index_t* search; // NULL without the journal or when search_index is 0
+    history_t* history;     // NULL without the journal
+
+    // guarded by mutex
+    file_saver_buffer_t buffers[2];
+    file_saver_buffer_t* active;
+    uint64_t appended;      // events put in the buffers
+    uint64_t durable;       // events written, and synced unless file_sync is none
+    uint64_t failed;        // appended when the last flush that could not write or sync everything was taken
+    file_saver_notify_fun notify;
+    void* notify_arg;
+    bool notify_asked;      // somebody waits for durable without blocking
+    bool flush_now;
+    bool running;
+    mutex_t mutex;
+    pthread_cond_t lines_ready;
+    pthread_cond_t swapped;
+    pthread_cond_t durable_changed;
 } file_saver_ctx_t;
 
 int file_saver_init (file_saver_ctx_t* ctx, global_ctx_t* global);
+void file_saver_stop (file_saver_ctx_t* ctx);
 void file_saver_free (file_saver_ctx_t* ctx);
 void file_saver_handle_event (global_ctx_t* ctx, eso_event_t* eso_event);
-event_handler_t* file_saver_event_handler_create ();
+uint64_t file_saver_durable_target (file_saver_ctx_t* ctx);
+int file_saver_durable (file_saver_ctx_t* ctx, uint64_t target);
+void file_saver_set_notify (file_saver_ctx_t* ctx, file_saver_notify_fun notify, void* arg);
+event_handler_t* file_saver_event_handler_create (file_saver_ctx_t* ctx);
 void file_saver_event_handler_free (event_handler_t* handler);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include "file-uring.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct file_uring {
+    int fd;
+    void* ring;
+    size_t ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int sq_entries;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+/* The user data of a completion: the op index, and whether it is the fdatasync */
+#define FILE_URING_DATA(index, sync) ((uint64_t)(index) << 1 | (sync))
+
+static bool file_uring_supports (int fd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+        && probe->last_op >= IORING_OP_WRITE
+        && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+file_uring_t* file_uring_create (unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return NULL;
+    // one mapping for both rings, and writes at the file position so O_APPEND works as with write()
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_RW_CUR_POS)
+        || !file_uring_supports(fd)) {
+        close(fd);
+        return NULL;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* sqes = ring == MAP_FAILED ? MAP_FAILED
+        : mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (ring != MAP_FAILED)
+            munmap(ring, ring_size);
+        close(fd);
+        return NULL;
+    }
+
+    file_uring_t* uring = MALLOC_STRUCT(file_uring_t);
+    uring->fd = fd;
+    uring->ring = ring;
+    uring->ring_size = ring_size;
+    uring->sqes = sqes;
+    uring->sqes_size = sqes_size;
+    char* base = ring;
+    uring->sq_head = (unsigned int*)(base + params.sq_off.head);
+    uring->sq_tail = (unsigned int*)(base + params.sq_off.tail);
+    uring->sq_mask = (unsigned int*)(base + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned int*)(base + params.sq_off.array);
+    uring->sq_entries = params.sq_entries;
+    uring->cq_head = (unsigned int*)(base + params.cq_off.head);
+    uring->cq_tail = (unsigned int*)(base + params.cq_off.tail);
+    uring->cq_mask = (unsigned int*)(base + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    return uring;
+}
+
+void file_uring_free (file_uring_t* uring) {
+    munmap(uring->sqes, uring->sqes_size);
+    munmap(uring->ring, uring->ring_size);
+    close(uring->fd);
+    free(uring);
+}
+
+static void file_uring_push (file_uring_t* uring, unsigned int* tail, int opcode, file_uring_op_t* op,
+                             size_t index, uint8_t flags) {
+    unsigned int slot = *tail & *uring->sq_mask;
+    struct io_uring_sqe* sqe = &uring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = op->fd;
+    if (opcode == IORING_OP_WRITE) {
+        sqe->off = (uint64_t)-1;
+        sqe->addr = (uint64_t)(uintptr_t)op->data;
+        // a larger buffer comes back short and the rest is written the usual way
+        sqe->len = op->length > 0x40000000 ? 0x40000000 : (uint32_t)op->length;
+    }
+    else
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->flags = flags;
+    sqe->user_data = FILE_URING_DATA(index, opcode == IORING_OP_FSYNC);
+    uring->sq_array[slot] = slot;
+    (*tail)++;
+}
+
+static void file_uring_reap (file_uring_t* uring, file_uring_op_t* ops, size_t* pending) {
+    unsigned int head = *uring->cq_head;
+    unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+        file_uring_op_t* op = &ops[cqe->user_data >> 1];
+        // a failed or short write cancels its fdatasync, both are redone by the caller
+        if (cqe->user_data & 1)
+            op->synced = cqe->res == 0;
+        else if (cqe->res > 0)
+            op->written = (size_t)cqe->res;
+        (*pending)--;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * io_uring_enter failed for good: the entries the kernel did not take are withdrawn and the ones
+ * it took are waited for, the caller must not write the same files while they are in flight.
+ */
+static void file_uring_abandon (file_uring_t* uring, file_uring_op_t* ops, size_t* pending, unsigned int tail) {
+    unsigned int head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(uring->sq_tail, head, __ATOMIC_RELEASE);
+    *pending -= tail - head;
+    file_uring_reap(uring, ops, pending);
+    while (*pending > 0) {
+        if (syscall(__NR_io_uring_enter, uring->fd, 0, (unsigned int)*pending, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+        file_uring_reap(uring, ops, pending);
+    }
+}
+
+/*
+ * Submits the ops in batches that fit the ring and waits for all of them with the same call.
+ * What did not complete shows in written and synced, the caller finishes it with write().
+ * False when the ring stopped working and should not be used again.
+ */
+bool file_uring_run (file_uring_t* uring, file_uring_op_t* ops, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        ops[i].written = 0;
+        ops[i].synced = false;
+    }
+    size_t next = 0;
+    while (next < count) {
+        unsigned int tail = *uring->sq_tail;
+        unsigned int submit = 0;
+        for (; next < count && submit + 2 <= uring->sq_entries; next++) {
+            if (ops[next].length == 0)
+                continue;
+            file_uring_push(uring, &tail, IORING_OP_WRITE, &ops[next], next, ops[next].sync ? IOSQE_IO_LINK : 0);
+            submit++;
+            if (ops[next].sync) {
+                file_uring_push(uring, &tail, IORING_OP_FSYNC, &ops[next], next, 0);
+                submit++;
+            }
+        }
+        __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        size_t pending = submit;
+        unsigned int to_submit = submit;
+        while (pending > 0) {
+            int entered = (int)syscall(__NR_io_uring_enter, uring->fd, to_submit, (unsigned int)pending,
+                                       IORING_ENTER_GETEVENTS, NULL, 0);
+            if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                printf("err %d, io_uring_enter failed, log files go back to write()\n", errno);
+                file_uring_abandon(uring, ops, &pending, tail);
+                return false;
+            }
+            if (entered > 0)
+                to_submit -= (unsigned int)entered < to_submit ? (unsigned int)entered : to_submit;
+            file_uring_reap(uring, ops, &pending);
+        }
+    }
+    return true;
+}
+
+#else
+
+file_uring_t* file_uring_create (unsigned int entries) {
+    return NULL;
+}
+
+bool file_uring_run (file_uring_t* uring, file_uring_op_t* ops, size_t count) {
+    return false;
+}
+
+void file_uring_free (file_uring_t* uring) {
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef NOTIFIER_FILE_URING_H_HEADER
+#define NOTIFIER_FILE_URING_H_HEADER
+
+#include "main.h"
+
+/*
+ * The appends of one flush submitted to an io_uring together, each write linked to the
+ * fdatasync of its file, and reaped with the same io_uring_enter. Raw system calls, no liburing.
+ * Linux 5.6 or newer, file_uring_create returns NULL elsewhere and the caller writes as before.
+ */
+
+#define FILE_URING_ENTRIES  64
+
+/* One append, written and synced tell how far it got */
+typedef struct file_uring_op {
+    int fd;
+    const char* data;
+    size_t length;
+    bool sync;              // fdatasync after the write
+    bool barrier;           // run on its own, the ops after it start once it is finished
+    size_t written;
+    bool synced;
+} file_uring_op_t;
+
+typedef struct file_uring file_uring_t;
+
+file_uring_t* file_uring_create (unsigned int entries);
+bool file_uring_run (file_uring_t* uring, file_uring_op_t* ops, size_t count);
+void file_uring_free (file_uring_t* uring);
+
+#endif
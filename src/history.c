@@ -0,0 +1,311 @@
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <json.h>
+#include "history.h"
+#include "cbor.h"
+
+#define HISTORY_BUCKET_MS ((int64_t)HISTORY_INDEX_MINUTES * 60 * 1000)
+
+/* One day of a query, scanned on its own thread */
+typedef struct history_scan {
+    history_t* history;
+    const history_query_t* query;
+    long day_key;
+    long limit;
+    pthread_t thread;
+    // results
+    string_builder_t* cbor;     // items of the events array
+    list_t* items;              // history_item_t of each event taken
+    json_object* json;
+    long count;
+    bool more;
+} history_scan_t;
+
+history_t* history_create (const char* log_dir) {
+    history_t* history = MALLOC_STRUCT(history_t);
+    history->log_dir = string_builder_copy(log_dir);
+    mutex_init(&history->mutex);
+    history->days = list_create(history_day_t*);
+    return history;
+}
+
+void history_free (history_t* history) {
+    for (size_t i = 0; i < list_size(history->days); i++) {
+        history_day_t* day = list_get(history->days, i, history_day_t*);
+        list_free(day->marks);
+        mutex_free(&day->mutex);
+        free(day);
+    }
+    list_free(history->days);
+    mutex_free(&history->mutex);
+    string_builder_free(history->log_dir);
+    free(history);
+}
+
+/* "chat,userRoll" as ESO_EVENT_MASK bits, every type when types is NULL or empty */
+uint32_t history_parse_types (const char* types) {
+    if (types == NULL || *types == '\0')
+        return ESO_EVENT_MASK_ALL;
+    uint32_t mask = 0;
+    char name[64];
+    while (*types != '\0') {
+        size_t length = strcspn(types, ",");
+        if (length < sizeof(name)) {
+            memcpy(name, types, length);
+            name[length] = '\0';
+            mask |= ESO_EVENT_MASK(match_event_name_to_constant(name));
+        }
+        types += length;
+        if (*types == ',')
+            types++;
+    }
+    return mask;
+}
+
+static history_day_t* history_day_get (history_t* history, long day_key) {
+    history_day_t* day = NULL;
+    mutex_lock(&history->mutex);
+    for (size_t i = 0; i < list_size(history->days) && day == NULL; i++) {
+        history_day_t* known = list_get(history->days, i, history_day_t*);
+        if (known->day_key == day_key)
+            day = known;
+    }
+    if (day == NULL) {
+        day = MALLOC_STRUCT(history_day_t);
+        day->day_key = day_key;
+        mutex_init(&day->mutex);
+        day->marks = list_create(history_mark_t);
+        day->indexed = 0;
+        day->last_bucket = INT64_MIN;
+        list_push(history->days, day);
+    }
+    mutex_unlock(&history->mutex);
+    return day;
+}
+
+/* Brings the marks up to the end of the mapped journal and returns where records from time start */
+static size_t history_day_seek (history_day_t* day, journal_map_t* map, int64_t time) {
+    mutex_lock(&day->mutex);
+    // a journal cut back by recovery is indexed anew
+    if (day->indexed > map->size) {
+        list_clear(day->marks);
+        day->indexed = 0;
+        day->last_bucket = INT64_MIN;
+    }
+    size_t offset = day->indexed;
+    const journal_record_t* record;
+    while ((record = journal_map_next(map, &offset)) != NULL) {
+        int64_t bucket = record->time / HISTORY_BUCKET_MS;
+        if (bucket > day->last_bucket) {
+            history_mark_t mark = {record->time, (uint64_t)((const char*)record - map->data)};
+            list_push_value(day->marks, &mark);
+            day->last_bucket = bucket;
+        }
+        day->indexed = offset;
+    }
+    // the last mark not after time, the records before it are all older
+    size_t low = 0, high = list_size(day->marks);
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if ((list_get(day->marks, middle, history_mark_t)).time <= time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    size_t start = low > 0 ? (list_get(day->marks, low - 1, history_mark_t)).offset : 0;
+    mutex_unlock(&day->mutex);
+    return start;
+}
+
+static void history_emit (history_scan_t* scan, const journal_record_t* record) {
+    history_item_t taken = {record->time, record->seq, 0};
+    if (scan->query->cbor) {
+        cbor_write_head(scan->cbor, CBOR_MAP, 3);
+        cbor_write_text(scan->cbor, "seq");
+        cbor_write_int(scan->cbor, (int64_t)record->seq);
+        cbor_write_text(scan->cbor, "time");
+        cbor_write_int(scan->cbor, record->time);
+        // the journal keeps the event as the CBOR map /event takes, it goes out untouched
+        cbor_write_text(scan->cbor, "event");
+        string_builder_append_string(scan->cbor, JOURNAL_RECORD_PAYLOAD(record), record->length);
+        taken.end = string_builder_size(scan->cbor);
+        list_push_value(scan->items, &taken);
+        scan->count++;
+        return;
+    }
+    eso_event_t* event = journal_record_event(record);
+    if (event == NULL)
+        return;
+    string_builder_t* text = eso_event_format(event);
+    json_object* item = json_object_new_object();
+    json_object_object_add(item, "seq", json_object_new_int64((int64_t)record->seq));
+    json_object_object_add(item, "time", json_object_new_int64(record->time));
+    json_object_object_add(item, "code", json_object_new_string(event->event_code));
+    json_object_object_add(item, "text", json_object_new_string(string_builder_as_cstring(text)));
+    json_object_array_add(scan->json, item);
+    string_builder_free(text);
+    eso_event_release(event);
+    list_push_value(scan->items, &taken);
+    scan->count++;
+}
+
+/* Journals are written in time order, the scan stops at the first record past the range */
+void* history_scan_day (void* _scan) {
+    history_scan_t* scan = (history_scan_t*)_scan;
+    const history_query_t* query = scan->query;
+    string_builder_t* path = journal_day_path(string_builder_as_cstring(scan->history->log_dir), scan->day_key);
+    journal_map_t* map = journal_map_open(string_builder_as_cstring(path));
+    string_builder_free(path);
+    if (map == NULL)
+        return NULL;
+    size_t offset = history_day_seek(history_day_get(scan->history, scan->day_key), map, query->from);
+    const journal_record_t* record;
+    while ((record = journal_map_next(map, &offset)) != NULL && record->time <= query->to) {
+        if (record->time < query->from || (record->time == query->from && record->seq <= query->after)
+            || (query->types & ESO_EVENT_MASK(record->type)) == 0)
+            continue;
+        if (scan->count == scan->limit) {
+            scan->more = true;
+            break;
+        }
+        history_emit(scan, record);
+    }
+    journal_map_close(map);
+    return NULL;
+}
+
+static long history_local_day_key (int64_t ms) {
+    time_t seconds = (time_t)(ms / 1000);
+    struct tm local;
+    if (localtime_r(&seconds, &local) == NULL)
+        return ms < 0 ? 0 : LONG_MAX;
+    return (long)(local.tm_year + 1900) * 10000 + (local.tm_mon + 1) * 100 + local.tm_mday;
+}
+
+static int history_compare_keys (const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Day keys of the journals the range touches, oldest first */
+static list_t* history_days_in_range (history_t* history, int64_t from, int64_t to) {
+    list_t* keys = list_create(long);
+    DIR* dir = opendir(string_builder_as_cstring(history->log_dir));
+    if (dir == NULL)
+        return keys;
+    long first = history_local_day_key(from), last = history_local_day_key(to);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        long key = strstr(entry->d_name, JOURNAL_SUFFIX) != NULL ? journal_day_key(entry->d_name) : -1;
+        if (key >= first && key <= last)
+            list_push_value(keys, &key);
+    }
+    closedir(dir);
+    qsort(keys->values, list_size(keys), sizeof(long), &history_compare_keys);
+    return keys;
+}
+
+/*
+ * Events of the range, oldest first, up to query->limit. Days are scanned HISTORY_THREADS at a
+ * time and the next batch only starts while the limit is not reached. With "more" comes "next",
+ * the time and seq of the last event, the client asks again with it as the cursor.
+ */
+string_builder_t* history_query (history_t* history, history_query_t* query) {
+    if (query->limit <= 0)
+        query->limit = HISTORY_DEFAULT_LIMIT;
+    if (query->limit > HISTORY_MAX_LIMIT)
+        query->limit = HISTORY_MAX_LIMIT;
+    list_t* keys = history_days_in_range(history, query->from, query->to);
+    string_builder_t* items = string_builder_create(query->cbor ? 4096 : 16);
+    json_object* events = json_object_new_array();
+    long count = 0;
+    bool more = false;
+    history_item_t last = {0, 0, 0};
+    for (size_t first = 0; first < list_size(keys) && !more; first += HISTORY_THREADS) {
+        history_scan_t scans[HISTORY_THREADS];
+        size_t batch = list_size(keys) - first < HISTORY_THREADS ? list_size(keys) - first : HISTORY_THREADS;
+        for (size_t i = 0; i < batch; i++) {
+            history_scan_t* scan = &scans[i];
+            scan->history = history;
+            scan->query = query;
+            scan->day_key = list_get(keys, first + i, long);
+            scan->limit = query->limit - count;
+            scan->cbor = query->cbor ? string_builder_create(4096) : NULL;
+            scan->items = list_create(history_item_t);
+            scan->json = query->cbor ? NULL : json_object_new_array();
+            scan->count = 0;
+            scan->more = false;
+        }
+        // the first day of the batch runs here, the rest on their own threads
+        bool started[HISTORY_THREADS] = {false};
+        for (size_t i = 1; i < batch; i++)
+            started[i] = pthread_create(&scans[i].thread, NULL, &history_scan_day, &scans[i]) == 0;
+        for (size_t i = 0; i < batch; i++)
+            if (!started[i])
+                history_scan_day(&scans[i]);
+        for (size_t i = 1; i < batch; i++)
+            if (started[i])
+                pthread_join(scans[i].thread, NULL);
+
+        for (size_t i = 0; i < batch; i++) {
+            history_scan_t* scan = &scans[i];
+            // the days of a batch were scanned with the same room, the later ones may not fit
+            long take = scan->count < query->limit - count ? scan->count : query->limit - count;
+            if (!more && take > 0 && query->cbor)
+                string_builder_append_string(items, string_builder_as_cstring(scan->cbor),
+                                             (list_get(scan->items, take - 1, history_item_t)).end);
+            else if (!more) {
+                for (long j = 0; j < take; j++)
+                    json_object_array_add(events, json_object_get(json_object_array_get_idx(scan->json, j)));
+            }
+            if (!more && take > 0)
+                last = list_get(scan->items, take - 1, history_item_t);
+            if (!more) {
+                count += take;
+                more = take < scan->count || scan->more || (count == query->limit && first + i + 1 < list_size(keys));
+            }
+            if (scan->cbor != NULL)
+                string_builder_free(scan->cbor);
+            list_free(scan->items);
+            if (scan->json != NULL)
+                json_object_put(scan->json);
+        }
+    }
+    list_free(keys);
+    // the cursor is the text "time:seq", the same in both formats
+    string_builder_t* next = NULL;
+    if (more) {
+        next = string_builder_create(48);
+        string_builder_append_printf(next, "%lld:%llu", (long long)last.time, (unsigned long long)last.seq);
+    }
+
+    string_builder_t* response;
+    if (query->cbor) {
+        response = string_builder_create(string_builder_size(items) + 32);
+        cbor_write_head(response, CBOR_MAP, more ? 3 : 2);
+        cbor_write_text(response, "events");
+        cbor_write_head(response, CBOR_ARRAY, (uint64_t)count);
+        string_builder_append_string(response, string_builder_as_cstring(items), string_builder_size(items));
+        cbor_write_text(response, "more");
+        cbor_write_bool(response, more);
+        if (more) {
+            cbor_write_text(response, "next");
+            cbor_write_text(response, string_builder_as_cstring(next));
+        }
+        json_object_put(events);
+    }
+    else {
+        json_object* root = json_object_new_object();
+        json_object_object_add(root, "events", events);
+        json_object_object_add(root, "more", json_object_new_boolean(more));
+        if (more)
+            json_object_object_add(root, "next", json_object_new_string(string_builder_as_cstring(next)));
+        response = string_builder_copy(json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN));
+        json_object_put(root);
+    }
+    string_builder_free(items);
+    if (next != NULL)
+        string_builder_free(next);
+    return response;
+}
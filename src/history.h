@@ -0,0 +1,61 @@
+#ifndef NOTIFIER_HISTORY_H_HEADER
+#define NOTIFIER_HISTORY_H_HEADER
+
+#include <stdint.h>
+#include "main.h"
+#include "journal.h"
+
+/*
+ * Past events for GET /history, read from the day journals mapped read only.
+ * Every journal gets a sparse time index in memory: the offset of the first record of each
+ * HISTORY_INDEX_MINUTES, so a range starts close to its first record instead of at the top.
+ * The index of the current day is extended as the journal grows.
+ */
+
+#define HISTORY_INDEX_MINUTES   5
+#define HISTORY_THREADS         4       // days scanned at once
+#define HISTORY_DEFAULT_LIMIT   1000
+#define HISTORY_MAX_LIMIT       10000
+
+typedef struct history_mark {
+    int64_t time;           // of the first record in the bucket
+    uint64_t offset;
+} history_mark_t;
+
+typedef struct history_day {
+    long day_key;
+    mutex_t mutex;          // marks and indexed
+    list_t* marks;          // history_mark_t, in file order
+    size_t indexed;         // journal bytes covered by the marks
+    int64_t last_bucket;
+} history_day_t;
+
+typedef struct history {
+    string_builder_t* log_dir;
+    mutex_t mutex;          // days
+    list_t* days;           // history_day_t*
+} history_t;
+
+/* What a query asks for */
+typedef struct history_query {
+    int64_t from;           // ms, inclusive
+    int64_t to;             // ms, inclusive
+    uint64_t after;         // seq of the last event a page ended with, those up to it at from are skipped
+    uint32_t types;         // ESO_EVENT_MASK bits
+    long limit;
+    bool cbor;              // the stored CBOR as it is instead of JSON with the text lines
+} history_query_t;
+
+/* Where an event sits, the last one of a page is the cursor of the next */
+typedef struct history_item {
+    int64_t time;
+    uint64_t seq;
+    size_t end;             // of its CBOR item
+} history_item_t;
+
+history_t* history_create (const char* log_dir);
+uint32_t history_parse_types (const char* types);
+string_builder_t* history_query (history_t* history, history_query_t* query);
+void history_free (history_t* history);
+
+#endif
@@ -1,8 +1,15 @@
 #include "http.h"
 //#include "main.h"
 
+/* 200 header blocks up to the content-length line, by content type and keep-alive */
+const char* http_content_types[] = {HTTP_CONTENT_PLAIN, HTTP_CONTENT_HTML, HTTP_CONTENT_JSON, HTTP_CONTENT_CBOR};
+#define HTTP_CONTENT_TYPES (sizeof(http_content_types) / sizeof(http_content_types[0]))
+
+string_builder_t* http_ok_headers[HTTP_CONTENT_TYPES][2];
+string_builder_t* http_static_responses[HTTP_STATIC_RESPONSES][2];
+
 void add_http_version (string_builder_t* builder) {
-    string_builder_append(builder, "HTTP/1.0 ");
+    string_builder_append(builder, HTTP_VERSION " ");
 }
 
 void add_http_ok (string_builder_t* builder) {
@@ -16,7 +23,7 @@ void add_http_header (string_builder_t* builder, char* name, char* value) {
     string_builder_append(builder, "\r\n");
 }
 
-void http_not_found (string_builder_t* builder) {
+void http_not_found (string_builder_t* builder, bool keep_alive) {
     // length 146
     char result[] = "<html><head><title>404 Not Found</title></head>\n<body>\n<center><h1>404 Not Found</h1></center>\n<hr><center>cringinx/3.22</center>\n</body>\n</html>";
     add_http_version(builder);
@@ -24,13 +31,44 @@ void http_not_found (string_builder_t* builder) {
     string_builder_append(builder, HTTP_CRLF);
     http_server_header(builder);
     http_cors_header(builder);
+    http_connection_header(builder, keep_alive);
     add_http_header(builder, "content-length", "146");
     add_http_header(builder, "content-type", HTTP_CONTENT_HTML);
     string_builder_append(builder, HTTP_CRLF);
     string_builder_append_string(builder, result, 146);
 }
 
-void http_respond_text (string_builder_t* builder, string_builder_t* response, char* content_type) {
+void http_error (string_builder_t* builder, const char* status, char* message, bool keep_alive) {
+    char message_length_string[32];
+    sprintf(message_length_string, "%ld", strlen(message));
+    add_http_version(builder);
+    string_builder_append(builder, (char*)status);
+    string_builder_append(builder, HTTP_CRLF);
+    http_server_header(builder);
+    http_cors_header(builder);
+    http_connection_header(builder, keep_alive);
+    add_http_header(builder, "content-length", message_length_string);
+    add_http_header(builder, "content-type", HTTP_CONTENT_PLAIN);
+    string_builder_append(builder, HTTP_CRLF);
+    string_builder_append(builder, message);
+}
+
+void http_bad_request (string_builder_t* builder, char* message, bool keep_alive) {
+    http_error(builder, HTTP_BAD_REQUEST, message, keep_alive);
+}
+
+void http_switching_protocols (string_builder_t* builder, const char* websocket_accept) {
+    add_http_version(builder);
+    string_builder_append(builder, HTTP_SWITCHING_PROTOCOLS);
+    string_builder_append(builder, HTTP_CRLF);
+    http_server_header(builder);
+    add_http_header(builder, "upgrade", "websocket");
+    add_http_header(builder, "connection", "Upgrade");
+    add_http_header(builder, "sec-websocket-accept", (char*)websocket_accept);
+    string_builder_append(builder, HTTP_CRLF);
+}
+
+void http_respond_text (string_builder_t* builder, string_builder_t* response, char* content_type, bool keep_alive) {
     size_t response_length = response->value_null - response->value;
     char response_length_string[256];
     sprintf(response_length_string, "%ld", response_length);
@@ -40,19 +78,22 @@ void http_respond_text (string_builder_t* builder, string_builder_t* response, c
     string_builder_append(builder, HTTP_CRLF);
     http_server_header(builder);
     http_cors_header(builder);
+    http_connection_header(builder, keep_alive);
     add_http_header(builder, "content-length", response_length_string);
     add_http_header(builder, "content-type", content_type);
     string_builder_append(builder, HTTP_CRLF);
     string_builder_append_string(builder, response->value, response_length);
 }
 
-void http_respond_options (string_builder_t* builder, char* method_list_string) {
+void http_respond_options (string_builder_t* builder, char* method_list_string, bool keep_alive) {
     add_http_version(builder);
     string_builder_append(builder, HTTP_OK);
     string_builder_append(builder, HTTP_CRLF);
     add_http_header(builder, "allow", method_list_string);
     http_server_header(builder);
     http_cors_header(builder);
+    http_connection_header(builder, keep_alive);
+    add_http_header(builder, "content-length", "0");
     string_builder_append(builder, HTTP_CRLF);
 }
 
@@ -63,4 +104,161 @@ void http_server_header (string_builder_t* builder) {
 void http_cors_header (string_builder_t* builder) {
     add_http_header(builder, "access-control-allow-origin", HTTP_CORS_ORIGIN);
     add_http_header(builder, "access-control-allow-headers", "*");
-}
\ No newline at end of file
+}
+
+void http_connection_header (string_builder_t* builder, bool keep_alive) {
+    add_http_header(builder, "connection", keep_alive ? "keep-alive" : "close");
+}
+
+/* Compares the path part of the uri, the query string is ignored */
+bool http_uri_path_equals (const char* uri, const char* path) {
+    size_t length = strlen(path);
+    return strncmp(uri, path, length) == 0 && (uri[length] == '\0' || uri[length] == '?');
+}
+
+/* "application/cbor; charset=x" is application/cbor, parameters are ignored */
+bool http_media_type_is (const char* value, const char* type) {
+    if (value == NULL)
+        return false;
+    while (*value == ' ')
+        value++;
+    size_t length = strlen(type);
+    if (strncasecmp(value, type, length) != 0)
+        return false;
+    char next = value[length];
+    return next == '\0' || next == ';' || next == ' ' || next == ',';
+}
+
+/* Whether one of the comma separated types of an Accept header is type */
+bool http_accepts (const char* accept, const char* type) {
+    while (accept != NULL) {
+        if (http_media_type_is(accept, type))
+            return true;
+        accept = strchr(accept, ',');
+        if (accept != NULL)
+            accept++;
+    }
+    return false;
+}
+
+/* The raw value of a query parameter, ends at '&' or the end of the uri */
+const char* http_uri_query_find (const char* uri, const char* name) {
+    const char* query = strchr(uri, '?');
+    if (query == NULL)
+        return NULL;
+    size_t name_length = strlen(name);
+    const char* param = query + 1;
+    while (*param != '\0') {
+        if (strncmp(param, name, name_length) == 0 && param[name_length] == '=')
+            return param + name_length + 1;
+        const char* next = strchr(param, '&');
+        if (next == NULL)
+            break;
+        param = next + 1;
+    }
+    return NULL;
+}
+
+long http_uri_query_long (const char* uri, const char* name, long default_value) {
+    const char* param = http_uri_query_find(uri, name);
+    if (param == NULL)
+        return default_value;
+    char* end;
+    long value = strtol(param, &end, 10);
+    if (end == param || (*end != '\0' && *end != '&'))
+        return default_value;
+    return value;
+}
+
+int http_hex_digit (char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Percent and '+' decoded value, NULL without the parameter */
+string_builder_t* http_uri_query_string (const char* uri, const char* name) {
+    const char* param = http_uri_query_find(uri, name);
+    if (param == NULL)
+        return NULL;
+    string_builder_t* value = string_builder_create(32);
+    for (; *param != '\0' && *param != '&'; param++) {
+        char c = *param;
+        if (c == '+')
+            c = ' ';
+        else if (c == '%' && http_hex_digit(param[1]) >= 0 && http_hex_digit(param[2]) >= 0) {
+            c = (char)(http_hex_digit(param[1]) << 4 | http_hex_digit(param[2]));
+            param += 2;
+        }
+        string_builder_append_string(value, &c, 1);
+    }
+    return value;
+}
+
+void http_ok_header_block (string_builder_t* builder, const char* content_type, bool keep_alive) {
+    add_http_version(builder);
+    string_builder_append(builder, HTTP_OK);
+    string_builder_append(builder, HTTP_CRLF);
+    http_server_header(builder);
+    http_cors_header(builder);
+    http_connection_header(builder, keep_alive);
+    add_http_header(builder, "content-type", (char*)content_type);
+}
+
+/* Must run before the server starts, everything rendered here is read only afterwards */
+void http_init (char* options_method_list) {
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        for (size_t i = 0; i < HTTP_CONTENT_TYPES; i++) {
+            http_ok_headers[i][keep_alive] = string_builder_create(256);
+            http_ok_header_block(http_ok_headers[i][keep_alive], http_content_types[i], keep_alive);
+        }
+        string_builder_t* not_found = string_builder_create(512);
+        http_not_found(not_found, keep_alive);
+        http_static_responses[HTTP_STATIC_NOT_FOUND][keep_alive] = not_found;
+        string_builder_t* options = string_builder_create(256);
+        http_respond_options(options, options_method_list, keep_alive);
+        http_static_responses[HTTP_STATIC_OPTIONS][keep_alive] = options;
+        string_builder_t* bad_request = string_builder_create(256);
+        http_bad_request(bad_request, "bad request", keep_alive);
+        http_static_responses[HTTP_STATIC_BAD_REQUEST][keep_alive] = bad_request;
+        string_builder_t* too_large = string_builder_create(256);
+        http_error(too_large, HTTP_PAYLOAD_TOO_LARGE, "payload too large", keep_alive);
+        http_static_responses[HTTP_STATIC_TOO_LARGE][keep_alive] = too_large;
+    }
+}
+
+void http_free () {
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        for (size_t i = 0; i < HTTP_CONTENT_TYPES; i++)
+            string_builder_free(http_ok_headers[i][keep_alive]);
+        for (int i = 0; i < HTTP_STATIC_RESPONSES; i++)
+            string_builder_free(http_static_responses[i][keep_alive]);
+    }
+}
+
+const string_builder_t* http_static_response (int response, bool keep_alive) {
+    return http_static_responses[response][keep_alive];
+}
+
+/* The body is pointed to, not copied, it has to stay alive until the response is sent */
+void http_response_prepare (http_response_t* response, const char* content_type, bool keep_alive,
+                            const char* body, size_t body_length) {
+    string_builder_t* header = http_ok_headers[0][keep_alive];
+    for (size_t i = 0; i < HTTP_CONTENT_TYPES; i++) {
+        if (strcmp(content_type, http_content_types[i]) == 0) {
+            header = http_ok_headers[i][keep_alive];
+            break;
+        }
+    }
+    int length_line = sprintf(response->length_line, "content-length: %ld" HTTP_CRLF HTTP_CRLF, body_length);
+    response->iov[0].iov_base = header->value;
+    response->iov[0].iov_len = string_builder_size(header);
+    response->iov[1].iov_base = response->length_line;
+    response->iov[1].iov_len = length_line;
+    response->iov[2].iov_base = (void*)body;
+    response->iov[2].iov_len = body_length;
+}
@@ -1,6 +1,7 @@
 #ifndef NOTIFIER_HTTP_H_HEADER
 #define NOTIFIER_HTTP_H_HEADER
 
+#include <sys/uio.h>
 #include "util.h"
 
 #define HTTP_CRLF "\r\n"
@@ -9,10 +10,27 @@
 
 #define HTTP_OK "200 OK"
 #define HTTP_NOT_FOUND "404 NOT FOUND"
+#define HTTP_BAD_REQUEST "400 BAD REQUEST"
+#define HTTP_PAYLOAD_TOO_LARGE "413 PAYLOAD TOO LARGE"
+#define HTTP_SWITCHING_PROTOCOLS "101 SWITCHING PROTOCOLS"
 
 #define HTTP_CONTENT_PLAIN "text/plain"
 #define HTTP_CONTENT_HTML "text/html"
 #define HTTP_CONTENT_JSON "application/json"
+#define HTTP_CONTENT_CBOR "application/cbor"
+
+/* Responses rendered once by http_init */
+#define HTTP_STATIC_NOT_FOUND   0
+#define HTTP_STATIC_OPTIONS     1
+#define HTTP_STATIC_BAD_REQUEST 2
+#define HTTP_STATIC_TOO_LARGE   3
+#define HTTP_STATIC_RESPONSES   4
+
+/* Pre-rendered header block, the content-length line and the body, ready for writev */
+typedef struct http_response {
+    struct iovec iov[3];
+    char length_line[48];
+} http_response_t;
 
 void add_http_version (string_builder_t* builder);
 void add_http_ok (string_builder_t* builder);
@@ -20,9 +38,25 @@ void add_http_header (string_builder_t* builder, char* name, char* value);
 
 void http_server_header (string_builder_t* builder);
 void http_cors_header (string_builder_t* builder);
-
-void http_respond_options (string_builder_t* builder, char* method_list_string);
-void http_respond_text (string_builder_t* builder, string_builder_t* response, char* content_type);
-void http_not_found (string_builder_t* builder);
+void http_connection_header (string_builder_t* builder, bool keep_alive);
+
+void http_respond_options (string_builder_t* builder, char* method_list_string, bool keep_alive);
+void http_respond_text (string_builder_t* builder, string_builder_t* response, char* content_type, bool keep_alive);
+void http_not_found (string_builder_t* builder, bool keep_alive);
+void http_error (string_builder_t* builder, const char* status, char* message, bool keep_alive);
+void http_bad_request (string_builder_t* builder, char* message, bool keep_alive);
+void http_switching_protocols (string_builder_t* builder, const char* websocket_accept);
+
+void http_init (char* options_method_list);
+void http_free ();
+const string_builder_t* http_static_response (int response, bool keep_alive);
+void http_response_prepare (http_response_t* response, const char* content_type, bool keep_alive,
+                            const char* body, size_t body_length);
+
+bool http_uri_path_equals (const char* uri, const char* path);
+bool http_media_type_is (const char* value, const char* type);
+bool http_accepts (const char* accept, const char* type);
+long http_uri_query_long (const char* uri, const char* name, long default_value);
+string_builder_t* http_uri_query_string (const char* uri, const char* name);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "journal.h"
+#include "eso-cbor.h"
+
+_Static_assert(sizeof(journal_file_header_t) % JOURNAL_ALIGN == 0, "journal file header breaks the alignment");
+_Static_assert(sizeof(journal_record_t) % JOURNAL_ALIGN == 0, "journal record header breaks the alignment");
+
+/* Everything after the crc field, so a torn write of any part shows */
+static uint32_t journal_crc (const char* record, size_t length) {
+    size_t skip = offsetof(journal_record_t, seq);
+    return (uint32_t)crc32(0, (const Bytef*)record + skip, (uInt)(sizeof(journal_record_t) - skip + length));
+}
+
+int64_t journal_now () {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void journal_file_header_fill (journal_file_header_t* header) {
+    memset(header, 0, sizeof(journal_file_header_t));
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->version = JOURNAL_VERSION;
+}
+
+/* Appends one record, out has to end at a JOURNAL_ALIGN boundary of the file */
+void journal_append (string_builder_t* out, uint64_t seq, int64_t time, eso_event_t* event) {
+    static const char padding[JOURNAL_ALIGN];
+    journal_record_t record;
+    memset(&record, 0, sizeof(record));
+    size_t start = string_builder_size(out);
+    string_builder_append_string(out, (const char*)&record, sizeof(record));
+    eso_event_to_cbor(out, event);
+    size_t length = string_builder_size(out) - start - sizeof(record);
+    string_builder_append_string(out, padding, JOURNAL_PADDED(length) - length);
+
+    record.length = (uint32_t)length;
+    record.seq = seq;
+    record.time = time;
+    record.type = event->event_type > 0 ? (uint32_t)event->event_type : 0;
+    // the builder may have moved while growing
+    char* at = out->value + start;
+    memcpy(at, &record, sizeof(record));
+    record.crc = journal_crc(at, length);
+    memcpy(at + offsetof(journal_record_t, crc), &record.crc, sizeof(record.crc));
+}
+
+journal_map_t* journal_map_open (const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(journal_file_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    const journal_file_header_t* header = data;
+    if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 || header->version != JOURNAL_VERSION) {
+        printf("\"%s\" is not a journal of version %d\n", path, JOURNAL_VERSION);
+        munmap(data, file_stat.st_size);
+        return NULL;
+    }
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+    journal_map_t* map = MALLOC_STRUCT(journal_map_t);
+    map->data = data;
+    map->size = file_stat.st_size;
+    return map;
+}
+
+/* Start with offset 0. NULL at the end, or at the first record that is torn or damaged */
+const journal_record_t* journal_map_next (journal_map_t* map, size_t* offset) {
+    if (*offset < sizeof(journal_file_header_t))
+        *offset = sizeof(journal_file_header_t);
+    if (map->size - *offset < sizeof(journal_record_t))
+        return NULL;
+    const journal_record_t* record = (const journal_record_t*)(map->data + *offset);
+    if (record->length > JOURNAL_RECORD_MAX
+        || map->size - *offset - sizeof(journal_record_t) < JOURNAL_PADDED(record->length)
+        || journal_crc((const char*)record, record->length) != record->crc)
+        return NULL;
+    *offset += sizeof(journal_record_t) + JOURNAL_PADDED(record->length);
+    return record;
+}
+
+void journal_map_close (journal_map_t* map) {
+    munmap((void*)map->data, map->size);
+    free(map);
+}
+
+eso_event_t* journal_record_event (const journal_record_t* record) {
+    return parse_eso_event_cbor(JOURNAL_RECORD_PAYLOAD(record), record->length);
+}
+
+/* "dd-mm-YYYY", with or without JOURNAL_SUFFIX, as YYYYMMDD, -1 for other names */
+long journal_day_key (const char* name) {
+    int day, month, year, end = 0;
+    if (sscanf(name, "%2d-%2d-%4d%n", &day, &month, &year, &end) != 3 || end != 10)
+        return -1;
+    if (name[end] != '\0' && !STREQUAL(name + end, JOURNAL_SUFFIX))
+        return -1;
+    return (long)year * 10000 + month * 100 + day;
+}
+
+string_builder_t* journal_day_path (const char* log_dir, long day_key) {
+    string_builder_t* path = string_builder_copy(log_dir);
+    string_builder_append_printf(path, "%02ld-%02ld-%04ld" JOURNAL_SUFFIX,
+                                 day_key % 100, day_key / 100 % 100, day_key / 10000);
+    return path;
+}
+
+static int journal_compare_keys_newest_first (const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return x > y ? -1 : x < y;
+}
+
+/* The next offset from where a good record starts, when a damaged one stopped journal_map_next */
+static bool journal_map_resync (journal_map_t* map, size_t* offset) {
+    for (size_t at = *offset + JOURNAL_ALIGN; at + sizeof(journal_record_t) <= map->size; at += JOURNAL_ALIGN) {
+        size_t next = at;
+        if (journal_map_next(map, &next) != NULL) {
+            *offset = at;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The sequence number of the last good record of a journal, 0 when it has none. valid_end and
+ * size are where the first run of good records ends and how big the file is, 0 for a file that is
+ * not a journal. Good records past a damaged one count for the seq and set damaged_inside.
+ */
+static uint64_t journal_last_seq (const char* path, size_t* valid_end, size_t* size, bool* damaged_inside) {
+    uint64_t seq = 0;
+    *valid_end = 0;
+    *size = 0;
+    *damaged_inside = false;
+    journal_map_t* map = journal_map_open(path);
+    if (map == NULL) {
+        struct stat file_stat;
+        if (stat(path, &file_stat) == 0)
+            *size = file_stat.st_size;
+        return 0;
+    }
+    *size = map->size;
+    size_t offset = 0;
+    const journal_record_t* record;
+    while ((record = journal_map_next(map, &offset)) != NULL)
+        seq = record->seq;
+    *valid_end = offset < sizeof(journal_file_header_t) ? sizeof(journal_file_header_t) : offset;
+    while (journal_map_resync(map, &offset)) {
+        *damaged_inside = true;
+        while ((record = journal_map_next(map, &offset)) != NULL)
+            seq = record->seq;
+    }
+    journal_map_close(map);
+    return seq;
+}
+
+/* The newest journal is the one appended to, a crash leaves its end torn */
+static void journal_repair (const char* path, size_t valid_end, size_t size, bool damaged_inside) {
+    // not ours or of another version, or good records follow the damage: it is kept aside for a look
+    if ((valid_end == 0 && size >= sizeof(journal_file_header_t)) || damaged_inside) {
+        string_builder_t* aside = string_builder_copy(path);
+        string_builder_append(aside, ".damaged");
+        if (rename(path, string_builder_as_cstring(aside)) != 0)
+            printf("err %d, cannot move journal \"%s\" aside\n", errno, path);
+        string_builder_free(aside);
+        return;
+    }
+    // a torn file header is dropped too, the writer puts a new one in
+    if (valid_end < size) {
+        printf("journal \"%s\": dropping %zu damaged bytes at the end\n", path, size - valid_end);
+        if (truncate(path, valid_end) != 0)
+            printf("err %d, cannot truncate journal \"%s\"\n", errno, path);
+    }
+}
+
+/*
+ * Cuts off a record a crash left half written at the end of the newest journal, so the appends
+ * that follow stay aligned, and returns the last sequence number on disk, 0 without journals.
+ * Damage with good records after it is not cut, the file is moved aside and a new one started.
+ * The newest journal may have no record yet, then the older ones are asked, newest first.
+ */
+uint64_t journal_recover (const char* log_dir) {
+    DIR* dir = opendir(log_dir);
+    if (dir == NULL)
+        return 0;
+    list_t* keys = list_create(long);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        long key = strstr(entry->d_name, JOURNAL_SUFFIX) != NULL ? journal_day_key(entry->d_name) : -1;
+        if (key >= 0)
+            list_push_value(keys, &key);
+    }
+    closedir(dir);
+    qsort(keys->values, list_size(keys), sizeof(long), &journal_compare_keys_newest_first);
+
+    uint64_t seq = 0;
+    for (size_t i = 0; i < list_size(keys) && seq == 0; i++) {
+        string_builder_t* path = journal_day_path(log_dir, list_get(keys, i, long));
+        size_t valid_end, size;
+        bool damaged_inside;
+        seq = journal_last_seq(string_builder_as_cstring(path), &valid_end, &size, &damaged_inside);
+        if (i == 0)
+            journal_repair(string_builder_as_cstring(path), valid_end, size, damaged_inside);
+        string_builder_free(path);
+    }
+    list_free(keys);
+    return seq;
+}
@@ -0,0 +1,56 @@
+#ifndef NOTIFIER_JOURNAL_H_HEADER
+#define NOTIFIER_JOURNAL_H_HEADER
+
+#include <stdint.h>
+#include "main.h"
+#include "eso.h"
+
+/*
+ * Day journal "dd-mm-YYYY.journal": a file header, then records one after another.
+ * Every record is a fixed header and the event as the CBOR map /event accepts, padded
+ * to JOURNAL_ALIGN so the headers of a mapped file can be read in place. Host byte order.
+ */
+
+#define JOURNAL_MAGIC           "ESOJRNL1"
+#define JOURNAL_VERSION         1
+#define JOURNAL_SUFFIX          ".journal"
+#define JOURNAL_ALIGN           8
+#define JOURNAL_RECORD_MAX      (16 * 1024 * 1024)
+
+typedef struct journal_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} journal_file_header_t;
+
+typedef struct journal_record {
+    uint32_t length;        // CBOR bytes after the header, without the padding
+    uint32_t crc;           // crc32 of the rest of the header and the CBOR
+    uint64_t seq;           // grows by one per event over all the days
+    int64_t time;           // unix time in ms
+    uint32_t type;          // ESO_EVENT_*, 0 for unexpected events
+    uint32_t reserved;
+} journal_record_t;
+
+/* A journal mapped read only */
+typedef struct journal_map {
+    const char* data;
+    size_t size;
+} journal_map_t;
+
+#define JOURNAL_PADDED(length) (((length) + JOURNAL_ALIGN - 1) & ~(size_t)(JOURNAL_ALIGN - 1))
+#define JOURNAL_RECORD_PAYLOAD(record) ((const char*)(record) + sizeof(journal_record_t))
+
+void journal_append (string_builder_t* out, uint64_t seq, int64_t time, eso_event_t* event);
+void journal_file_header_fill (journal_file_header_t* header);
+int64_t journal_now ();
+uint64_t journal_recover (const char* log_dir);
+long journal_day_key (const char* name);
+string_builder_t* journal_day_path (const char* log_dir, long day_key);
+
+journal_map_t* journal_map_open (const char* path);
+const journal_record_t* journal_map_next (journal_map_t* map, size_t* offset);
+void journal_map_close (journal_map_t* map);
+eso_event_t* journal_record_event (const journal_record_t* record);
+
+#endif
@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#include <zlib.h>
+#include "log-archive.h"
+
+void* log_archive_worker (void* _archive);
+
+log_archive_t* log_archive_create (const char* log_dir) {
+    log_archive_t* archive = MALLOC_STRUCT(log_archive_t);
+    archive->log_dir = log_dir;
+    // the files left from the previous runs are looked at right away
+    archive->pending = true;
+    archive->running = true;
+    mutex_init(&archive->mutex);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&archive->wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    if (pthread_create(&archive->thread, NULL, &log_archive_worker, (void*)archive) != 0) {
+        printf("couldn't start the log compression\n");
+        mutex_free(&archive->mutex);
+        pthread_cond_destroy(&archive->wake);
+        free(archive);
+        return NULL;
+    }
+    return archive;
+}
+
+void log_archive_notify (log_archive_t* archive) {
+    mutex_lock(&archive->mutex);
+    archive->pending = true;
+    pthread_cond_signal(&archive->wake);
+    mutex_unlock(&archive->mutex);
+}
+
+/* A compression in progress is abandoned, the day is compressed again on the next start */
+void log_archive_free (log_archive_t* archive) {
+    mutex_lock(&archive->mutex);
+    archive->running = false;
+    pthread_cond_signal(&archive->wake);
+    mutex_unlock(&archive->mutex);
+    pthread_join(archive->thread, NULL);
+    mutex_free(&archive->mutex);
+    pthread_cond_destroy(&archive->wake);
+    free(archive);
+}
+
+bool log_archive_running (log_archive_t* archive) {
+    mutex_lock(&archive->mutex);
+    bool running = archive->running;
+    mutex_unlock(&archive->mutex);
+    return running;
+}
+
+/* "dd-mm-YYYY.txt", the names the file saver gives to day files */
+bool log_archive_is_day_file (const char* name) {
+    static const char pattern[] = "00-00-0000.txt";
+    if (strlen(name) != sizeof(pattern) - 1)
+        return false;
+    for (size_t i = 0; i < sizeof(pattern) - 1; i++) {
+        if (pattern[i] == '0' ? name[i] < '0' || name[i] > '9' : name[i] != pattern[i])
+            return false;
+    }
+    return true;
+}
+
+ssize_t log_archive_read (int fd, char* buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t read_bytes = read(fd, buffer + total, size - total);
+        if (read_bytes < 0 && errno == EINTR)
+            continue;
+        if (read_bytes < 0)
+            return -1;
+        if (read_bytes == 0)
+            break;
+        total += read_bytes;
+    }
+    return total;
+}
+
+/* Decompresses gz_path and compares it with the original byte by byte, gzread checks the crc at the end */
+bool log_archive_verify (int fd, const char* gz_path, char* buffer, char* unpacked) {
+    if (lseek(fd, 0, SEEK_SET) != 0)
+        return false;
+    gzFile check = gzopen(gz_path, "rb");
+    if (check == NULL)
+        return false;
+    bool same = true;
+    while (same) {
+        ssize_t read_bytes = log_archive_read(fd, buffer, LOG_ARCHIVE_CHUNK_SIZE);
+        int unpacked_bytes = gzread(check, unpacked, LOG_ARCHIVE_CHUNK_SIZE);
+        same = read_bytes >= 0 && unpacked_bytes == read_bytes && memcmp(buffer, unpacked, read_bytes) == 0;
+        if (read_bytes == 0)
+            break;
+    }
+    return gzclose(check) == Z_OK && same;
+}
+
+bool log_archive_write (log_archive_t* archive, int fd, const char* gz_path, char* buffer) {
+    gzFile out = gzopen(gz_path, "wb9");
+    if (out == NULL)
+        return false;
+    ssize_t read_bytes;
+    bool written = true;
+    while (written && (read_bytes = log_archive_read(fd, buffer, LOG_ARCHIVE_CHUNK_SIZE)) > 0)
+        written = gzwrite(out, buffer, read_bytes) == read_bytes && log_archive_running(archive);
+    return gzclose(out) == Z_OK && written && read_bytes == 0;
+}
+
+/* name.txt becomes name.txt.gz, the original is only removed once the copy reads back the same */
+bool log_archive_compress (log_archive_t* archive, const char* file_path) {
+    string_builder_t* path = string_builder_copy(file_path);
+    string_builder_t* gz_path = string_builder_copy(string_builder_as_cstring(path));
+    string_builder_append(gz_path, LOG_ARCHIVE_SUFFIX);
+    string_builder_t* tmp_path = string_builder_copy(string_builder_as_cstring(gz_path));
+    string_builder_append(tmp_path, ".tmp");
+    const char* tmp_path_s = string_builder_as_cstring(tmp_path);
+
+    bool done = false;
+    char* buffer = malloc(LOG_ARCHIVE_CHUNK_SIZE * 2);
+    int fd = open(string_builder_as_cstring(path), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0
+        && log_archive_write(archive, fd, tmp_path_s, buffer)
+        && log_archive_verify(fd, tmp_path_s, buffer, buffer + LOG_ARCHIVE_CHUNK_SIZE)) {
+        int tmp_fd = open(tmp_path_s, O_RDONLY | O_CLOEXEC);
+        done = tmp_fd >= 0 && fsync(tmp_fd) == 0;
+        if (tmp_fd >= 0) {
+#ifdef POSIX_FADV_DONTNEED
+            // nobody reads old days soon, don't keep them in the page cache
+            posix_fadvise(tmp_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+            close(tmp_fd);
+        }
+        done = done && rename(tmp_path_s, string_builder_as_cstring(gz_path)) == 0;
+        if (done)
+            unlink(string_builder_as_cstring(path));
+    }
+    if (!done) {
+        if (log_archive_running(archive))
+            printf("err %d, cannot compress log file \"%s\"\n", errno, string_builder_as_cstring(path));
+        unlink(tmp_path_s);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buffer);
+    string_builder_free(path);
+    string_builder_free(gz_path);
+    string_builder_free(tmp_path);
+    return done;
+}
+
+/* Past day files of dir_path and of the partition directories under it, see file_partition */
+bool log_archive_scan_dir (log_archive_t* archive, const char* dir_path, const char* today, time_t now, int depth) {
+    DIR* dir = opendir(dir_path);
+    if (dir == NULL) {
+        printf("err %d, cannot list \"%s\"\n", errno, dir_path);
+        return false;
+    }
+    bool deferred = false;
+    struct dirent* entry;
+    list_t* names = list_create(char*);
+    while ((entry = readdir(dir)) != NULL) {
+        if (!STREQUAL(entry->d_name, ".") && !STREQUAL(entry->d_name, "..")
+            && (log_archive_is_day_file(entry->d_name) ? !STREQUAL(entry->d_name, today) : depth > 0))
+            list_push(names, strdup(entry->d_name));
+    }
+    closedir(dir);
+
+    for (size_t i = 0; i < list_size(names); i++) {
+        char* name = list_get(names, i, char*);
+        string_builder_t* path = string_builder_copy(dir_path);
+        string_builder_append(path, name);
+        struct stat file_stat;
+        bool found = stat(string_builder_as_cstring(path), &file_stat) == 0;
+        if (found && S_ISDIR(file_stat.st_mode)) {
+            string_builder_append(path, FILE_SEP_S);
+            deferred = log_archive_scan_dir(archive, string_builder_as_cstring(path), today, now, depth - 1) || deferred;
+        }
+        else if (found && log_archive_is_day_file(name)) {
+            // the writer may still be finishing the day that just ended
+            if (now - file_stat.st_mtime < LOG_ARCHIVE_MIN_AGE)
+                deferred = true;
+            else if (log_archive_running(archive))
+                log_archive_compress(archive, string_builder_as_cstring(path));
+        }
+        string_builder_free(path);
+        free(name);
+    }
+    list_free(names);
+    return deferred;
+}
+
+/* Compresses every past day file, true when some file was written too recently and has to wait */
+bool log_archive_scan (log_archive_t* archive) {
+    time_t now = time(NULL);
+    struct tm local_time;
+    localtime_r(&now, &local_time);
+    char today[16];
+    strftime(today, sizeof(today), "%d-%m-%Y.txt", &local_time);
+    bool deferred = log_archive_scan_dir(archive, archive->log_dir, today, now, 0);
+
+    string_builder_t* partitions = string_builder_copy(archive->log_dir);
+    string_builder_append(partitions, LOG_ARCHIVE_PARTITION_DIR FILE_SEP_S);
+    struct stat dir_stat;
+    if (stat(string_builder_as_cstring(partitions), &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode))
+        deferred = log_archive_scan_dir(archive, string_builder_as_cstring(partitions), today, now, 2) || deferred;
+    string_builder_free(partitions);
+    return deferred;
+}
+
+void* log_archive_worker (void* _archive) {
+    log_archive_t* archive = (log_archive_t*)_archive;
+#ifdef __linux__
+    // the thread is its own scheduling entity, only the compression gets the lowest priority
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    // idle io class: IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+    bool deferred = false;
+    mutex_lock(&archive->mutex);
+    while (archive->running) {
+        if (!archive->pending) {
+            if (!deferred) {
+                pthread_cond_wait(&archive->wake, &archive->mutex);
+                continue;
+            }
+            long long retry_ms = get_monotonic_ms() + LOG_ARCHIVE_MIN_AGE * 1000;
+            struct timespec retry;
+            retry.tv_sec = retry_ms / 1000;
+            retry.tv_nsec = (retry_ms % 1000) * 1000000;
+            if (pthread_cond_timedwait(&archive->wake, &archive->mutex, &retry) == 0)
+                continue;
+        }
+        archive->pending = false;
+        mutex_unlock(&archive->mutex);
+        deferred = log_archive_scan(archive);
+        mutex_lock(&archive->mutex);
+    }
+    mutex_unlock(&archive->mutex);
+    return NULL;
+}
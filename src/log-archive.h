@@ -0,0 +1,25 @@
+#ifndef NOTIFIER_LOG_ARCHIVE_H_HEADER
+#define NOTIFIER_LOG_ARCHIVE_H_HEADER
+
+#include "main.h"
+
+#define LOG_ARCHIVE_CHUNK_SIZE  65536
+#define LOG_ARCHIVE_MIN_AGE     60      // seconds without writes before a past day is compressed
+#define LOG_ARCHIVE_SUFFIX      ".gz"
+#define LOG_ARCHIVE_PARTITION_DIR "nodes" // node and actor directories of file_partition
+
+/* Compresses past day files on a low priority thread, woken at start and on every day change */
+typedef struct log_archive {
+    const char* log_dir;    // ends with FILE_SEP
+    pthread_t thread;
+    mutex_t mutex;
+    pthread_cond_t wake;
+    bool pending;
+    bool running;
+} log_archive_t;
+
+log_archive_t* log_archive_create (const char* log_dir);
+void log_archive_notify (log_archive_t* archive);
+void log_archive_free (log_archive_t* archive);
+
+#endif
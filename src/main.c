@@ -1,61 +1,303 @@
 #include <json.h>
 #include <telebot.h>
-#include <sys/socket.h>
 #include <pthread.h>
 #include <locale.h>
+#include <limits.h>
 
 #include "main.h"
 #include "server.h"
 #include "eso.h"
+#include "eso-cbor.h"
 #include "telegram.h"
 #include "config.h"
 #include "file-saver.h"
+#include "event-queue.h"
 
 const char commands_uri[] = "/commands";
 const char event_uri[] = "/event";
+const char events_uri[] = "/events";
+const char websocket_uri[] = "/ws";
+const char search_uri[] = "/search";
+const char history_uri[] = "/history";
+
+#define COMMANDS_MAX_WAIT 60 // seconds
+
+bool handle_event_text (global_ctx_t* global_ctx, char* text) {
+    eso_event_t* event = parse_eso_event(text);
+    if (event == NULL) {
+        printf("body: \"%s\"\n", text);
+        return false;
+    }
+    event_handlers_eso_event(global_ctx, event);
+    eso_event_release(event);
+    return true;
+}
+
+bool handle_event_cbor (global_ctx_t* global_ctx, const char* data, size_t length) {
+    eso_event_t* event = parse_eso_event_cbor(data, length);
+    if (event == NULL) {
+        printf("malformed cbor event of %zu bytes\n", length);
+        return false;
+    }
+    event_handlers_eso_event(global_ctx, event);
+    eso_event_release(event);
+    return true;
+}
+
+bool is_cbor_body (request_t* request) {
+    return http_media_type_is(request_get_known_header(request, HTTP_HEADER_CONTENT_TYPE), HTTP_CONTENT_CBOR);
+}
+
+list_t* parse_request_events (request_t* request, char* text, size_t length) {
+    if (is_cbor_body(request))
+        return parse_eso_event_batch_cbor(text, length);
+    return parse_eso_event_batch(text, length);
+}
+
+void wake_parked_requests (void* server_ctx) {
+    server_wake_parked((server_ctx_t*)server_ctx);
+}
+
+void handle_event_batch (global_ctx_t* global_ctx, list_t* events) {
+    for (size_t i = 0; i < list_size(events); i++) {
+        eso_event_t* event = list_get(events, i, eso_event_t*);
+        if (event != NULL)
+            event_handlers_eso_event(global_ctx, event);
+    }
+}
+
+bool is_event_upload (request_t* request) {
+    return request->method == HTTP_METHOD_POST
+        && (http_uri_path_equals(request->uri, event_uri) || http_uri_path_equals(request->uri, events_uri));
+}
+
+/*
+ * ?sync=1 holds the response until the events are on disk. The request parks meanwhile, true
+ * means the callback returns without responding and runs again once the log writer moved on.
+ * park_target stays 0 until then, a request that runs again must not handle its events twice.
+ */
+bool park_until_durable (global_ctx_t* global_ctx, request_t* request) {
+    if (http_uri_query_long(request->uri, "sync", 0) == 0 || request->park_expired)
+        return false;
+    if (request->park_target == 0)
+        request->park_target = file_saver_durable_target(global_ctx->file_saver_ctx);
+    if (file_saver_durable(global_ctx->file_saver_ctx, request->park_target) != FILE_DURABLE_WAIT)
+        return false;
+    server_park_request(request, FILE_SYNC_WAIT_MAX);
+    return true;
+}
+
+/* After park_until_durable, false when ?sync=1 was asked and the events did not make it in time */
+bool is_durable_if_asked (global_ctx_t* global_ctx, request_t* request) {
+    return http_uri_query_long(request->uri, "sync", 0) == 0
+        || file_saver_durable(global_ctx->file_saver_ctx, request->park_target) == FILE_DURABLE_OK;
+}
+
+void free_parked_response (void* response) {
+    string_builder_free((string_builder_t*)response);
+}
+
+/* Every chunk of a streamed upload holds one or more whole events, new line separated in JSON */
+void chunk_handler (server_ctx_t* ctx, request_t* request, char* chunk, size_t chunk_length) {
+    if (!is_event_upload(request))
+        return;
+    list_t* events = parse_request_events(request, chunk, chunk_length);
+    handle_event_batch(ctx->global_ctx, events);
+    eso_event_list_free(events);
+}
+
+/* Messages carry events like POST /events, binary ones in CBOR, commands are pushed as they are queued */
+void websocket_handler (server_ctx_t* ctx, request_t* request, int opcode, char* message, size_t message_length) {
+    if (message != NULL) {
+        list_t* events = opcode == WEBSOCKET_OP_BINARY
+            ? parse_eso_event_batch_cbor(message, message_length)
+            : parse_eso_event_batch(message, message_length);
+        handle_event_batch(ctx->global_ctx, events);
+        eso_event_list_free(events);
+        return;
+    }
+    eso_command_t* commands = command_queue_retrieve(ctx->global_ctx->command_queue);
+    if (commands == NULL)
+        return;
+    string_builder_t* json = eso_command_list_to_json(commands);
+    server_send_frame(request, WEBSOCKET_OP_TEXT, json->value, string_builder_size(json));
+    string_builder_free(json);
+    eso_command_list_free(commands);
+}
+
+void respond (request_t* request, const char* content_type, const char* body, size_t body_length) {
+    http_response_t response;
+    http_response_prepare(&response, content_type, request->keep_alive, body, body_length);
+    server_sendv(request, response.iov, 3);
+}
+
+void respond_text (request_t* request, const char* text) {
+    respond(request, HTTP_CONTENT_PLAIN, text, strlen(text));
+}
+
+void respond_static (request_t* request, int static_response) {
+    const string_builder_t* response = http_static_response(static_response, request->keep_alive);
+    server_send(request, response->value, response->size);
+}
+
+/* GET /search?q=words&actor=id or name&node=name&limit=N, the newest matching events as JSON */
+void handle_search (global_ctx_t* global_ctx, request_t* request) {
+    search_index_t* search = global_ctx->file_saver_ctx->search;
+    if (search == NULL) {
+        respond_text(request, "search is off");
+        return;
+    }
+    string_builder_t* q = http_uri_query_string(request->uri, "q");
+    string_builder_t* actor = http_uri_query_string(request->uri, "actor");
+    string_builder_t* node = http_uri_query_string(request->uri, "node");
+    string_builder_t* response = search_index_query_json(search,
+        q != NULL ? string_builder_as_cstring(q) : NULL,
+        actor != NULL ? string_builder_as_cstring(actor) : NULL,
+        node != NULL ? string_builder_as_cstring(node) : NULL,
+        http_uri_query_long(request->uri, "limit", SEARCH_DEFAULT_LIMIT));
+    if (response != NULL) {
+        respond(request, HTTP_CONTENT_JSON, response->value, string_builder_size(response));
+        string_builder_free(response);
+    }
+    else
+        respond_static(request, HTTP_STATIC_BAD_REQUEST);
+    string_builder_t* params[] = {q, actor, node};
+    for (int i = 0; i < 3; i++)
+        if (params[i] != NULL)
+            string_builder_free(params[i]);
+}
+
+/* "time:seq" the last page ended with, the next one starts at that time after that seq */
+static bool parse_history_cursor (const char* cursor, history_query_t* query) {
+    char* end;
+    long long time = strtoll(cursor, &end, 10);
+    if (end == cursor || *end != ':')
+        return false;
+    const char* seq = end + 1;
+    unsigned long long after = strtoull(seq, &end, 10);
+    if (end == seq || *end != '\0' || time < 0)
+        return false;
+    query->from = time;
+    query->after = after;
+    return true;
+}
+
+/* GET /history?from=ms&to=ms&type=chat,userRoll&limit=N&cursor=next, the events of the range oldest first */
+void handle_history (global_ctx_t* global_ctx, request_t* request) {
+    history_t* history = global_ctx->file_saver_ctx->history;
+    if (history == NULL) {
+        respond_text(request, "history is off");
+        return;
+    }
+    history_query_t query;
+    query.from = http_uri_query_long(request->uri, "from", 0);
+    query.to = http_uri_query_long(request->uri, "to", LONG_MAX);
+    query.after = 0;
+    string_builder_t* cursor = http_uri_query_string(request->uri, "cursor");
+    bool valid = cursor == NULL || parse_history_cursor(string_builder_as_cstring(cursor), &query);
+    if (cursor != NULL)
+        string_builder_free(cursor);
+    string_builder_t* types = http_uri_query_string(request->uri, "type");
+    query.types = history_parse_types(types != NULL ? string_builder_as_cstring(types) : NULL);
+    if (types != NULL)
+        string_builder_free(types);
+    query.limit = http_uri_query_long(request->uri, "limit", HISTORY_DEFAULT_LIMIT);
+    query.cbor = http_accepts(request_get_header(request, "accept"), HTTP_CONTENT_CBOR);
+    if (!valid || query.from > query.to) {
+        respond_static(request, HTTP_STATIC_BAD_REQUEST);
+        return;
+    }
+    string_builder_t* response = history_query(history, &query);
+    respond(request, query.cbor ? HTTP_CONTENT_CBOR : HTTP_CONTENT_JSON, response->value, string_builder_size(response));
+    string_builder_free(response);
+}
 
 void request_handler (server_ctx_t* ctx, request_t* request) {
-    string_builder_t* string = string_builder_create(4096);
     string_builder_t* response = NULL;
     /*if (request->body != NULL)
         printf("%s\n", request->body);*/
-    if (STREQUAL(request->method_name, "POST") && request->body == NULL) {
+    if (request->method == HTTP_METHOD_POST && request->body == NULL && !request->chunked) {
         // should be bad request
-        http_respond_text(string, string_builder_copy("no body"), HTTP_CONTENT_PLAIN);
-    }
-    else if (strcmp(request->method_name, "OPTIONS") == 0)
-        http_respond_options(string, "GET, POST, OPTIONS");
-    else if (request->method == HTTP_METHOD_GET && strncmp(request->uri, commands_uri, sizeof(commands_uri)) == 0) {
-        list_t* commands = command_queue_retrieve(ctx->global_ctx->command_queue);
-        response = eso_command_list_to_json(commands);
-        eso_command_list_free(commands);
-        http_respond_text(string, response, HTTP_CONTENT_PLAIN);
-    }
-    else if (request->method == HTTP_METHOD_POST && strncmp(request->uri, event_uri, sizeof(event_uri)) == 0) {
-        if (request->body == NULL) {
-            response = string_builder_copy("empty body");
-            http_respond_text(string, response, HTTP_CONTENT_PLAIN);
-            goto exit;
+        respond_text(request, "no body");
+    }
+    else if (request->method == HTTP_METHOD_GET && http_uri_path_equals(request->uri, websocket_uri)) {
+        if (!server_accept_websocket(request))
+            respond_static(request, HTTP_STATIC_BAD_REQUEST);
+    }
+    else if (request->method == HTTP_METHOD_OPTIONS)
+        respond_static(request, HTTP_STATIC_OPTIONS);
+    else if (request->method == HTTP_METHOD_GET && http_uri_path_equals(request->uri, commands_uri)) {
+        // ?wait=N holds an empty poll until a command arrives or N seconds pass
+        long wait = http_uri_query_long(request->uri, "wait", 0);
+        if (wait > COMMANDS_MAX_WAIT)
+            wait = COMMANDS_MAX_WAIT;
+        eso_command_t* commands = command_queue_retrieve(ctx->global_ctx->command_queue);
+        if (commands == NULL && wait > 0 && !request->park_expired) {
+            server_park_request(request, wait * 1000);
+            return;
         }
-        eso_event_t* event = parse_eso_event(request->body);
-        if (event == NULL) {
-            printf("body: \"%s\"\n", request->body);
-            response = string_builder_copy("failed to to parse event");
+        if (http_accepts(request_get_header(request, "accept"), HTTP_CONTENT_CBOR)) {
+            response = eso_command_list_to_cbor(commands);
+            eso_command_list_free(commands);
+            respond(request, HTTP_CONTENT_CBOR, response->value, string_builder_size(response));
         }
         else {
-            event_handlers_eso_event(ctx->global_ctx, event);
-            eso_event_free(event);
-            response = string_builder_copy("done 👍");
+            response = eso_command_list_to_json(commands);
+            eso_command_list_free(commands);
+            respond(request, HTTP_CONTENT_PLAIN, response->value, string_builder_size(response));
         }
-        http_respond_text(string, response, HTTP_CONTENT_PLAIN);
+    }
+    else if (request->method == HTTP_METHOD_GET && http_uri_path_equals(request->uri, search_uri))
+        handle_search(ctx->global_ctx, request);
+    else if (request->method == HTTP_METHOD_GET && http_uri_path_equals(request->uri, history_uri))
+        handle_history(ctx->global_ctx, request);
+    else if (request->method == HTTP_METHOD_POST && http_uri_path_equals(request->uri, events_uri)) {
+        // streamed batches have no per-item status, every chunk was handled on arrival
+        if (request->chunked) {
+            if (park_until_durable(ctx->global_ctx, request))
+                return;
+            if (is_durable_if_asked(ctx->global_ctx, request))
+                respond_text(request, "done 👍");
+            else
+                respond_text(request, "not synced");
+            return;
+        }
+        // the body is parsed in place, a parked batch keeps its status for when it runs again
+        if (request->park_data == NULL) {
+            list_t* events = parse_request_events(request, request->body, request->body_length);
+            handle_event_batch(ctx->global_ctx, events);
+            request->park_data = eso_event_batch_status_to_json(events);
+            request->park_data_free = &free_parked_response;
+            eso_event_list_free(events);
+        }
+        if (park_until_durable(ctx->global_ctx, request))
+            return;
+        if (!is_durable_if_asked(ctx->global_ctx, request)) {
+            respond_text(request, "not synced");
+            return;
+        }
+        string_builder_t* status = request->park_data;
+        respond(request, HTTP_CONTENT_JSON, status->value, string_builder_size(status));
+    }
+    else if (request->method == HTTP_METHOD_POST && http_uri_path_equals(request->uri, event_uri)) {
+        // a streamed upload was already handled chunk by chunk, a parked one before it parked
+        bool handled = request->chunked || request->park_target != 0
+            || (is_cbor_body(request)
+                ? handle_event_cbor(ctx->global_ctx, request->body, request->body_length)
+                : handle_event_text(ctx->global_ctx, request->body));
+        if (handled && park_until_durable(ctx->global_ctx, request))
+            return;
+        if (handled && !is_durable_if_asked(ctx->global_ctx, request))
+            respond_text(request, "not synced");
+        else if (handled)
+            respond_text(request, "done 👍");
+        else
+            respond_text(request, "failed to to parse event");
     }
     else
-        http_not_found(string);
-    exit:
-    send(request->conn.client_sd, string->value, string->value_null - string->value, 0);
+        respond_static(request, HTTP_STATIC_NOT_FOUND);
     if (response != NULL)
         string_builder_free(response);
-    string_builder_free(string);
 }
 
 int main (int argc, char* argv[]) {
@@ -71,6 +313,9 @@ int main (int argc, char* argv[]) {
         config_set_value(config, "ip", "0.0.0.0");
     config->debug = config_get_value(config, "debug") != NULL ? true : false;
 
+    if (eso_event_types_init() != 0)
+        return 1;
+
     global_ctx_t* global_ctx = MALLOC_STRUCT(global_ctx_t);
     global_ctx->config = config;
     command_queue_t* command_queue = command_queue_create();
@@ -83,7 +328,7 @@ int main (int argc, char* argv[]) {
     global_ctx->file_saver_ctx = fs_ctx;
     if (file_saver_init(fs_ctx, global_ctx) != 0)
         return 1;
-    list_push(global_ctx->event_handlers, file_saver_event_handler_create());
+    list_push(global_ctx->event_handlers, file_saver_event_handler_create(fs_ctx));
 
     tg_context_t* tg_ctx = NULL;
     pthread_t* telegram_thread = NULL;
@@ -96,26 +341,37 @@ int main (int argc, char* argv[]) {
         }
         global_ctx->tg_ctx = tg_ctx;
         list_push(global_ctx->event_handlers, tg_event_handler_create());
-        telegram_thread = tg_run_worker(tg_ctx);
-        if (telegram_thread == NULL)
-            return 1;
     }
 
+    if (event_handlers_start(global_ctx) != 0)
+        return 1;
+
+    http_init("GET, POST, OPTIONS");
     server_ctx_t* server_ctx = MALLOC_STRUCT(server_ctx_t);
     int cs_error = create_server(
             global_ctx,
             server_ctx,
             &request_handler,
+            &chunk_handler,
+            &websocket_handler,
             config_get_value(config, "ip"),
             config_get_value(config, "port"));
     if (cs_error < 0)
         return 1;
     global_ctx->server_ctx = server_ctx;
+    command_queue_set_notify(command_queue, &wake_parked_requests, server_ctx);
+    file_saver_set_notify(global_ctx->file_saver_ctx, &wake_parked_requests, server_ctx);
 
-    pthread_t server_thread = run_server(server_ctx);
-    if (server_thread == 0)
+    if (run_server(server_ctx) != 0)
         return 1;
 
+    // the bot is the producer of commands, it starts once the queue can notify the server
+    if (tg_ctx != NULL) {
+        telegram_thread = tg_run_worker(tg_ctx);
+        if (telegram_thread == NULL)
+            return 1;
+    }
+
     char input;
     while (true) {
         scanf("%c", &input);
@@ -127,54 +383,68 @@ int main (int argc, char* argv[]) {
             break;
         }
     }
-
-    if (tg_ctx != NULL) {
+    if (tg_ctx != NULL)
         pthread_join(*telegram_thread, NULL);
+    command_queue_set_notify(command_queue, NULL, NULL);
+    file_saver_set_notify(global_ctx->file_saver_ctx, NULL, NULL);
+    join_server(server_ctx);
+    // nothing enqueues events anymore, let the handlers finish what they have
+    event_handlers_stop(global_ctx);
+    // then the log writer, it gets the last lines from the file handler
+    file_saver_stop(global_ctx->file_saver_ctx);
+
+    if (tg_ctx != NULL)
         tg_free_context(tg_ctx);
-    }
     if (global_ctx->file_saver_ctx != NULL) {
         file_saver_free(global_ctx->file_saver_ctx);
     }
-    pthread_join(server_thread, NULL);
     command_queue_free(command_queue);
+    http_free();
+    arena_pool_free();
 
     return 0;
 }
 
-void event_handlers_eso_event (global_ctx_t* ctx, eso_event_t* eso_event) {
-    for (size_t i = 0; i < list_size(ctx->event_handlers); i++) {
-        event_handler_t* handler = list_get(ctx->event_handlers, i, event_handler_t*);
-        handler->event(ctx, eso_event);
-    }
-}
-
 command_queue_t* command_queue_create () {
     command_queue_t* queue = MALLOC_STRUCT(command_queue_t);
-    queue->queue = list_create(eso_command_t*);
-    queue->mutex = MALLOC_STRUCT(mutex_t);
-    mutex_init(queue->mutex);
+    atomic_init(&queue->head, NULL);
+    queue->notify = NULL;
+    queue->notify_arg = NULL;
     return queue;
 }
 
 void command_queue_free (command_queue_t* commands) {
-    mutex_free(commands->mutex);
-    eso_command_list_free(commands->queue);
-    list_free(commands->queue);
+    eso_command_list_free(atomic_load(&commands->head));
     free(commands);
 }
 
 void command_queue_add (command_queue_t* commands, eso_command_t* cmd) {
-    list_push(commands->queue, cmd);
+    eso_command_t* head = atomic_load_explicit(&commands->head, memory_order_relaxed);
+    do
+        cmd->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&commands->head, &head, cmd,
+                                                  memory_order_release, memory_order_relaxed));
+    if (commands->notify != NULL)
+        commands->notify(commands->notify_arg);
 }
 
-list_t* command_queue_retrieve (command_queue_t* commands) {
-    if (list_size(commands->queue) == 0)
-        return list_create_empty(eso_command_t*);
+/* Not synchronized, call it before any producer runs or after all of them stopped */
+void command_queue_set_notify (command_queue_t* commands, command_queue_notify_fun notify, void* arg) {
+    commands->notify = notify;
+    commands->notify_arg = arg;
+}
 
-    mutex_lock(commands->mutex);
-    list_t* new_queue = list_create(eso_command_t*);
-    list_t* old_queue = commands->queue;
-    commands->queue = new_queue;
-    mutex_unlock(commands->mutex);
-    return old_queue;
-}
\ No newline at end of file
+/* Drains everything queued so far, oldest first, linked through next */
+eso_command_t* command_queue_retrieve (command_queue_t* commands) {
+    if (atomic_load_explicit(&commands->head, memory_order_relaxed) == NULL)
+        return NULL;
+    eso_command_t* stack = atomic_exchange_explicit(&commands->head, NULL, memory_order_acquire);
+    eso_command_t* ordered = NULL;
+    while (stack != NULL) {
+        eso_command_t* next = stack->next;
+        stack->next = ordered;
+        ordered = stack;
+        stack = next;
+    }
+    return ordered;
+}
@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 /* Pre-defined from other files */
 typedef struct config config_t;
@@ -51,8 +53,28 @@ typedef pthread_mutex_t mutex_t;
 
 typedef void(*event_handler_fun)(global_ctx_t*, eso_event_t*);
 
+#define EVENT_QUEUE_DEFAULT_DEPTH 1024
+#define EVENT_POLICY_BLOCK  1
+#define EVENT_POLICY_DROP   2
+
+/* Every handler runs on its own thread and takes events from a bounded ring */
 typedef struct event_handler {
     event_handler_fun event;
+    const char* name;
+    uint32_t subscriptions; // ESO_EVENT_MASK bits of the types passed to event
+    int policy;
+    eso_event_t** queue;
+    size_t queue_depth;
+    size_t queue_head;
+    size_t queue_count;
+    size_t dropped;
+    uint64_t enqueued;      // events accepted so far, they are handled in this order
+    mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t thread;
+    bool running;
+    global_ctx_t* global_ctx;
 } event_handler_t;
 
 typedef struct global_ctx {
@@ -64,16 +86,26 @@ typedef struct global_ctx {
     config_t* config;
 } global_ctx_t;
 
+typedef void(*command_queue_notify_fun)(void* arg);
+
+/*
+ * Lock-free multi-producer queue: commands are pushed onto an intrusive stack and a consumer
+ * takes all of them with one exchange. notify is set before any producer starts.
+ */
 typedef struct command_queue {
-    list_t* queue;
-    mutex_t* mutex;
+    _Atomic(eso_command_t*) head;
+    command_queue_notify_fun notify;
+    void* notify_arg;
 } command_queue_t;
 
 command_queue_t* command_queue_create ();
 void command_queue_free (command_queue_t* commands);
 void command_queue_add (command_queue_t* commands, eso_command_t* cmd);
-list_t* command_queue_retrieve (command_queue_t* commands);
+void command_queue_set_notify (command_queue_t* commands, command_queue_notify_fun notify, void* arg);
+eso_command_t* command_queue_retrieve (command_queue_t* commands);
 
 void event_handlers_eso_event (global_ctx_t* ctx, eso_event_t* eso_event);
+int event_handlers_start (global_ctx_t* ctx);
+void event_handlers_stop (global_ctx_t* ctx);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include <stdint.h>
+#include "scan.h"
+
+#if defined(__x86_64__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Finds the first byte of buf[from, length) that is one of the delimiters in set,
+ * returns length when there is none. Kernels differ only in block width.
+ */
+
+/* Expands a set into four delimiter chars, unused slots repeat the first one */
+static void scan_set_chars (int set, char chars[4]) {
+    static const char all[] = {' ', '\r', '\n', ':'};
+    int count = 0;
+    for (int i = 0; i < 4; i++)
+        if (set & (1 << i))
+            chars[count++] = all[i];
+    for (int i = count; i < 4; i++)
+        chars[i] = count > 0 ? chars[0] : '\n';
+}
+
+static size_t scan_scalar (const char* buf, size_t from, size_t length, int set) {
+    char c[4];
+    scan_set_chars(set, c);
+    for (size_t i = from; i < length; i++) {
+        char b = buf[i];
+        if (b == c[0] || b == c[1] || b == c[2] || b == c[3])
+            return i;
+    }
+    return length;
+}
+
+#ifdef SCAN_X86
+static size_t scan_sse2 (const char* buf, size_t from, size_t length, int set) {
+    char c[4];
+    scan_set_chars(set, c);
+    __m128i d0 = _mm_set1_epi8(c[0]);
+    __m128i d1 = _mm_set1_epi8(c[1]);
+    __m128i d2 = _mm_set1_epi8(c[2]);
+    __m128i d3 = _mm_set1_epi8(c[3]);
+
+    size_t i = from;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(block, d0), _mm_cmpeq_epi8(block, d1)),
+                _mm_or_si128(_mm_cmpeq_epi8(block, d2), _mm_cmpeq_epi8(block, d3)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return scan_scalar(buf, i, length, set);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2 (const char* buf, size_t from, size_t length, int set) {
+    char c[4];
+    scan_set_chars(set, c);
+    __m256i d0 = _mm256_set1_epi8(c[0]);
+    __m256i d1 = _mm256_set1_epi8(c[1]);
+    __m256i d2 = _mm256_set1_epi8(c[2]);
+    __m256i d3 = _mm256_set1_epi8(c[3]);
+
+    size_t i = from;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i hits = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, d0), _mm256_cmpeq_epi8(block, d1)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, d2), _mm256_cmpeq_epi8(block, d3)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return scan_sse2(buf, i, length, set);
+}
+
+static scan_fun scan_kernel = &scan_sse2;
+static const char* scan_kernel_label = "sse2";
+#else
+static scan_fun scan_kernel = &scan_scalar;
+static const char* scan_kernel_label = "scalar";
+#endif
+
+void scan_init () {
+#ifdef SCAN_X86
+    // sse2 is part of x86-64, only avx2 needs checking
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_kernel = &scan_avx2;
+        scan_kernel_label = "avx2";
+    }
+#endif
+}
+
+const char* scan_kernel_name () {
+    return scan_kernel_label;
+}
+
+size_t scan_delimiters (const char* buf, size_t from, size_t length, int set) {
+    if (from >= length)
+        return length;
+    return scan_kernel(buf, from, length, set);
+}
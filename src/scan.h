@@ -0,0 +1,18 @@
+#ifndef NOTIFIER_SCAN_H_HEADER
+#define NOTIFIER_SCAN_H_HEADER
+
+#include <stddef.h>
+
+/* Delimiter set bits for scan_delimiters */
+#define SCAN_SPACE  0x01
+#define SCAN_CR     0x02
+#define SCAN_LF     0x04
+#define SCAN_COLON  0x08
+
+typedef size_t(*scan_fun)(const char* buf, size_t from, size_t length, int set);
+
+void scan_init ();
+const char* scan_kernel_name ();
+size_t scan_delimiters (const char* buf, size_t from, size_t length, int set);
+
+#endif
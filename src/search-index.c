@@ -0,0 +1,1012 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <json.h>
+#include "search-index.h"
+#include "journal.h"
+
+#define SEARCH_QUERY_TERMS 16
+
+_Static_assert(sizeof(search_segment_header_t) % 8 == 0, "segment header breaks the directory alignment");
+
+void* search_index_worker (void* _index);
+
+/* Latin-1 punctuation and spaces, general punctuation like dashes, quotes and ellipsis */
+static bool search_is_separator (const unsigned char* p) {
+    if (*p < 0x80)
+        return !isalnum(*p);
+    return *p == 0xc2 || (*p == 0xe2 && p[1] == 0x80);
+}
+
+/* Bytes of the UTF-8 character at p, a broken sequence is taken byte by byte */
+static size_t search_char_length (const unsigned char* p) {
+    size_t length = *p >= 0xf0 ? 4 : *p >= 0xe0 ? 3 : *p >= 0xc0 ? 2 : 1;
+    for (size_t i = 1; i < length; i++)
+        if ((p[i] & 0xc0) != 0x80)
+            return 1;
+    return length;
+}
+
+/* Lower case for ASCII and Russian, ё reads as е */
+static size_t search_fold_char (const unsigned char* p, size_t length, char* out) {
+    if (length == 1) {
+        out[0] = (char)(*p >= 'A' && *p <= 'Z' ? *p + 32 : *p);
+        return 1;
+    }
+    if (length == 2 && (p[0] == 0xd0 || p[0] == 0xd1)) {
+        unsigned int c = (p[0] & 0x1f) << 6 | (p[1] & 0x3f);
+        if (c >= 0x410 && c <= 0x42f)
+            c += 0x20;
+        else if (c == 0x401 || c == 0x451)
+            c = 0x435;
+        out[0] = (char)(0xc0 | c >> 6);
+        out[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    memcpy(out, p, length);
+    return length;
+}
+
+/* Folds value into out after the prefix, cut at SEARCH_TERM_MAX on a character boundary */
+static size_t search_fold (char* out, const char* prefix, const char* value) {
+    size_t length = strlen(prefix);
+    memcpy(out, prefix, length);
+    const unsigned char* p = (const unsigned char*)value;
+    while (*p != '\0') {
+        size_t char_length = search_char_length(p);
+        char folded[4];
+        size_t folded_length = search_fold_char(p, char_length, folded);
+        if (length + folded_length > SEARCH_TERM_MAX)
+            break;
+        memcpy(out + length, folded, folded_length);
+        length += folded_length;
+        p += char_length;
+    }
+    return length;
+}
+
+/* Calls term for every folded word of text, words longer than SEARCH_TERM_MAX are cut */
+void search_tokenize (const char* text, search_term_fun term, void* data) {
+    char word[SEARCH_TERM_MAX];
+    size_t length = 0;
+    const unsigned char* p = (const unsigned char*)text;
+    while (true) {
+        if (*p == '\0' || search_is_separator(p)) {
+            if (length > 0)
+                term(word, length, data);
+            length = 0;
+            if (*p == '\0')
+                break;
+            p += search_char_length(p);
+            continue;
+        }
+        size_t char_length = search_char_length(p);
+        char folded[4];
+        size_t folded_length = search_fold_char(p, char_length, folded);
+        if (length + folded_length <= SEARCH_TERM_MAX) {
+            memcpy(word + length, folded, folded_length);
+            length += folded_length;
+        }
+        p += char_length;
+    }
+}
+
+/* Words of the text the event carries, and the actor and node as whole terms */
+void search_event_terms (eso_event_t* event, search_term_fun term, void* data) {
+    char field[SEARCH_TERM_MAX + 24];
+    int length = snprintf(field, sizeof(field), "actor:%d", event->actor.id);
+    term(field, length, data);
+    term(field, search_fold(field, "name:", event->actor.name), data);
+    term(field, search_fold(field, "node:", event->game_data.node), data);
+    if (event->data == NULL)
+        return;
+    switch (event->event_type) {
+        case ESO_EVENT_CHAT:
+            search_tokenize(((eso_event_chat_t*)event->data)->message, term, data);
+            break;
+        case ESO_EVENT_BROADCAST:
+            search_tokenize(((eso_event_broadcast_t*)event->data)->message, term, data);
+            break;
+        case ESO_EVENT_TRY:
+            search_tokenize(((eso_event_try_t*)event->data)->message, term, data);
+            break;
+        case ESO_EVENT_MEDIA_TRACK:
+            search_tokenize(((eso_media_track_t*)event->data)->id, term, data);
+            break;
+    }
+}
+
+static void search_write_varint (string_builder_t* out, uint64_t value) {
+    char bytes[10];
+    size_t length = 0;
+    while (value >= 0x80) {
+        bytes[length++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    bytes[length++] = (char)value;
+    string_builder_append_string(out, bytes, length);
+}
+
+static bool search_read_varint (const char** p, const char* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t byte = (uint8_t)*(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
+static void search_postings_push (search_postings_t* postings, uint64_t value) {
+    if (postings->size == postings->capacity) {
+        postings->capacity = postings->capacity < 4 ? 4 : postings->capacity * 2;
+        postings->values = realloc(postings->values, sizeof(uint64_t) * postings->capacity);
+    }
+    postings->values[postings->size++] = value;
+}
+
+static int search_compare_postings (const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void search_postings_sort (search_postings_t* postings) {
+    if (postings->size < 2)
+        return;
+    qsort(postings->values, postings->size, sizeof(uint64_t), &search_compare_postings);
+    size_t unique = 1;
+    for (size_t i = 1; i < postings->size; i++)
+        if (postings->values[i] != postings->values[unique - 1])
+            postings->values[unique++] = postings->values[i];
+    postings->size = unique;
+}
+
+/* FNV-1a */
+static uint32_t search_hash (const char* term, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)term[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+search_memtable_t* search_memtable_create (size_t capacity) {
+    search_memtable_t* memtable = MALLOC_STRUCT(search_memtable_t);
+    memtable->slots = calloc(capacity, sizeof(search_postings_t));
+    memtable->capacity = capacity;
+    memtable->terms = 0;
+    memtable->postings = 0;
+    return memtable;
+}
+
+void search_memtable_free (search_memtable_t* memtable) {
+    for (size_t i = 0; i < memtable->capacity; i++) {
+        free(memtable->slots[i].term);
+        free(memtable->slots[i].values);
+    }
+    free(memtable->slots);
+    free(memtable);
+}
+
+static search_postings_t* search_memtable_slot (search_postings_t* slots, size_t capacity, const char* term,
+                                                size_t length) {
+    size_t i = search_hash(term, length) & (capacity - 1);
+    while (slots[i].term != NULL && !(strlen(slots[i].term) == length && memcmp(slots[i].term, term, length) == 0))
+        i = (i + 1) & (capacity - 1);
+    return &slots[i];
+}
+
+static void search_memtable_grow (search_memtable_t* memtable) {
+    size_t capacity = memtable->capacity * 2;
+    search_postings_t* slots = calloc(capacity, sizeof(search_postings_t));
+    for (size_t i = 0; i < memtable->capacity; i++) {
+        search_postings_t* old = &memtable->slots[i];
+        if (old->term != NULL)
+            *search_memtable_slot(slots, capacity, old->term, strlen(old->term)) = *old;
+    }
+    free(memtable->slots);
+    memtable->slots = slots;
+    memtable->capacity = capacity;
+}
+
+search_postings_t* search_memtable_get (search_memtable_t* memtable, const char* term, size_t length) {
+    search_postings_t* slot = search_memtable_slot(memtable->slots, memtable->capacity, term, length);
+    return slot->term != NULL ? slot : NULL;
+}
+
+/* Postings come in growing order, a term seen twice in one event is kept once */
+void search_memtable_add (search_memtable_t* memtable, const char* term, size_t length, uint64_t posting) {
+    if ((memtable->terms + 1) * 10 > memtable->capacity * 7)
+        search_memtable_grow(memtable);
+    search_postings_t* slot = search_memtable_slot(memtable->slots, memtable->capacity, term, length);
+    if (slot->term == NULL) {
+        slot->term = malloc(length + 1);
+        memcpy(slot->term, term, length);
+        slot->term[length] = '\0';
+        memtable->terms++;
+    }
+    else if (slot->size > 0 && slot->values[slot->size - 1] >= posting)
+        return;
+    search_postings_push(slot, posting);
+    memtable->postings++;
+}
+
+/* Puts the postings of a memtable that could not be written back in front of the newer ones */
+static void search_memtable_restore (search_memtable_t* memtable, search_memtable_t* frozen) {
+    for (size_t i = 0; i < frozen->capacity; i++) {
+        search_postings_t* old = &frozen->slots[i];
+        if (old->term == NULL)
+            continue;
+        size_t length = strlen(old->term);
+        if ((memtable->terms + 1) * 10 > memtable->capacity * 7)
+            search_memtable_grow(memtable);
+        search_postings_t* slot = search_memtable_slot(memtable->slots, memtable->capacity, old->term, length);
+        if (slot->term == NULL) {
+            // the term and its values move over as they are
+            *slot = *old;
+            old->term = NULL;
+            old->values = NULL;
+            memtable->terms++;
+            memtable->postings += slot->size;
+            continue;
+        }
+        memtable->postings -= slot->size;
+        for (size_t j = 0; j < old->size; j++)
+            search_postings_push(slot, old->values[j]);
+        search_postings_sort(slot);
+        memtable->postings += slot->size;
+    }
+}
+
+typedef struct search_segment_builder {
+    string_builder_t* data;
+    search_postings_t offsets; // of every term entry
+    uint64_t watermark;
+} search_segment_builder_t;
+
+static void search_builder_init (search_segment_builder_t* builder) {
+    search_segment_header_t header;
+    memset(&header, 0, sizeof(header));
+    builder->data = string_builder_create(64 * 1024);
+    string_builder_append_string(builder->data, (const char*)&header, sizeof(header));
+    memset(&builder->offsets, 0, sizeof(builder->offsets));
+    builder->watermark = 0;
+}
+
+/* Entry: term length, term, count, first posting, then the gaps to the previous ones */
+static void search_builder_add (search_segment_builder_t* builder, const char* term, size_t length,
+                                const uint64_t* values, size_t count) {
+    search_postings_push(&builder->offsets, string_builder_size(builder->data));
+    search_write_varint(builder->data, length);
+    string_builder_append_string(builder->data, term, length);
+    search_write_varint(builder->data, count);
+    uint64_t previous = 0;
+    for (size_t i = 0; i < count; i++) {
+        search_write_varint(builder->data, values[i] - previous);
+        previous = values[i];
+    }
+    if (count > 0 && values[count - 1] > builder->watermark)
+        builder->watermark = values[count - 1];
+}
+
+search_segment_t* search_segment_open (const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(search_segment_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    const search_segment_header_t* header = data;
+    size_t size = file_stat.st_size;
+    if (memcmp(header->magic, SEARCH_SEGMENT_MAGIC, sizeof(SEARCH_SEGMENT_MAGIC)) != 0
+        || header->version != SEARCH_SEGMENT_VERSION || header->directory % 8 != 0
+        || header->directory > size || (size - header->directory) / 8 < header->terms) {
+        printf("\"%s\" is not a search segment of version %d\n", path, SEARCH_SEGMENT_VERSION);
+        munmap(data, size);
+        return NULL;
+    }
+    search_segment_t* segment = MALLOC_STRUCT(search_segment_t);
+    segment->header = header;
+    segment->data = data;
+    segment->size = size;
+    segment->directory = (const uint64_t*)((const char*)data + header->directory);
+    segment->path = strdup(path);
+    return segment;
+}
+
+void search_segment_free (search_segment_t* segment, bool remove) {
+    munmap((void*)segment->data, segment->size);
+    if (remove)
+        unlink(segment->path);
+    free(segment->path);
+    free(segment);
+}
+
+/* The directory goes last, the file only gets its name once it is complete and synced */
+static search_segment_t* search_builder_finish (search_index_t* index, search_segment_builder_t* builder,
+                                                uint64_t id, const uint64_t* sources, size_t source_count) {
+    static const char padding[8];
+    size_t directory = JOURNAL_PADDED(string_builder_size(builder->data));
+    string_builder_append_string(builder->data, padding, directory - string_builder_size(builder->data));
+    string_builder_append_string(builder->data, (const char*)builder->offsets.values,
+                                 sizeof(uint64_t) * builder->offsets.size);
+
+    search_segment_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEARCH_SEGMENT_MAGIC, sizeof(SEARCH_SEGMENT_MAGIC));
+    header.version = SEARCH_SEGMENT_VERSION;
+    header.terms = (uint32_t)builder->offsets.size;
+    header.id = id;
+    header.watermark = builder->watermark;
+    for (size_t i = 0; i < source_count && i < SEARCH_MERGE_FANIN; i++)
+        header.sources[i] = sources[i];
+    header.directory = directory;
+    memcpy(builder->data->value, &header, sizeof(header));
+
+    string_builder_t* path = string_builder_copy(string_builder_as_cstring(index->dir));
+    string_builder_append_printf(path, "%020llu.seg", (unsigned long long)id);
+    string_builder_t* tmp_path = string_builder_copy(string_builder_as_cstring(path));
+    string_builder_append(tmp_path, ".tmp");
+    search_segment_t* segment = NULL;
+    int fd = open(string_builder_as_cstring(tmp_path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    bool written = fd >= 0;
+    const char* data = string_builder_as_cstring(builder->data);
+    size_t left = string_builder_size(builder->data);
+    while (written && left > 0) {
+        ssize_t wrote_bytes = write(fd, data, left);
+        if (wrote_bytes < 0 && errno == EINTR)
+            continue;
+        written = wrote_bytes > 0;
+        if (written) {
+            data += wrote_bytes;
+            left -= wrote_bytes;
+        }
+    }
+    if (fd >= 0) {
+        written = written && fdatasync(fd) == 0;
+        close(fd);
+    }
+    if (written && rename(string_builder_as_cstring(tmp_path), string_builder_as_cstring(path)) == 0)
+        segment = search_segment_open(string_builder_as_cstring(path));
+    if (segment == NULL) {
+        printf("err %d, cannot write search segment \"%s\"\n", errno, string_builder_as_cstring(path));
+        unlink(string_builder_as_cstring(tmp_path));
+    }
+    string_builder_free(path);
+    string_builder_free(tmp_path);
+    string_builder_free(builder->data);
+    free(builder->offsets.values);
+    return segment;
+}
+
+/* Term of entry i, pos is left at its postings */
+static bool search_segment_entry (search_segment_t* segment, size_t i, const char** term, size_t* length,
+                                  const char** pos) {
+    const char* end = segment->data + segment->header->directory;
+    uint64_t offset = segment->directory[i];
+    if (offset >= segment->header->directory)
+        return false;
+    *pos = segment->data + offset;
+    uint64_t term_length;
+    if (!search_read_varint(pos, end, &term_length) || term_length > (uint64_t)(end - *pos))
+        return false;
+    *term = *pos;
+    *length = term_length;
+    *pos += term_length;
+    return true;
+}
+
+static bool search_segment_read_postings (search_segment_t* segment, const char* pos, search_postings_t* out) {
+    const char* end = segment->data + segment->header->directory;
+    uint64_t count, value = 0, gap;
+    if (!search_read_varint(&pos, end, &count) || count > (uint64_t)(end - pos))
+        return false;
+    for (uint64_t i = 0; i < count; i++) {
+        if (!search_read_varint(&pos, end, &gap))
+            return false;
+        value += gap;
+        search_postings_push(out, value);
+    }
+    return true;
+}
+
+static int search_term_compare (const char* a, size_t a_length, const char* b, size_t b_length) {
+    int result = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    if (result != 0)
+        return result;
+    return a_length < b_length ? -1 : a_length > b_length;
+}
+
+/* Binary search over the directory, appends the postings of term when the segment has it */
+static void search_segment_find (search_segment_t* segment, const char* term, size_t length, search_postings_t* out) {
+    size_t low = 0, high = segment->header->terms;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const char* entry_term;
+        size_t entry_length;
+        const char* pos;
+        if (!search_segment_entry(segment, middle, &entry_term, &entry_length, &pos))
+            return;
+        int compare = search_term_compare(entry_term, entry_length, term, length);
+        if (compare == 0) {
+            search_segment_read_postings(segment, pos, out);
+            return;
+        }
+        if (compare < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+}
+
+static int search_compare_slots (const void* a, const void* b) {
+    return strcmp((*(search_postings_t* const*)a)->term, (*(search_postings_t* const*)b)->term);
+}
+
+/* Index thread, or the opening thread before it starts */
+void search_index_flush (search_index_t* index) {
+    pthread_rwlock_wrlock(&index->lock);
+    search_memtable_t* frozen = index->memtable;
+    if (frozen->postings == 0) {
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    index->frozen = frozen;
+    index->memtable = search_memtable_create(1024);
+    pthread_rwlock_unlock(&index->lock);
+
+    search_postings_t** sorted = malloc(sizeof(search_postings_t*) * frozen->terms);
+    size_t count = 0;
+    for (size_t i = 0; i < frozen->capacity; i++)
+        if (frozen->slots[i].term != NULL)
+            sorted[count++] = &frozen->slots[i];
+    qsort(sorted, count, sizeof(search_postings_t*), &search_compare_slots);
+    search_segment_builder_t builder;
+    search_builder_init(&builder);
+    for (size_t i = 0; i < count; i++)
+        search_builder_add(&builder, sorted[i]->term, strlen(sorted[i]->term), sorted[i]->values, sorted[i]->size);
+    free(sorted);
+    search_segment_t* segment = search_builder_finish(index, &builder, index->next_id++, NULL, 0);
+
+    // a segment written later would move the watermark past these postings, they go back to be flushed again
+    pthread_rwlock_wrlock(&index->lock);
+    if (segment != NULL)
+        list_push(index->segments, segment);
+    else
+        search_memtable_restore(index->memtable, frozen);
+    index->frozen = NULL;
+    pthread_rwlock_unlock(&index->lock);
+    search_memtable_free(frozen);
+}
+
+static int search_compare_segment_size (const void* a, const void* b) {
+    size_t x = (*(search_segment_t* const*)a)->size, y = (*(search_segment_t* const*)b)->size;
+    return x < y ? -1 : x > y;
+}
+
+/* Merges the SEARCH_MERGE_FANIN smallest segments into one, the postings of a term are merge sorted */
+void search_index_merge (search_index_t* index) {
+    search_segment_t* sources[SEARCH_MERGE_FANIN];
+    pthread_rwlock_rdlock(&index->lock);
+    size_t total = list_size(index->segments);
+    search_segment_t** all = malloc(sizeof(search_segment_t*) * (total > 0 ? total : 1));
+    for (size_t i = 0; i < total; i++)
+        all[i] = list_get(index->segments, i, search_segment_t*);
+    pthread_rwlock_unlock(&index->lock);
+    if (total < SEARCH_MERGE_FANIN) {
+        free(all);
+        return;
+    }
+    qsort(all, total, sizeof(search_segment_t*), &search_compare_segment_size);
+    memcpy(sources, all, sizeof(sources));
+    free(all);
+
+    size_t cursors[SEARCH_MERGE_FANIN] = {0};
+    uint64_t source_ids[SEARCH_MERGE_FANIN];
+    for (size_t i = 0; i < SEARCH_MERGE_FANIN; i++)
+        source_ids[i] = sources[i]->header->id;
+    search_segment_builder_t builder;
+    search_builder_init(&builder);
+    search_postings_t merged = {0};
+    while (true) {
+        const char* smallest = NULL;
+        size_t smallest_length = 0;
+        for (size_t i = 0; i < SEARCH_MERGE_FANIN; i++) {
+            const char* term;
+            size_t length;
+            const char* pos;
+            if (cursors[i] < sources[i]->header->terms
+                && search_segment_entry(sources[i], cursors[i], &term, &length, &pos)
+                && (smallest == NULL || search_term_compare(term, length, smallest, smallest_length) < 0)) {
+                smallest = term;
+                smallest_length = length;
+            }
+        }
+        if (smallest == NULL)
+            break;
+        merged.size = 0;
+        for (size_t i = 0; i < SEARCH_MERGE_FANIN; i++) {
+            const char* term;
+            size_t length;
+            const char* pos;
+            if (cursors[i] < sources[i]->header->terms
+                && search_segment_entry(sources[i], cursors[i], &term, &length, &pos)
+                && search_term_compare(term, length, smallest, smallest_length) == 0) {
+                search_segment_read_postings(sources[i], pos, &merged);
+                cursors[i]++;
+            }
+        }
+        search_postings_sort(&merged);
+        search_builder_add(&builder, smallest, smallest_length, merged.values, merged.size);
+    }
+    free(merged.values);
+    search_segment_t* segment = search_builder_finish(index, &builder, index->next_id++, source_ids,
+                                                      SEARCH_MERGE_FANIN);
+    if (segment == NULL)
+        return;
+
+    pthread_rwlock_wrlock(&index->lock);
+    list_t* segments = list_create(search_segment_t*);
+    for (size_t i = 0; i < list_size(index->segments); i++) {
+        search_segment_t* old = list_get(index->segments, i, search_segment_t*);
+        bool merged_source = false;
+        for (size_t j = 0; j < SEARCH_MERGE_FANIN; j++)
+            merged_source = merged_source || old == sources[j];
+        if (!merged_source)
+            list_push(segments, old);
+    }
+    list_push(segments, segment);
+    list_free(index->segments);
+    index->segments = segments;
+    pthread_rwlock_unlock(&index->lock);
+    for (size_t i = 0; i < SEARCH_MERGE_FANIN; i++)
+        search_segment_free(sources[i], true);
+}
+
+typedef struct search_add {
+    search_memtable_t* memtable;
+    uint64_t posting;
+} search_add_t;
+
+static void search_add_term (const char* term, size_t length, void* data) {
+    search_add_t* add = data;
+    search_memtable_add(add->memtable, term, length, add->posting);
+}
+
+/* Called with the write lock */
+static void search_index_add_record (search_index_t* index, long day_key, uint64_t offset,
+                                     const journal_record_t* record) {
+    uint64_t posting = SEARCH_POSTING(day_key, offset);
+    if (posting <= index->watermark)
+        return;
+    eso_event_t* event = journal_record_event(record);
+    if (event != NULL) {
+        search_add_t add = {index->memtable, posting};
+        search_event_terms(event, &search_add_term, &add);
+        eso_event_release(event);
+    }
+    index->watermark = posting;
+}
+
+/* Writer thread: records is what was just appended to the journal of day at offset */
+void search_index_add_records (search_index_t* index, const char* day, uint64_t offset,
+                               const char* records, size_t length) {
+    long day_key = journal_day_key(day);
+    size_t position = 0;
+    pthread_rwlock_wrlock(&index->lock);
+    while (length - position >= sizeof(journal_record_t)) {
+        const journal_record_t* record = (const journal_record_t*)(records + position);
+        search_index_add_record(index, day_key, offset + position, record);
+        position += sizeof(journal_record_t) + JOURNAL_PADDED(record->length);
+    }
+    bool full = index->memtable->postings >= SEARCH_MEMTABLE_POSTINGS;
+    pthread_rwlock_unlock(&index->lock);
+    if (full) {
+        mutex_lock(&index->mutex);
+        index->flush_pending = true;
+        pthread_cond_signal(&index->wake);
+        mutex_unlock(&index->mutex);
+    }
+}
+
+/* Indexes the journal records no segment has, oldest day first */
+void search_index_catch_up (search_index_t* index) {
+    DIR* dir = opendir(string_builder_as_cstring(index->log_dir));
+    if (dir == NULL)
+        return;
+    search_postings_t keys = {0};
+    struct dirent* entry;
+    long first_day = SEARCH_POSTING_DAY(index->watermark);
+    while ((entry = readdir(dir)) != NULL) {
+        long key = strstr(entry->d_name, JOURNAL_SUFFIX) != NULL ? journal_day_key(entry->d_name) : -1;
+        if (key >= first_day)
+            search_postings_push(&keys, (uint64_t)key);
+    }
+    closedir(dir);
+    qsort(keys.values, keys.size, sizeof(uint64_t), &search_compare_postings);
+
+    size_t indexed = 0;
+    for (size_t i = 0; i < keys.size; i++) {
+        string_builder_t* path = journal_day_path(string_builder_as_cstring(index->log_dir), (long)keys.values[i]);
+        journal_map_t* map = journal_map_open(string_builder_as_cstring(path));
+        string_builder_free(path);
+        if (map == NULL)
+            continue;
+        size_t offset = 0;
+        const journal_record_t* record;
+        while ((record = journal_map_next(map, &offset)) != NULL) {
+            pthread_rwlock_wrlock(&index->lock);
+            uint64_t watermark = index->watermark;
+            search_index_add_record(index, (long)keys.values[i], (const char*)record - map->data, record);
+            bool full = index->memtable->postings >= SEARCH_MEMTABLE_POSTINGS;
+            pthread_rwlock_unlock(&index->lock);
+            indexed += index->watermark != watermark;
+            if (full)
+                search_index_flush(index);
+        }
+        journal_map_close(map);
+    }
+    free(keys.values);
+    if (indexed > 0) {
+        printf("search index: %zu journal records indexed\n", indexed);
+        search_index_flush(index);
+    }
+}
+
+/* The lowest posting of a segment, the first one of some term */
+static uint64_t search_segment_first_posting (search_segment_t* segment) {
+    uint64_t first = UINT64_MAX;
+    const char* end = segment->data + segment->header->directory;
+    for (size_t i = 0; i < segment->header->terms; i++) {
+        const char* term;
+        size_t length;
+        const char* pos;
+        uint64_t count, value;
+        if (search_segment_entry(segment, i, &term, &length, &pos) && search_read_varint(&pos, end, &count)
+            && count > 0 && search_read_varint(&pos, end, &value) && value < first)
+            first = value;
+    }
+    return first;
+}
+
+/*
+ * Recovery may have cut the journal the watermark points into, or moved it aside, and the records
+ * written next would reuse the offsets. Segments with postings past its good records go, and so
+ * do the ones reaching past the first posting of a dropped one: what is left ends before anything
+ * dropped, its watermark is where catch_up indexes again from, after a crash too.
+ */
+static void search_index_check_journal (search_index_t* index) {
+    long day_key = SEARCH_POSTING_DAY(index->watermark);
+    size_t watermark_offset = SEARCH_POSTING_OFFSET(index->watermark);
+    size_t end = 0;
+    bool found = false;
+    string_builder_t* path = journal_day_path(string_builder_as_cstring(index->log_dir), day_key);
+    journal_map_t* map = journal_map_open(string_builder_as_cstring(path));
+    string_builder_free(path);
+    if (map != NULL) {
+        const journal_record_t* record;
+        while ((record = journal_map_next(map, &end)) != NULL)
+            found = found || (size_t)((const char*)record - map->data) == watermark_offset;
+        journal_map_close(map);
+    }
+    if (found)
+        return;
+    // records that are not where the index has them, the whole day is suspect
+    uint64_t limit = SEARCH_POSTING(day_key, watermark_offset < end ? 0 : end);
+    size_t dropped = 0;
+    bool again = true;
+    while (again) {
+        again = false;
+        list_t* kept = list_create(search_segment_t*);
+        for (size_t i = 0; i < list_size(index->segments); i++) {
+            search_segment_t* segment = list_get(index->segments, i, search_segment_t*);
+            if (segment->header->watermark < limit) {
+                list_push(kept, segment);
+                continue;
+            }
+            uint64_t first = search_segment_first_posting(segment);
+            if (first < limit) {
+                limit = first;
+                again = true;
+            }
+            search_segment_free(segment, true);
+            dropped++;
+        }
+        list_free(index->segments);
+        index->segments = kept;
+    }
+    index->watermark = 0;
+    for (size_t i = 0; i < list_size(index->segments); i++) {
+        search_segment_t* segment = list_get(index->segments, i, search_segment_t*);
+        if (segment->header->watermark > index->watermark)
+            index->watermark = segment->header->watermark;
+    }
+    printf("search index: the journal of %ld is shorter than the index, %zu segments dropped\n", day_key, dropped);
+}
+
+/* Loads the segments, a merge that was cut short leaves its sources behind and they go now */
+void search_index_load (search_index_t* index) {
+    DIR* dir = opendir(string_builder_as_cstring(index->dir));
+    if (dir == NULL)
+        return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length < 4 || !STREQUAL(entry->d_name + length - 4, ".seg"))
+            continue;
+        string_builder_t* path = string_builder_copy(string_builder_as_cstring(index->dir));
+        string_builder_append(path, entry->d_name);
+        search_segment_t* segment = search_segment_open(string_builder_as_cstring(path));
+        string_builder_free(path);
+        if (segment != NULL)
+            list_push(index->segments, segment);
+    }
+    closedir(dir);
+
+    list_t* loaded = index->segments;
+    index->segments = list_create(search_segment_t*);
+    for (size_t i = 0; i < list_size(loaded); i++) {
+        search_segment_t* segment = list_get(loaded, i, search_segment_t*);
+        bool merged = false;
+        for (size_t j = 0; j < list_size(loaded) && !merged; j++) {
+            search_segment_t* other = list_get(loaded, j, search_segment_t*);
+            for (size_t k = 0; k < SEARCH_MERGE_FANIN; k++)
+                merged = merged || other->header->sources[k] == segment->header->id;
+        }
+        if (merged) {
+            search_segment_free(segment, true);
+            continue;
+        }
+        list_push(index->segments, segment);
+        if (segment->header->id >= index->next_id)
+            index->next_id = segment->header->id + 1;
+        if (segment->header->watermark > index->watermark)
+            index->watermark = segment->header->watermark;
+    }
+    list_free(loaded);
+    if (index->watermark > 0)
+        search_index_check_journal(index);
+}
+
+search_index_t* search_index_open (const char* log_dir) {
+    search_index_t* index = MALLOC_STRUCT(search_index_t);
+    index->log_dir = string_builder_copy(log_dir);
+    index->dir = string_builder_copy(log_dir);
+    string_builder_append(index->dir, "index" FILE_SEP_S);
+    const char* dir_s = string_builder_as_cstring(index->dir);
+    if (mkdir(dir_s, S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST)
+        printf("err %d, cannot create directory \"%s\"\n", errno, dir_s);
+    pthread_rwlock_init(&index->lock, NULL);
+    index->segments = list_create(search_segment_t*);
+    index->memtable = search_memtable_create(1024);
+    index->frozen = NULL;
+    index->next_id = 1;
+    index->watermark = 0;
+    mutex_init(&index->mutex);
+    pthread_cond_init(&index->wake, NULL);
+    index->flush_pending = false;
+    index->running = true;
+
+    search_index_load(index);
+    search_index_catch_up(index);
+    // restarts leave a segment each, the thread merges them right away
+    index->flush_pending = list_size(index->segments) >= SEARCH_MERGE_FANIN;
+    if (pthread_create(&index->thread, NULL, &search_index_worker, (void*)index) != 0) {
+        printf("couldn't start the search index\n");
+        // there is no thread to join
+        index->running = false;
+        search_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+void* search_index_worker (void* _index) {
+    search_index_t* index = (search_index_t*)_index;
+    mutex_lock(&index->mutex);
+    while (true) {
+        while (!index->flush_pending && index->running)
+            pthread_cond_wait(&index->wake, &index->mutex);
+        if (!index->flush_pending)
+            break;
+        index->flush_pending = false;
+        mutex_unlock(&index->mutex);
+        search_index_flush(index);
+        search_index_merge(index);
+        mutex_lock(&index->mutex);
+    }
+    mutex_unlock(&index->mutex);
+    return NULL;
+}
+
+/* Whatever the memtable has goes to a last segment */
+void search_index_free (search_index_t* index) {
+    mutex_lock(&index->mutex);
+    bool was_running = index->running;
+    index->running = false;
+    pthread_cond_signal(&index->wake);
+    mutex_unlock(&index->mutex);
+    if (was_running)
+        pthread_join(index->thread, NULL);
+    search_index_flush(index);
+    for (size_t i = 0; i < list_size(index->segments); i++)
+        search_segment_free(list_get(index->segments, i, search_segment_t*), false);
+    list_free(index->segments);
+    search_memtable_free(index->memtable);
+    pthread_rwlock_destroy(&index->lock);
+    mutex_free(&index->mutex);
+    pthread_cond_destroy(&index->wake);
+    string_builder_free(index->log_dir);
+    string_builder_free(index->dir);
+    free(index);
+}
+
+/* Every posting of term, sorted. Called with the read lock */
+static void search_index_term (search_index_t* index, const char* term, size_t length, search_postings_t* out) {
+    search_memtable_t* memtables[2] = {index->frozen, index->memtable};
+    for (int i = 0; i < 2; i++) {
+        search_postings_t* postings = memtables[i] != NULL ? search_memtable_get(memtables[i], term, length) : NULL;
+        for (size_t j = 0; postings != NULL && j < postings->size; j++)
+            search_postings_push(out, postings->values[j]);
+    }
+    for (size_t i = 0; i < list_size(index->segments); i++)
+        search_segment_find(list_get(index->segments, i, search_segment_t*), term, length, out);
+    search_postings_sort(out);
+}
+
+/* Keeps the postings of into that other has too, both sorted */
+static void search_intersect (search_postings_t* into, const search_postings_t* other) {
+    size_t kept = 0, low = 0;
+    for (size_t i = 0; i < into->size && low < other->size; i++) {
+        uint64_t value = into->values[i];
+        // galloping, a short list against a long one stays cheap
+        size_t step = 1, high = low;
+        while (high < other->size && other->values[high] < value) {
+            low = high + 1;
+            high += step;
+            step *= 2;
+        }
+        if (high > other->size)
+            high = other->size;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (other->values[middle] < value)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low < other->size && other->values[low] == value)
+            into->values[kept++] = value;
+    }
+    into->size = kept;
+}
+
+typedef struct search_query {
+    char terms[SEARCH_QUERY_TERMS][SEARCH_TERM_MAX + 24];
+    size_t lengths[SEARCH_QUERY_TERMS];
+    size_t count;
+} search_query_t;
+
+static void search_query_term (const char* term, size_t length, void* data) {
+    search_query_t* query = data;
+    if (query->count == SEARCH_QUERY_TERMS)
+        return;
+    memcpy(query->terms[query->count], term, length);
+    query->lengths[query->count++] = length;
+}
+
+typedef struct search_journal {
+    long day_key;
+    journal_map_t* map;
+} search_journal_t;
+
+/* The event behind a posting formatted like the text log, NULL when the record is not there */
+static json_object* search_resolve (search_index_t* index, list_t* journals, uint64_t posting) {
+    long day_key = SEARCH_POSTING_DAY(posting);
+    journal_map_t* map = NULL;
+    for (size_t i = 0; i < list_size(journals) && map == NULL; i++) {
+        search_journal_t* journal = list_get(journals, i, search_journal_t*);
+        if (journal->day_key == day_key)
+            map = journal->map;
+    }
+    if (map == NULL) {
+        string_builder_t* path = journal_day_path(string_builder_as_cstring(index->log_dir), day_key);
+        map = journal_map_open(string_builder_as_cstring(path));
+        string_builder_free(path);
+        if (map == NULL)
+            return NULL;
+        search_journal_t* journal = MALLOC_STRUCT(search_journal_t);
+        journal->day_key = day_key;
+        journal->map = map;
+        list_push(journals, journal);
+    }
+    size_t offset = SEARCH_POSTING_OFFSET(posting);
+    const journal_record_t* record = journal_map_next(map, &offset);
+    if (record == NULL || (const char*)record - map->data != (ptrdiff_t)SEARCH_POSTING_OFFSET(posting))
+        return NULL;
+    eso_event_t* event = journal_record_event(record);
+    if (event == NULL)
+        return NULL;
+    string_builder_t* text = eso_event_format(event);
+    json_object* result = json_object_new_object();
+    json_object_object_add(result, "seq", json_object_new_int64((int64_t)record->seq));
+    json_object_object_add(result, "time", json_object_new_int64(record->time));
+    json_object_object_add(result, "text", json_object_new_string(string_builder_as_cstring(text)));
+    string_builder_free(text);
+    eso_event_release(event);
+    return result;
+}
+
+/*
+ * Events having every word of q, by the actor (id or name) and on the node given, newest first.
+ * NULL when there is nothing to search for.
+ */
+string_builder_t* search_index_query_json (search_index_t* index, const char* q, const char* actor,
+                                           const char* node, long limit) {
+    search_query_t query;
+    query.count = 0;
+    if (q != NULL)
+        search_tokenize(q, &search_query_term, &query);
+    char field[SEARCH_TERM_MAX + 24];
+    if (actor != NULL && *actor != '\0') {
+        char* end;
+        long id = strtol(actor, &end, 10);
+        if (*end == '\0')
+            search_query_term(field, snprintf(field, sizeof(field), "actor:%ld", id), &query);
+        else
+            search_query_term(field, search_fold(field, "name:", actor), &query);
+    }
+    if (node != NULL && *node != '\0')
+        search_query_term(field, search_fold(field, "node:", node), &query);
+    if (query.count == 0)
+        return NULL;
+    if (limit <= 0)
+        limit = SEARCH_DEFAULT_LIMIT;
+    if (limit > SEARCH_MAX_LIMIT)
+        limit = SEARCH_MAX_LIMIT;
+
+    search_postings_t found = {0};
+    search_postings_t term = {0};
+    pthread_rwlock_rdlock(&index->lock);
+    search_index_term(index, query.terms[0], query.lengths[0], &found);
+    for (size_t i = 1; i < query.count && found.size > 0; i++) {
+        term.size = 0;
+        search_index_term(index, query.terms[i], query.lengths[i], &term);
+        search_intersect(&found, &term);
+    }
+    pthread_rwlock_unlock(&index->lock);
+    free(term.values);
+
+    json_object* results = json_object_new_array();
+    list_t* journals = list_create(search_journal_t*);
+    for (size_t i = found.size; i > 0 && (long)json_object_array_length(results) < limit; i--) {
+        json_object* result = search_resolve(index, journals, found.values[i - 1]);
+        if (result != NULL)
+            json_object_array_add(results, result);
+    }
+    for (size_t i = 0; i < list_size(journals); i++) {
+        search_journal_t* journal = list_get(journals, i, search_journal_t*);
+        journal_map_close(journal->map);
+        free(journal);
+    }
+    list_free(journals);
+
+    json_object* root = json_object_new_object();
+    json_object_object_add(root, "total", json_object_new_int64((int64_t)found.size));
+    json_object_object_add(root, "results", results);
+    free(found.values);
+    string_builder_t* response = string_builder_copy(json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN));
+    json_object_put(root);
+    return response;
+}
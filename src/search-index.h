@@ -0,0 +1,89 @@
+#ifndef NOTIFIER_SEARCH_INDEX_H_HEADER
+#define NOTIFIER_SEARCH_INDEX_H_HEADER
+
+#include <stdint.h>
+#include "main.h"
+#include "eso.h"
+
+/*
+ * Inverted index over the journals: term -> sorted postings, a posting is the journal day
+ * as YYYYMMDD in the high half and the record offset in that day's journal in the low half.
+ * New postings gather in a memtable, the index thread writes it out as a segment of
+ * delta encoded lists and merges small segments together. Everything can be rebuilt from
+ * the journals, at start the records past the newest posting on disk are indexed again.
+ */
+
+#define SEARCH_TERM_MAX             64
+#define SEARCH_MEMTABLE_POSTINGS    (256 * 1024)
+#define SEARCH_MERGE_FANIN          8
+#define SEARCH_DEFAULT_LIMIT        50
+#define SEARCH_MAX_LIMIT            500
+#define SEARCH_SEGMENT_MAGIC        "ESOIDX1"
+#define SEARCH_SEGMENT_VERSION      1
+
+#define SEARCH_POSTING(day_key, offset) ((uint64_t)(day_key) << 32 | (uint32_t)(offset))
+#define SEARCH_POSTING_DAY(posting)     ((long)((posting) >> 32))
+#define SEARCH_POSTING_OFFSET(posting)  ((size_t)((posting) & 0xffffffffu))
+
+typedef struct search_postings {
+    char* term;             // NULL for a free slot
+    uint64_t* values;
+    size_t size;
+    size_t capacity;
+} search_postings_t;
+
+typedef struct search_memtable {
+    search_postings_t* slots;
+    size_t capacity;        // power of two
+    size_t terms;
+    size_t postings;
+} search_memtable_t;
+
+typedef struct search_segment_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t terms;
+    uint64_t id;
+    uint64_t watermark;     // the highest posting in the segment
+    uint64_t sources[SEARCH_MERGE_FANIN]; // segments merged into this one, 0 when unused
+    uint64_t directory;     // offset of the term offsets, sorted by term
+} search_segment_header_t;
+
+/* A segment file mapped read only */
+typedef struct search_segment {
+    const search_segment_header_t* header;
+    const char* data;
+    size_t size;
+    const uint64_t* directory;
+    char* path;
+} search_segment_t;
+
+typedef struct search_index {
+    string_builder_t* log_dir;
+    string_builder_t* dir;  // log_dir + "index/"
+    pthread_rwlock_t lock;  // segments, memtable and frozen
+    list_t* segments;       // search_segment_t*
+    search_memtable_t* memtable;
+    search_memtable_t* frozen; // on its way to a segment, still searched
+    uint64_t next_id;
+    uint64_t watermark;     // the highest posting indexed
+    pthread_t thread;
+    mutex_t mutex;
+    pthread_cond_t wake;
+    bool flush_pending;
+    bool running;
+} search_index_t;
+
+typedef void(*search_term_fun)(const char* term, size_t length, void* data);
+
+void search_tokenize (const char* text, search_term_fun term, void* data);
+void search_event_terms (eso_event_t* event, search_term_fun term, void* data);
+
+search_index_t* search_index_open (const char* log_dir);
+void search_index_add_records (search_index_t* index, const char* day, uint64_t offset,
+                               const char* records, size_t length);
+string_builder_t* search_index_query_json (search_index_t* index, const char* q, const char* actor,
+                                           const char* node, long limit);
+void search_index_free (search_index_t* index);
+
+#endif
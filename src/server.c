@@ -1,23 +1,26 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
-#include <poll.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
 
 #include "server.h"
+#include "scan.h"
 #include "util.h"
 #include "config.h"
 
 #define ERRNO98 "Address already in use"
 #define ERRNO99 "Address not available"
 
-int create_server (global_ctx_t* global_ctx, server_ctx_t *ctx, request_callback_fun req_callback, const char* ip, const char* port) {
+int open_server_socket (const char* ip, const char* port, bool reuse_port) {
     int server_sd = -1;
     struct addrinfo* addrinfo_result;
     struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
@@ -30,13 +33,19 @@ int create_server (global_ctx_t* global_ctx, server_ctx_t *ctx, request_callback
         return -1;
     }
 
-    int bind_err = -1, bind_errno;
+    int bind_err = -1, bind_errno = 0;
     for (struct addrinfo* curaddr = addrinfo_result; curaddr != NULL; curaddr = curaddr->ai_next) {
         server_sd = socket(curaddr->ai_family, curaddr->ai_socktype, curaddr->ai_protocol);
         if (server_sd < 0)
             break;
         int reuseaddr_val = 1;
         setsockopt(server_sd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_val, sizeof(reuseaddr_val));
+        if (reuse_port && setsockopt(server_sd, SOL_SOCKET, SO_REUSEPORT, &reuseaddr_val, sizeof(reuseaddr_val)) != 0) {
+            printf("SO_REUSEPORT is not supported, err %d\n", errno);
+            close(server_sd);
+            freeaddrinfo(addrinfo_result);
+            return -2;
+        }
 
         struct sockaddr_in* sin = (struct sockaddr_in*) curaddr->ai_addr;
         printf("binding to %s:%d\n", inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
@@ -62,305 +71,1307 @@ int create_server (global_ctx_t* global_ctx, server_ctx_t *ctx, request_callback
 
     if (listen(server_sd, 1000) != 0) {
         printf("listen() error: %d\n", errno);
+        close(server_sd);
         return -3;
     }
+    fcntl(server_sd, F_SETFL, fcntl(server_sd, F_GETFL, 0) | O_NONBLOCK);
+    return server_sd;
+}
+
+int create_server_loop (server_ctx_t* ctx, server_loop_t* loop, const char* ip, const char* port) {
+    int server_sd = open_server_socket(ip, port, ctx->loops_count > 1);
+    if (server_sd < 0)
+        return server_sd;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        printf("epoll/eventfd error: %d\n", errno);
+        goto error;
+    }
+    // the listening socket and the wake up descriptor are told apart from connections by address
+    struct epoll_event server_event = {.events = EPOLLIN, .data.ptr = &loop->server_sd};
+    struct epoll_event wake_event = {.events = EPOLLIN, .data.ptr = &loop->wake_fd};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sd, &server_event) != 0
+            || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake_event) != 0) {
+        printf("epoll_ctl() error: %d\n", errno);
+        goto error;
+    }
+
+    loop->server = ctx;
+    loop->server_sd = server_sd;
+    loop->epoll_fd = epoll_fd;
+    loop->wake_fd = wake_fd;
+    loop->thread = 0;
+    loop->connections = list_create(connection_t*);
+    loop->completed = NULL;
+    mutex_init(&loop->completed_mutex);
+    loop->parked = NULL;
+    loop->wake_generation = 0;
+    return 0;
+
+    error:
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (wake_fd >= 0)
+        close(wake_fd);
+    close(server_sd);
+    return -4;
+}
+
+void free_server_loop (server_loop_t* loop) {
+    for (size_t i = 0; i < list_size(loop->connections); i++) {
+        connection_t* conn = list_get(loop->connections, i, connection_t*);
+        close_connection(loop->server, conn);
+        free_connection(conn);
+    }
+    list_free(loop->connections);
+    mutex_free(&loop->completed_mutex);
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
+    close(loop->server_sd);
+}
+
+int create_server (global_ctx_t* global_ctx, server_ctx_t *ctx, request_callback_fun req_callback,
+                   chunk_callback_fun chunk_callback, websocket_callback_fun websocket_callback,
+                   const char* ip, const char* port) {
+    scan_init();
+    long loops_count = config_get_long(global_ctx->config, "threads", 1);
+    long workers_count = config_get_long(global_ctx->config, "workers", SERVER_DEFAULT_WORKERS);
+
+    ctx->keep_alive_timeout = config_get_long(global_ctx->config, "keepalive_timeout", SERVER_KEEP_ALIVE_TIMEOUT) * 1000;
+    ctx->keep_alive_requests = config_get_long(global_ctx->config, "keepalive_requests", SERVER_KEEP_ALIVE_REQUESTS);
+    ctx->stream_timeout = config_get_long(global_ctx->config, "stream_timeout", SERVER_STREAM_TIMEOUT) * 1000;
+    ctx->ping_interval = config_get_long(global_ctx->config, "ping_interval", SERVER_PING_INTERVAL) * 1000;
     ctx->request_callback = req_callback;
-    ctx->server_sd = server_sd;
+    ctx->chunk_callback = chunk_callback;
+    ctx->websocket_callback = websocket_callback;
     ctx->state = 0;
     ctx->global_ctx = global_ctx;
+    ctx->loops_count = loops_count < 1 ? 1 : loops_count;
+    ctx->workers_count = workers_count < 0 ? 0 : workers_count;
+    ctx->workers = calloc(ctx->workers_count + 1, sizeof(pthread_t));
+    ctx->jobs_head = NULL;
+    ctx->jobs_tail = NULL;
+    atomic_init(&ctx->wake_generation, 0);
+    mutex_init(&ctx->jobs_mutex);
+    pthread_cond_init(&ctx->jobs_cond, NULL);
+
+    ctx->loops = calloc(ctx->loops_count, sizeof(server_loop_t));
+    for (size_t i = 0; i < ctx->loops_count; i++) {
+        int loop_error = create_server_loop(ctx, &ctx->loops[i], ip, port);
+        if (loop_error < 0) {
+            while (i > 0)
+                free_server_loop(&ctx->loops[--i]);
+            free(ctx->loops);
+            free(ctx->workers);
+            return loop_error;
+        }
+    }
 
     return 0;
 }
 
 void stop_server_loop (server_ctx_t* ctx) {
+    mutex_lock(&ctx->jobs_mutex);
     ctx->state = 2;
+    pthread_cond_broadcast(&ctx->jobs_cond);
+    mutex_unlock(&ctx->jobs_mutex);
+    for (size_t i = 0; i < ctx->loops_count; i++)
+        eventfd_write(ctx->loops[i].wake_fd, 1);
 }
 
-pthread_t run_server (server_ctx_t* ctx) {
-    pthread_t thread;
+int run_server (server_ctx_t* ctx) {
     ctx->state = 1;
-    int result = pthread_create(&thread, NULL, &server_listener, (void*)ctx);
-    if (result != 0) {
-        ctx->state = 0;
-        return 0;
+    for (size_t i = 0; i < ctx->workers_count; i++) {
+        if (pthread_create(&ctx->workers[i], NULL, &server_worker, (void*)ctx) != 0) {
+            printf("couldn't start server worker %ld\n", i);
+            ctx->workers_count = i;
+            stop_server_loop(ctx);
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < ctx->loops_count; i++) {
+        server_loop_t* loop = &ctx->loops[i];
+        if (pthread_create(&loop->thread, NULL, &server_listener, (void*)loop) != 0) {
+            printf("couldn't start server thread %ld\n", i);
+            stop_server_loop(ctx);
+            return -1;
+        }
     }
-    ctx->worker = thread;
+    printf("server: %ld threads, %ld workers, %s scanner\n", ctx->loops_count, ctx->workers_count, scan_kernel_name());
+    return 0;
+}
 
-    return thread;
+void join_server (server_ctx_t* ctx) {
+    for (size_t i = 0; i < ctx->loops_count; i++)
+        if (ctx->loops[i].thread != 0)
+            pthread_join(ctx->loops[i].thread, NULL);
+    for (size_t i = 0; i < ctx->workers_count; i++)
+        pthread_join(ctx->workers[i], NULL);
+
+    for (size_t i = 0; i < ctx->loops_count; i++)
+        free_server_loop(&ctx->loops[i]);
+    free(ctx->loops);
+    free(ctx->workers);
+    mutex_free(&ctx->jobs_mutex);
+    pthread_cond_destroy(&ctx->jobs_cond);
+    free(ctx);
 }
 
-void sig_child_handler (int pid) {
-    wait(NULL);
+void close_connection (server_ctx_t* ctx, connection_t* conn) {
+    if (conn->closed)
+        return;
+    epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->sd, NULL);
+    shutdown(conn->sd, SHUT_RDWR);
+    close(conn->sd);
+    conn->closed = true;
 }
 
-void* server_listener (void* _ctx) {
-    server_ctx_t* ctx = (server_ctx_t*)_ctx;
-//    bool debug = ctx->global_ctx->config->debug;
-    bool debug = true;
-    signal(SIGCHLD, sig_child_handler);
-    while(ctx->state == 1) {
-        int client_sd = accept(ctx->server_sd, NULL, NULL);
-        int pid;
-        if (!debug)
-            pid = fork();
-        else
-            pid = 0;
-        if (pid < 0) {
-            printf("couldn't create process\n");
-            shutdown(client_sd, SHUT_RDWR);
-            close(client_sd);
+void connection_flush (server_ctx_t* ctx, connection_t* conn) {
+    while (conn->out != NULL && conn->out_pos < string_builder_size(conn->out)) {
+        ssize_t sent = send(conn->sd, conn->out->value + conn->out_pos,
+                            string_builder_size(conn->out) - conn->out_pos, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            close_connection(ctx, conn);
+            return;
         }
-        else if (pid > 0);
-        else {
-            if (client_sd < 0) {
-                printf("accept() error %d, client %d\n", errno, client_sd);
+        conn->out_pos += sent;
+        conn->last_active = get_monotonic_ms();
+    }
+    if (conn->out != NULL) {
+        string_builder_free(conn->out);
+        conn->out = NULL;
+        conn->out_pos = 0;
+    }
+    if (conn->close_after_write)
+        close_connection(ctx, conn);
+}
+
+/* Gathers the buffers into one send, whatever the socket does not take is queued. iov is consumed */
+void connection_sendv (connection_t* conn, struct iovec* iov, int count) {
+    if (conn == NULL || conn->closed)
+        return;
+
+    if (conn->out == NULL) {
+        // nothing queued yet, try to write straight from the caller's buffers
+        while (count > 0) {
+            struct msghdr message = {.msg_iov = iov, .msg_iovlen = count};
+            ssize_t sent = sendmsg(conn->sd, &message, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    conn->close_after_write = true;
+                    return;
+                }
                 break;
             }
-            serve_client(ctx, client_sd);
-            shutdown(client_sd, SHUT_RDWR);
-            close(client_sd);
-            if (!debug) {
-                fflush(stdout);
-                shutdown(STDOUT_FILENO, SHUT_WR);
-                close(STDOUT_FILENO);
-                exit(0);
+            while (count > 0 && (size_t)sent >= iov->iov_len) {
+                sent -= iov->iov_len;
+                iov++;
+                count--;
             }
+            if (count > 0) {
+                iov->iov_base = (char*)iov->iov_base + sent;
+                iov->iov_len -= sent;
+            }
+        }
+        if (count == 0)
+            return;
+        size_t rest = 0;
+        for (int i = 0; i < count; i++)
+            rest += iov[i].iov_len;
+        conn->out = string_builder_create(rest + 1);
+    }
+    for (int i = 0; i < count; i++)
+        string_builder_append_string(conn->out, iov[i].iov_base, iov[i].iov_len);
+}
+
+/* Called by whoever owns the request: the loop thread or the worker running the callback */
+void server_sendv (request_t* req, struct iovec* iov, int count) {
+    connection_sendv(req->conn.connection, iov, count);
+}
+
+void server_send (request_t* req, const char* data, size_t length) {
+    struct iovec iov = {.iov_base = (void*)data, .iov_len = length};
+    connection_sendv(req->conn.connection, &iov, 1);
+}
+
+void connection_send_frame (connection_t* conn, int opcode, const char* payload, size_t length) {
+    uint8_t header[WEBSOCKET_MAX_HEADER_LENGTH];
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = websocket_frame_header(header, opcode, length)},
+        {.iov_base = (void*)payload, .iov_len = length}
+    };
+    connection_sendv(conn, iov, 2);
+}
+
+/* The payload goes out as is, the frame header is gathered in front of it */
+void server_send_frame (request_t* req, int opcode, const char* payload, size_t length) {
+    connection_send_frame(req->conn.connection, opcode, payload, length);
+}
+
+/*
+ * Answers the upgrade request of the callback with 101, the connection speaks websocket as soon as
+ * the callback returns. Returns false when the request is not a valid upgrade, nothing is sent then.
+ */
+bool server_accept_websocket (request_t* req) {
+    const char* upgrade = request_get_header(req, "upgrade");
+    const char* version = request_get_header(req, "sec-websocket-version");
+    const char* key = request_get_header(req, "sec-websocket-key");
+    if (req->method != HTTP_METHOD_GET || upgrade == NULL || strcasecmp(upgrade, "websocket") != 0
+            || version == NULL || strcmp(version, "13") != 0 || key == NULL || key[0] == '\0')
+        return false;
+
+    char accept[WEBSOCKET_ACCEPT_LENGTH + 1];
+    websocket_accept_key(key, strlen(key), accept);
+    string_builder_t* response = string_builder_create(256);
+    http_switching_protocols(response, accept);
+    server_send(req, response->value, string_builder_size(response));
+    string_builder_free(response);
+    req->upgrade = true;
+    return true;
+}
+
+size_t connection_backlog (connection_t* conn) {
+    return conn->out != NULL ? string_builder_size(conn->out) - conn->out_pos : 0;
+}
+
+/*
+ * Called by the request callback instead of responding, the connection waits in its loop without
+ * holding a worker. The deadline is kept when the callback parks the same request again.
+ */
+void server_park_request (request_t* req, long long timeout_ms) {
+    req->parked = true;
+    if (req->park_deadline == 0)
+        req->park_deadline = get_monotonic_ms() + timeout_ms;
+}
+
+/* Safe from any thread, parked requests run again on their loops */
+void server_wake_parked (server_ctx_t* ctx) {
+    atomic_fetch_add(&ctx->wake_generation, 1);
+    for (size_t i = 0; i < ctx->loops_count; i++)
+        eventfd_write(ctx->loops[i].wake_fd, 1);
+}
+
+void* server_worker (void* _ctx) {
+    server_ctx_t* ctx = (server_ctx_t*)_ctx;
+    while (true) {
+        mutex_lock(&ctx->jobs_mutex);
+        while (ctx->jobs_head == NULL && ctx->state == 1)
+            pthread_cond_wait(&ctx->jobs_cond, &ctx->jobs_mutex);
+        connection_t* conn = ctx->jobs_head;
+        if (conn != NULL) {
+            ctx->jobs_head = conn->queue_next;
+            if (ctx->jobs_head == NULL)
+                ctx->jobs_tail = NULL;
+        }
+        mutex_unlock(&ctx->jobs_mutex);
+        if (conn == NULL)
+            break;
+
+        request_t* req = conn->request;
+        if (conn->ws.active) {
+            if (ctx->websocket_callback != NULL)
+                ctx->websocket_callback(ctx, req, req->chunk != NULL ? conn->ws.opcode : 0, req->chunk, req->chunk_length);
+        }
+        else if (req->chunk != NULL) {
+            if (ctx->chunk_callback != NULL)
+                ctx->chunk_callback(ctx, req, req->chunk, req->chunk_length);
         }
+        else if (ctx->request_callback != NULL)
+            ctx->request_callback(ctx, req);
 
+        // hand the connection back to the loop that owns its socket
+        server_loop_t* loop = conn->loop;
+        mutex_lock(&loop->completed_mutex);
+        conn->queue_next = loop->completed;
+        loop->completed = conn;
+        mutex_unlock(&loop->completed_mutex);
+        eventfd_write(loop->wake_fd, 1);
     }
-    close(ctx->server_sd);
-    free(ctx);
     return NULL;
 }
 
-void serve_client (server_ctx_t* ctx, int client_sd) {
-    char buf[CLIENT_SOCKET_BUF_SIZE];
-    buf[CLIENT_SOCKET_BUF_SIZE - 1] = 0;
-    size_t buf_length = CLIENT_SOCKET_BUF_SIZE;
-    ssize_t bytes_read;
+/* Drops the finished request from the receive buffer, whatever follows it is the next pipelined one */
+void finish_request (server_ctx_t* ctx, connection_t* conn) {
+    size_t consumed = conn->request->p.end;
+    reset_request(conn->request);
+    memmove(conn->buf, conn->buf + consumed, conn->buf_length - consumed);
+    conn->buf_length -= consumed;
+    if (conn->buf_size > CLIENT_SOCKET_BUF_SIZE * 4 && conn->buf_length < CLIENT_SOCKET_BUF_SIZE) {
+        // give back the memory of a large body
+        char* memory = realloc(conn->buf, CLIENT_SOCKET_BUF_SIZE);
+        if (memory != NULL) {
+            conn->buf = memory;
+            conn->buf_size = CLIENT_SOCKET_BUF_SIZE;
+        }
+    }
+    connection_flush(ctx, conn);
+}
 
-    struct pollfd fd = {.fd = client_sd, .events = POLLIN};
-    struct pollfd fds[] = {fd};
-    request_t* req = NULL;
-    int poll_retries = 0;
-    bool flag = false;
+/* The worker owns the request and the output buffer until the loop gets the connection back */
+void queue_job (server_ctx_t* ctx, connection_t* conn) {
+    conn->busy = true;
+    conn->queue_next = NULL;
+    mutex_lock(&ctx->jobs_mutex);
+    if (ctx->jobs_tail != NULL)
+        ctx->jobs_tail->queue_next = conn;
+    else
+        ctx->jobs_head = conn;
+    ctx->jobs_tail = conn;
+    pthread_cond_signal(&ctx->jobs_cond);
+    mutex_unlock(&ctx->jobs_mutex);
+}
 
-    do {
-        bytes_read = recv(client_sd, buf, buf_length, MSG_DONTWAIT);
-//        printf("client %d bytes: %ld, errno: %d\n", client_sd, bytes_read, errno);
-        if (bytes_read < 0) {
-            if (errno == EAGAIN) {
-                poll(fds, sizeof(fds) / sizeof(fds[0]), 1000);
-                poll_retries++;
-            }
-            else {
-                printf("read error %d\n", errno);
-                break;
-            }
+bool connection_reserve (connection_t* conn, size_t free_space) {
+    if (conn->buf_size - conn->buf_length >= free_space)
+        return true;
+    if (conn->buf_length + free_space > CLIENT_MAX_BUF_SIZE)
+        return false;
+    // doubling would overshoot the cap long before a largest request fills it
+    size_t new_size = conn->buf_size * 2;
+    while (new_size - conn->buf_length < free_space)
+        new_size *= 2;
+    if (new_size > CLIENT_MAX_BUF_SIZE)
+        new_size = CLIENT_MAX_BUF_SIZE;
+    char* memory = realloc(conn->buf, new_size);
+    if (memory == NULL)
+        return false;
+    conn->buf = memory;
+    conn->buf_size = new_size;
+    return true;
+}
+
+/* Drops the frames of a handled message, a pull leaves the buffer alone */
+void finish_websocket (server_ctx_t* ctx, connection_t* conn) {
+    request_t* req = conn->request;
+    if (req->chunk != NULL) {
+        conn->buf[conn->ws.message_start + conn->ws.message_length] = conn->ws.saved_byte;
+        memmove(conn->buf, conn->buf + conn->ws.frame_end, conn->buf_length - conn->ws.frame_end);
+        conn->buf_length -= conn->ws.frame_end;
+        conn->ws.opcode = 0;
+        conn->ws.message_start = 0;
+        conn->ws.message_length = 0;
+        conn->ws.frame_end = 0;
+        req->chunk = NULL;
+        req->chunk_length = 0;
+    }
+    connection_flush(ctx, conn);
+}
+
+void run_websocket (server_ctx_t* ctx, connection_t* conn) {
+    request_t* req = conn->request;
+    req->conn.client_sd = conn->sd;
+    req->conn.connection = conn;
+    if (ctx->workers_count == 0) {
+        if (ctx->websocket_callback != NULL)
+            ctx->websocket_callback(ctx, req, req->chunk != NULL ? conn->ws.opcode : 0, req->chunk, req->chunk_length);
+        finish_websocket(ctx, conn);
+        return;
+    }
+    queue_job(ctx, conn);
+}
+
+/* Lets the callback push what it has queued, held back while the client is behind on reading */
+void websocket_pull (server_ctx_t* ctx, connection_t* conn) {
+    if (!conn->ws.pull || conn->busy || conn->closed || conn->close_after_write
+            || connection_backlog(conn) > SERVER_WEBSOCKET_BACKLOG)
+        return;
+    conn->ws.pull = false;
+    run_websocket(ctx, conn);
+}
+
+void dispatch_websocket_message (server_ctx_t* ctx, connection_t* conn) {
+    request_t* req = conn->request;
+    size_t end = conn->ws.message_start + conn->ws.message_length;
+    // the byte after the message may belong to the next frame
+    conn->ws.saved_byte = conn->buf[end];
+    conn->buf[end] = '\0';
+    req->chunk = conn->buf + conn->ws.message_start;
+    req->chunk_length = conn->ws.message_length;
+    run_websocket(ctx, conn);
+}
+
+void websocket_control (server_ctx_t* ctx, connection_t* conn, int opcode, const char* payload, size_t length) {
+    if (opcode == WEBSOCKET_OP_PING)
+        connection_send_frame(conn, WEBSOCKET_OP_PONG, payload, length);
+    else if (opcode == WEBSOCKET_OP_CLOSE) {
+        // echo the status code and close once it is written
+        connection_send_frame(conn, WEBSOCKET_OP_CLOSE, payload, length >= 2 ? 2 : 0);
+        conn->close_after_write = true;
+        connection_flush(ctx, conn);
+    }
+}
+
+/* The client is told why before the connection closes: 413 for a request, 1009 for a message */
+void connection_reject_too_large (server_ctx_t* ctx, connection_t* conn) {
+    if (conn->ws.active) {
+        char code[2] = {(char)(WEBSOCKET_CLOSE_TOO_BIG >> 8), (char)(WEBSOCKET_CLOSE_TOO_BIG & 0xff)};
+        connection_send_frame(conn, WEBSOCKET_OP_CLOSE, code, 2);
+    }
+    else {
+        const string_builder_t* response = http_static_response(HTTP_STATIC_TOO_LARGE, false);
+        struct iovec iov = {.iov_base = response->value, .iov_len = response->size};
+        connection_sendv(conn, &iov, 1);
+    }
+    conn->close_after_write = true;
+    connection_flush(ctx, conn);
+}
+
+/*
+ * Frames are unmasked in place and a whole message is passed straight from the receive buffer.
+ * Pieces of a fragmented message are joined by moving them over the frame headers between them.
+ */
+bool websocket_parse (server_ctx_t* ctx, connection_t* conn) {
+    while (!conn->closed && !conn->close_after_write && !conn->busy) {
+        size_t frame_start = conn->ws.opcode != 0 ? conn->ws.message_start + conn->ws.message_length : 0;
+        if (conn->buf_length <= frame_start)
+            return true;
+        // the pieces of a fragmented message count together
+        websocket_frame_t frame;
+        int status = websocket_parse_frame(conn->buf + frame_start, conn->buf_length - frame_start,
+                                           HTTP_MAX_CONTENT_LENGTH - conn->ws.message_length, &frame);
+        if (status == WEBSOCKET_FRAME_TOO_LARGE) {
+            connection_reject_too_large(ctx, conn);
+            return true;
+        }
+        if (status == WEBSOCKET_FRAME_INVALID)
+            return false;
+        if (status == WEBSOCKET_FRAME_INCOMPLETE)
+            return connection_reserve(conn, frame_start + frame.header_length + frame.payload_length + 1 - conn->buf_length);
+        // clients always mask
+        if (!frame.masked)
+            return false;
+
+        char* payload = conn->buf + frame_start + frame.header_length;
+        size_t frame_end = frame_start + frame.header_length + frame.payload_length;
+        websocket_unmask(payload, frame.payload_length, frame.mask);
+        if (WEBSOCKET_IS_CONTROL(frame.opcode)) {
+            websocket_control(ctx, conn, frame.opcode, payload, frame.payload_length);
+            memmove(conn->buf + frame_start, conn->buf + frame_end, conn->buf_length - frame_end);
+            conn->buf_length -= frame_end - frame_start;
+            continue;
+        }
+
+        bool continuation = frame.opcode == WEBSOCKET_OP_CONTINUATION;
+        if (continuation != (conn->ws.opcode != 0))
+            return false;
+        if (!continuation) {
+            if (frame.opcode != WEBSOCKET_OP_TEXT && frame.opcode != WEBSOCKET_OP_BINARY)
+                return false;
+            conn->ws.opcode = frame.opcode;
+            conn->ws.message_start = frame_start + frame.header_length;
+            conn->ws.message_length = frame.payload_length;
+            conn->ws.frame_end = frame_end;
         }
-        else if (bytes_read == 0)
-            break;
         else {
-            if (req == NULL)
-                req = create_request();
-            req->flag = flag;
-            req->p.buf_pos = 0;
-            int req_status = parse_request(req, buf, bytes_read);
-            if (req_status != ok)
-                goto cleanup;
-            if (req->p.crlf2 && req->method != HTTP_METHOD_POST)
-                break;
-            if (req->p.body && req->p.word_pos >= req->body_length)
-                break;
+            memmove(conn->buf + frame_start, payload, conn->buf_length - (frame_start + frame.header_length));
+            conn->buf_length -= frame.header_length;
+            conn->ws.message_length += frame.payload_length;
+            conn->ws.frame_end = frame_end - frame.header_length;
         }
-    } while (bytes_read > 0 || poll_retries < 5);
+        if (frame.fin)
+            dispatch_websocket_message(ctx, conn);
+    }
+    return true;
+}
+
+/* Whatever follows the upgrade request in the buffer is already websocket frames */
+void upgrade_connection (server_ctx_t* ctx, connection_t* conn) {
+    conn->close_after_write = false;
+    conn->ws.active = true;
+    conn->ws.pull = true;
+    conn->ws.last_ping = get_monotonic_ms();
+    finish_request(ctx, conn);
+    websocket_pull(ctx, conn);
+}
+
+/* A parked connection stays busy so nothing is read or parsed past the waiting request */
+void park_connection (connection_t* conn) {
+    server_loop_t* loop = conn->loop;
+    conn->request->parked = false;
+    conn->busy = true;
+    conn->parked = true;
+    conn->queue_next = loop->parked;
+    loop->parked = conn;
+}
 
-    if (req == NULL)
+void complete_request (server_ctx_t* ctx, connection_t* conn) {
+    if (conn->request->parked)
+        park_connection(conn);
+    else if (conn->request->upgrade)
+        upgrade_connection(ctx, conn);
+    else
+        finish_request(ctx, conn);
+}
+
+void run_request (server_ctx_t* ctx, connection_t* conn) {
+    // a wake up that comes while the callback runs must not be missed if it parks
+    conn->request->wake_generation = atomic_load(&ctx->wake_generation);
+    if (ctx->workers_count == 0) {
+        if (ctx->request_callback != NULL)
+            ctx->request_callback(ctx, conn->request);
+        complete_request(ctx, conn);
         return;
+    }
+    queue_job(ctx, conn);
+}
 
-    req->conn.client_sd = client_sd;
-    if (ctx->request_callback != NULL)
-        ctx->request_callback(ctx, req);
-    cleanup:
-    if (req != NULL)
-        free_request(req);
+void dispatch_request (server_ctx_t* ctx, connection_t* conn) {
+    request_t* req = conn->request;
+    conn->requests_served++;
+    request_terminate_strings(req, conn->buf);
+    req->conn.client_sd = conn->sd;
+    req->conn.connection = conn;
+    req->keep_alive = ctx->state == 1
+            && conn->requests_served < ctx->keep_alive_requests
+            && request_wants_keep_alive(req);
+    if (!req->keep_alive)
+        conn->close_after_write = true;
+    run_request(ctx, conn);
 }
 
-void write_param (struct parser* p, char* buf, char** param) {
-//    if (p->word_pos == 0)
-    *param = malloc(sizeof(char) * (p->word_pos + 1));
-    memcpy(*param, buf + p->buf_pos - p->word_pos, p->word_pos);
-    (*param)[p->word_pos] = '\0';
-    p->word_pos = 0;
+void finish_chunk (server_ctx_t* ctx, connection_t* conn) {
+    conn->buf_length = request_drop_chunk(conn->request, conn->buf, conn->buf_length);
+    connection_flush(ctx, conn);
 }
 
-enum http_parse_error parse_request (request_t* req, char* buf, size_t buf_len) {
-    struct parser* p = &req->p;
+void dispatch_chunk (server_ctx_t* ctx, connection_t* conn) {
+    request_t* req = conn->request;
+    request_terminate_strings(req, conn->buf);
+    request_take_chunk(req, conn->buf);
+    req->conn.client_sd = conn->sd;
+    req->conn.connection = conn;
+
+    if (ctx->workers_count == 0) {
+        if (ctx->chunk_callback != NULL)
+            ctx->chunk_callback(ctx, req, req->chunk, req->chunk_length);
+        finish_chunk(ctx, conn);
+        return;
+    }
+    queue_job(ctx, conn);
+}
+
+/* Parses whatever is buffered, returns false when the connection has to be dropped */
+bool connection_parse (server_ctx_t* ctx, connection_t* conn) {
+    while (conn->buf_length > 0 && !conn->closed && !conn->close_after_write && !conn->busy) {
+        if (conn->ws.active)
+            return websocket_parse(ctx, conn);
+        if (conn->request == NULL)
+            conn->request = create_request();
+        request_t* req = conn->request;
+
+        enum http_parse_error req_status = parse_request(req, conn->buf, conn->buf_length);
+        if (req_status == large_content_length) {
+            connection_reject_too_large(ctx, conn);
+            return true;
+        }
+        if (req_status != ok)
+            return false;
 
-    while (p->buf_pos < buf_len) {
-        char c = buf[p->buf_pos];
+        if (req->p.state == HTTP_N_CHUNK_READY) {
+            dispatch_chunk(ctx, conn);
+            continue;
+        }
+        if (!request_is_complete(req)) {
+            if (req->p.state == HTTP_N_BODY)
+                // the body is read in place, make room for all of it plus the terminator
+                return connection_reserve(conn, req->p.body_start + req->body_length + 1 - conn->buf_length);
+            if (req->p.state == HTTP_N_CHUNK_DATA)
+                return connection_reserve(conn, req->p.chunk_start + req->p.chunk_size + 3 - conn->buf_length);
+            return conn->buf_length - req->p.body_start < HTTP_MAX_HEADERS_LENGTH;
+        }
+        dispatch_request(ctx, conn);
+    }
+    return true;
+}
 
-        if (p->body) {
-            if (req->body == NULL)
-                return body_not_allocated;
-            if (p->crlf2) {
-                p->crlf2 = false;
-                p->word_pos = 0;
+void connection_read (server_ctx_t* ctx, connection_t* conn) {
+    while (!conn->closed && !conn->close_after_write && !conn->busy) {
+        // a websocket client that does not read what is pushed to it is not read from either
+        if (conn->ws.active && connection_backlog(conn) > SERVER_WEBSOCKET_BACKLOG)
+            return;
+        if (!connection_reserve(conn, CLIENT_SOCKET_BUF_SIZE / 2)) {
+            close_connection(ctx, conn);
+            return;
+        }
+        // one byte is always left spare for the terminator written after a body
+        ssize_t bytes_read = recv(conn->sd, conn->buf + conn->buf_length, conn->buf_size - conn->buf_length - 1, 0);
+        if (bytes_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
                 continue;
+            printf("read error %d\n", errno);
+            close_connection(ctx, conn);
+            return;
+        }
+        if (bytes_read == 0) {
+            // peer is done sending, answer what was already received and close
+            conn->close_after_write = true;
+            connection_flush(ctx, conn);
+            return;
+        }
+        conn->buf_length += bytes_read;
+        conn->last_active = get_monotonic_ms();
+        if (!connection_parse(ctx, conn)) {
+            close_connection(ctx, conn);
+            return;
+        }
+    }
+}
+
+/* Runs parked requests again once woken or expired, drops the ones whose client went away */
+void resume_parked (server_loop_t* loop) {
+    if (loop->parked == NULL)
+        return;
+    server_ctx_t* ctx = loop->server;
+    unsigned int generation = atomic_load(&ctx->wake_generation);
+    long long now = get_monotonic_ms();
+
+    connection_t* conn = loop->parked;
+    loop->parked = NULL;
+    while (conn != NULL) {
+        connection_t* next = conn->queue_next;
+        request_t* req = conn->request;
+        bool expired = now >= req->park_deadline;
+        if (!conn->closed && !expired && req->wake_generation == generation) {
+            conn->queue_next = loop->parked;
+            loop->parked = conn;
+        }
+        else {
+            conn->busy = false;
+            conn->parked = false;
+            conn->last_active = now;
+            if (!conn->closed) {
+                req->park_expired = expired;
+                run_request(ctx, conn);
+                // answered inline, pipelined requests behind it can go on
+                if (!conn->busy) {
+                    if (!connection_parse(ctx, conn))
+                        close_connection(ctx, conn);
+                    connection_read(ctx, conn);
+                }
             }
-            if (p->word_pos > req->body_length)
-                return body_overflow;
-            (req->body)[p->word_pos++] = c;
-            p->buf_pos++;
-            if (c == '\0')
-                break;
-            else
+        }
+        conn = next;
+    }
+}
+
+/* Every websocket of the loop is asked to push once server_wake_parked was called */
+void wake_websockets (server_loop_t* loop) {
+    server_ctx_t* ctx = loop->server;
+    unsigned int generation = atomic_load(&ctx->wake_generation);
+    if (generation == loop->wake_generation)
+        return;
+    loop->wake_generation = generation;
+    for (size_t i = 0; i < list_size(loop->connections); i++) {
+        connection_t* conn = list_get(loop->connections, i, connection_t*);
+        if (conn->ws.active && !conn->closed) {
+            conn->ws.pull = true;
+            websocket_pull(ctx, conn);
+        }
+    }
+}
+
+/* Takes back connections finished by workers, edge triggered events missed meanwhile are replayed */
+void collect_completed (server_loop_t* loop) {
+    server_ctx_t* ctx = loop->server;
+    eventfd_t value;
+    eventfd_read(loop->wake_fd, &value);
+
+    mutex_lock(&loop->completed_mutex);
+    connection_t* conn = loop->completed;
+    loop->completed = NULL;
+    mutex_unlock(&loop->completed_mutex);
+
+    while (conn != NULL) {
+        connection_t* next = conn->queue_next;
+        conn->busy = false;
+        conn->last_active = get_monotonic_ms();
+        if (conn->ws.active)
+            finish_websocket(ctx, conn);
+        else if (conn->request->chunk != NULL)
+            finish_chunk(ctx, conn);
+        else
+            complete_request(ctx, conn);
+        if (!connection_parse(ctx, conn))
+            close_connection(ctx, conn);
+        connection_read(ctx, conn);
+        if (conn->ws.active)
+            websocket_pull(ctx, conn);
+        conn = next;
+    }
+    resume_parked(loop);
+    wake_websockets(loop);
+}
+
+void accept_clients (server_loop_t* loop) {
+    while (true) {
+        int client_sd = accept(loop->server_sd, NULL, NULL);
+        if (client_sd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                printf("accept() error %d\n", errno);
+            return;
+        }
+        fcntl(client_sd, F_SETFL, fcntl(client_sd, F_GETFL, 0) | O_NONBLOCK);
+        connection_t* conn = create_connection(client_sd);
+        conn->loop = loop;
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_sd, &event) != 0) {
+            printf("epoll_ctl() error %d, client %d\n", errno, client_sd);
+            close(client_sd);
+            free_connection(conn);
+            continue;
+        }
+        list_push(loop->connections, conn);
+    }
+}
+
+/* Drops closed and idle connections, must not run while an event batch is being handled */
+void sweep_connections (server_loop_t* loop) {
+    server_ctx_t* ctx = loop->server;
+    list_t* connections = loop->connections;
+    long long now = get_monotonic_ms();
+    size_t kept = 0;
+    for (size_t i = 0; i < list_size(connections); i++) {
+        connection_t* conn = list_get(connections, i, connection_t*);
+        long long timeout = conn->request != NULL && request_is_streaming(conn->request)
+                ? ctx->stream_timeout : ctx->keep_alive_timeout;
+        if (conn->ws.active)
+            // a client that misses two pings in a row is gone
+            timeout = ctx->ping_interval > 0 ? ctx->ping_interval * 2 : ctx->stream_timeout;
+        if (!conn->busy && !conn->closed && now - conn->last_active > timeout)
+            close_connection(ctx, conn);
+        else if (conn->ws.active && !conn->busy && !conn->closed && ctx->ping_interval > 0
+                && now - conn->last_active > ctx->ping_interval && now - conn->ws.last_ping > ctx->ping_interval) {
+            connection_send_frame(conn, WEBSOCKET_OP_PING, NULL, 0);
+            conn->ws.last_ping = now;
+            connection_flush(ctx, conn);
+        }
+        if (!conn->busy && conn->closed)
+            free_connection(conn);
+        else
+            list_set(connections, kept++, conn);
+    }
+    connections->size = kept;
+}
+
+void* server_listener (void* _loop) {
+    server_loop_t* loop = (server_loop_t*)_loop;
+    server_ctx_t* ctx = loop->server;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    while (ctx->state == 1) {
+        int events_count = epoll_wait(loop->epoll_fd, events, SERVER_MAX_EVENTS, SERVER_POLL_TIMEOUT_MS);
+        if (events_count < 0) {
+            if (errno == EINTR)
                 continue;
+            printf("epoll_wait() error %d\n", errno);
+            break;
         }
 
-        if (c == p->expected_breakpoint) {
-            if (p->current_param == HTTP_N_METHOD) {
-                p->current_param = HTTP_N_URI;
-                write_param(p, buf, &req->method_name);
+        for (int i = 0; i < events_count; i++) {
+            void* source = events[i].data.ptr;
+            if (source == &loop->server_sd) {
+                accept_clients(loop);
+                continue;
             }
-            else if (p->current_param == HTTP_N_URI) {
-                req->method = match_method_name(req->method_name);
-                p->current_param = HTTP_N_VERSION;
-                p->expected_breakpoint = '\r';
-                write_param(p, buf, &req->uri);
+            if (source == &loop->wake_fd) {
+                collect_completed(loop);
+                continue;
             }
-            else if (p->current_param == HTTP_N_VERSION) {
-                p->expected_breakpoint = '\n';
-                p->current_param = HTTP_N_HEADERS;
-                write_param(p, buf, &req->http_version);
+            connection_t* conn = (connection_t*)source;
+            if (conn->parked) {
+                // still owned by this loop: finish writing earlier responses, notice a client giving up
+                if (events[i].events & EPOLLOUT && conn->out != NULL && !conn->close_after_write)
+                    connection_flush(ctx, conn);
+                if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                    close_connection(ctx, conn);
+                continue;
             }
-            else if (p->current_param == HTTP_N_HEADERS) {
-                if (c == '\n') {
-                    p->expected_breakpoint = ':';
-                    goto final;
-                }
-                else if (c == ':') {
-                    header_t* next = create_header();
-                    if (p->last_header != NULL) {
-                        // doesn't check last header
-                        if (p->last_header->name == NULL || p->last_header->value == NULL)
-                            return incomplete_header;
-                        p->last_header->next = next;
-                    }
-                    else
-                        req->header = next;
-                    p->last_header = next;
-                    write_param(p, buf, &p->last_header->name);
-                    p->expected_breakpoint = ' ';
-                }
-                else if (c == ' ') {
-                    p->expected_breakpoint = '\r';
-                    goto final;
-                }
-                else {
-                    if (p->last_header == NULL)
-                        return header_value_without_name;
-                    write_param(p, buf, &p->last_header->value);
-                    p->expected_breakpoint = '\n';
-                    static char cnt_length_h_name[] = "Content-Length";
-                    if (
-                            req->misc.content_length_header == NULL &&
-                            strncasecmp(p->last_header->name, cnt_length_h_name, sizeof(cnt_length_h_name)) == 0
-                    ) {
-                        size_t content_length = strtoll(p->last_header->value, NULL, 10);
-                        if (content_length > HTTP_MAX_CONTENT_LENGTH)
-                            return large_content_length;
-                        req->misc.content_length_header = p->last_header;
-                        req->body_length = content_length;
-                        req->misc.content_length = content_length;
-                        if (content_length > 0) {
-                            req->body = malloc(sizeof(char) * (content_length + 1));
-                            req->body[content_length] = '\0';
-                        }
-                    }
-                }
-
-                if (p->buf_pos < buf_len - 3 && c == '\r' && buf[p->buf_pos + 1] == '\n' && buf[p->buf_pos + 2] == '\r' && buf[p->buf_pos + 3] == '\n') {
-                    p->body = true;
-                    p->crlf2 = true;
+            // a worker is running this connection, collect_completed catches up on it later
+            if (conn->busy)
+                continue;
+            if (events[i].events & EPOLLIN)
+                connection_read(ctx, conn);
+            if (!conn->closed && !conn->busy && events[i].events & EPOLLOUT) {
+                connection_flush(ctx, conn);
+                if (conn->ws.active) {
+                    // the client caught up, reads and pushes held back by the backlog can go on
+                    connection_read(ctx, conn);
+                    websocket_pull(ctx, conn);
                 }
             }
-            else {
-                printf("%s\n", "unknown param");
-                goto final;
-            }
+            if (!conn->closed && !conn->busy && events[i].events & (EPOLLERR | EPOLLHUP))
+                close_connection(ctx, conn);
+        }
+        resume_parked(loop);
+        sweep_connections(loop);
+    }
+    return NULL;
+}
+
+#define HTTP_HASH_SEED 0x811c9dc5u
+#define HTTP_HASH_PRIME 0x01000193u
+
+/* FNV-1a over lowercase bytes, the case labels below are this hash of the header names */
+uint32_t http_header_hash (const char* name, size_t length) {
+    uint32_t hash = HTTP_HASH_SEED;
+    for (size_t i = 0; i < length; i++) {
+        char c = name[i];
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        hash = (hash ^ (uint8_t)c) * HTTP_HASH_PRIME;
+    }
+    return hash;
+}
+
+int match_known_header (const char* name, size_t length) {
+    int slot;
+    const char* expected;
+    switch (http_header_hash(name, length)) {
+        case 0x4df9451du:
+            slot = HTTP_HEADER_CONTENT_LENGTH;
+            expected = "content-length";
+            break;
+        case 0x38b99ed9u:
+            slot = HTTP_HEADER_CONNECTION;
+            expected = "connection";
+            break;
+        case 0xfcf70995u:
+            slot = HTTP_HEADER_CONTENT_TYPE;
+            expected = "content-type";
+            break;
+        case 0xddb4744cu:
+            slot = HTTP_HEADER_TRANSFER_ENCODING;
+            expected = "transfer-encoding";
+            break;
+        default:
+            return -1;
+    }
+    if (strlen(expected) != length || strncasecmp(name, expected, length) != 0)
+        return -1;
+    return slot;
+}
+
+http_string_t http_string_make (size_t start, size_t end) {
+    http_string_t view = {.offset = (uint32_t)start, .length = (uint32_t)(end - start)};
+    return view;
+}
+
+bool is_http_whitespace (char c) {
+    return c == ' ' || c == '\t';
+}
+
+enum http_parse_error parse_content_length (request_t* req, const char* value, size_t length) {
+    if (length == 0)
+        return invalid_content_length;
+    size_t content_length = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (value[i] < '0' || value[i] > '9')
+            return invalid_content_length;
+        content_length = content_length * 10 + (value[i] - '0');
+        if (content_length > HTTP_MAX_CONTENT_LENGTH)
+            return large_content_length;
+    }
+    req->body_length = content_length;
+    return ok;
+}
+
+enum http_parse_error parse_transfer_encoding (request_t* req, const char* buf) {
+    int index = req->known_headers[HTTP_HEADER_TRANSFER_ENCODING];
+    if (index < 0)
+        return ok;
+    http_string_t value = req->headers[index].value;
+    if (value.length != 7 || strncasecmp(buf + value.offset, "chunked", 7) != 0)
+        return unsupported_transfer_encoding;
+    // Content-Length is ignored when both are present
+    req->chunked = true;
+    req->body_length = 0;
+    return ok;
+}
+
+enum http_parse_error parse_chunk_size (const char* line, size_t length, size_t* chunk_size) {
+    size_t size = 0, digits = 0;
+    for (; digits < length; digits++) {
+        char c = line[digits];
+        int value;
+        if (c >= '0' && c <= '9')
+            value = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            value = c - 'A' + 10;
+        else
+            break;
+        size = size * 16 + value;
+        if (size > HTTP_MAX_CONTENT_LENGTH)
+            return large_content_length;
+    }
+    // chunk extensions after ';' are ignored
+    if (digits == 0 || (digits < length && line[digits] != ';' && !is_http_whitespace(line[digits])))
+        return invalid_chunk;
+    *chunk_size = size;
+    return ok;
+}
+
+/* Request line tokens and header names, a header value is only bound by HTTP_MAX_HEADERS_LENGTH */
+size_t parse_word_limit (struct parser* p) {
+    return p->state == HTTP_N_HEADERS && p->colon != 0 ? HTTP_MAX_HEADERS_LENGTH : HTTP_WORD_MAX_LENGTH;
+}
 
-            if (p->body)
-                p->buf_pos += 3;
+enum http_parse_error parse_header_line (request_t* req, char* buf, size_t start, size_t colon, size_t end) {
+    if (req->headers_count >= HTTP_MAX_HEADERS)
+        return too_many_headers;
+    if (colon == 0 || colon <= start || colon >= end)
+        return incomplete_header;
+    size_t name_end = colon;
+    while (name_end > start && is_http_whitespace(buf[name_end - 1]))
+        name_end--;
+    size_t value_start = colon + 1;
+    while (value_start < end && is_http_whitespace(buf[value_start]))
+        value_start++;
+    size_t value_end = end;
+    while (value_end > value_start && is_http_whitespace(buf[value_end - 1]))
+        value_end--;
+
+    header_t* header = &req->headers[req->headers_count];
+    header->name = http_string_make(start, name_end);
+    header->value = http_string_make(value_start, value_end);
+
+    int known = match_known_header(buf + start, name_end - start);
+    if (known >= 0 && req->known_headers[known] < 0) {
+        req->known_headers[known] = (int8_t)req->headers_count;
+        if (known == HTTP_HEADER_CONTENT_LENGTH) {
+            enum http_parse_error error = parse_content_length(req, buf + value_start, value_end - value_start);
+            if (error != ok)
+                return error;
         }
-        else if (c == '\0') {
+    }
+    req->headers_count++;
+    return ok;
+}
+
+/*
+ * Resumable, returns ok with p.state below HTTP_N_DONE when more bytes are needed.
+ * buf may be reallocated between calls, only offsets are kept.
+ */
+enum http_parse_error parse_request (request_t* req, char* buf, size_t buf_len) {
+    struct parser* p = &req->p;
+
+    while (p->state != HTTP_N_DONE) {
+        if (p->state == HTTP_N_BODY) {
+            if (buf_len - p->body_start < req->body_length)
+                return ok;
+            p->end = p->body_start + req->body_length;
+            p->state = HTTP_N_DONE;
             break;
         }
-        else
-            p->word_pos++;
+        if (p->state == HTTP_N_CHUNK_DATA) {
+            size_t data_end = p->chunk_start + p->chunk_size;
+            if (buf_len < data_end + 2)
+                return ok;
+            if (buf[data_end] != '\r' || buf[data_end + 1] != '\n')
+                return invalid_chunk;
+            p->chunk_next = data_end + 2;
+            p->state = HTTP_N_CHUNK_READY;
+        }
+        // the chunk stays in the buffer until request_drop_chunk
+        if (p->state == HTTP_N_CHUNK_READY)
+            return ok;
+
+        // one pass per line: request line tokens end at a space, header names at the first colon
+        int delimiters = SCAN_LF;
+        if (p->state == HTTP_N_METHOD || p->state == HTTP_N_URI)
+            delimiters |= SCAN_SPACE;
+        else if (p->state == HTTP_N_HEADERS && p->colon == 0)
+            delimiters |= SCAN_COLON;
+        size_t found = scan_delimiters(buf, p->buf_pos, buf_len, delimiters);
+        if (found == buf_len) {
+            p->buf_pos = buf_len;
+            if (buf_len - p->word_start >= parse_word_limit(p))
+                return large_word;
+            return ok;
+        }
+        if (buf[found] == ':') {
+            if (found - p->word_start >= HTTP_WORD_MAX_LENGTH)
+                return large_word;
+            p->colon = found;
+            p->buf_pos = found + 1;
+            continue;
+        }
 
-        final:
-        if (p->word_pos >= HTTP_WORD_MAX_LENGTH)
+        size_t word_end = found;
+        if (buf[found] == '\n') {
+            // an empty line before the request line, a CRLF left after the last body, is skipped
+            if (p->state == HTTP_N_METHOD
+                && (found == p->word_start || (found == p->word_start + 1 && buf[p->word_start] == '\r'))) {
+                p->word_start = found + 1;
+                p->buf_pos = found + 1;
+                continue;
+            }
+            if (p->state == HTTP_N_METHOD || p->state == HTTP_N_URI)
+                return bad_request_line;
+            if (word_end > p->word_start && buf[word_end - 1] == '\r')
+                word_end--;
+        }
+        if (word_end - p->word_start >= parse_word_limit(p))
             return large_word;
-        p->buf_pos++;
+
+        switch (p->state) {
+            case HTTP_N_METHOD:
+                if (word_end == p->word_start)
+                    return bad_request_line;
+                req->method_view = http_string_make(p->word_start, word_end);
+                req->method = match_method_name(buf + p->word_start, word_end - p->word_start);
+                p->state = HTTP_N_URI;
+                break;
+            case HTTP_N_URI:
+                if (word_end == p->word_start)
+                    return bad_request_line;
+                req->uri_view = http_string_make(p->word_start, word_end);
+                p->state = HTTP_N_VERSION;
+                break;
+            case HTTP_N_VERSION:
+                req->version_view = http_string_make(p->word_start, word_end);
+                p->state = HTTP_N_HEADERS;
+                break;
+            case HTTP_N_HEADERS: {
+                if (word_end == p->word_start) {
+                    p->body_start = found + 1;
+                    enum http_parse_error error = parse_transfer_encoding(req, buf);
+                    if (error != ok)
+                        return error;
+                    p->state = req->chunked ? HTTP_N_CHUNK_SIZE : HTTP_N_BODY;
+                    break;
+                }
+                enum http_parse_error error = parse_header_line(req, buf, p->word_start, p->colon, word_end);
+                if (error != ok)
+                    return error;
+                p->colon = 0;
+                break;
+            }
+            case HTTP_N_CHUNK_SIZE: {
+                size_t chunk_size;
+                enum http_parse_error error = parse_chunk_size(buf + p->word_start, word_end - p->word_start, &chunk_size);
+                if (error != ok)
+                    return error;
+                p->chunk_line_start = p->word_start;
+                if (chunk_size == 0)
+                    p->state = HTTP_N_TRAILERS;
+                else {
+                    p->chunk_start = found + 1;
+                    p->chunk_size = chunk_size;
+                    p->state = HTTP_N_CHUNK_DATA;
+                }
+                break;
+            }
+            case HTTP_N_TRAILERS:
+                // trailer fields are not used, only the blank line ending them matters
+                if (word_end == p->word_start) {
+                    p->end = found + 1;
+                    p->state = HTTP_N_DONE;
+                }
+                break;
+        }
+        p->buf_pos = found + 1;
+        p->word_start = p->buf_pos;
     }
     return ok;
 }
 
+bool request_is_complete (request_t* req) {
+    return req->p.state == HTTP_N_DONE;
+}
+
+/* Turns the views into C strings by writing terminators over the delimiters that follow them */
+void request_terminate_strings (request_t* req, char* buf) {
+    req->buf = buf;
+    req->method_name = buf + req->method_view.offset;
+    req->method_name[req->method_view.length] = '\0';
+    req->uri = buf + req->uri_view.offset;
+    req->uri[req->uri_view.length] = '\0';
+    req->http_version = buf + req->version_view.offset;
+    req->http_version[req->version_view.length] = '\0';
+    for (size_t i = 0; i < req->headers_count; i++) {
+        header_t* header = &req->headers[i];
+        buf[header->name.offset + header->name.length] = '\0';
+        buf[header->value.offset + header->value.length] = '\0';
+    }
+
+    if (req->body_length > 0) {
+        // the byte after the body may already belong to the next pipelined request
+        req->p.saved_byte = buf[req->p.end];
+        req->p.byte_saved = true;
+        buf[req->p.end] = '\0';
+        req->body = buf + req->p.body_start;
+    }
+}
+
+void request_take_chunk (request_t* req, char* buf) {
+    req->chunk = buf + req->p.chunk_start;
+    req->chunk_length = req->p.chunk_size;
+    req->chunk[req->chunk_length] = '\0';
+}
+
+/* Cuts the consumed chunk with its size line out of the buffer, returns the new buffer length */
+size_t request_drop_chunk (request_t* req, char* buf, size_t buf_len) {
+    struct parser* p = &req->p;
+    memmove(buf + p->chunk_line_start, buf + p->chunk_next, buf_len - p->chunk_next);
+    buf_len -= p->chunk_next - p->chunk_line_start;
+    p->buf_pos = p->chunk_line_start;
+    p->word_start = p->chunk_line_start;
+    p->state = HTTP_N_CHUNK_SIZE;
+    req->chunk = NULL;
+    req->chunk_length = 0;
+    return buf_len;
+}
+
+bool request_is_streaming (request_t* req) {
+    return req->chunked && req->p.state != HTTP_N_DONE;
+}
+
+const char* request_get_header (request_t* req, const char* name) {
+    size_t length = strlen(name);
+    for (size_t i = 0; i < req->headers_count; i++) {
+        header_t* header = &req->headers[i];
+        if (header->name.length == length && strncasecmp(req->buf + header->name.offset, name, length) == 0)
+            return req->buf + header->value.offset;
+    }
+    return NULL;
+}
+
+const char* request_get_known_header (request_t* req, int known_header) {
+    int index = req->known_headers[known_header];
+    if (index < 0)
+        return NULL;
+    return req->buf + req->headers[index].value.offset;
+}
+
+bool request_wants_keep_alive (request_t* req) {
+    const char* connection = request_get_known_header(req, HTTP_HEADER_CONNECTION);
+    if (connection != NULL) {
+        if (strcasecmp(connection, "close") == 0)
+            return false;
+        if (strcasecmp(connection, "keep-alive") == 0)
+            return true;
+    }
+    return STREQUAL(req->http_version, "HTTP/1.1");
+}
+
+connection_t* create_connection (int client_sd) {
+    connection_t* conn = MALLOC_STRUCT(connection_t);
+    conn->sd = client_sd;
+    conn->buf = malloc(sizeof(char) * CLIENT_SOCKET_BUF_SIZE);
+    conn->buf_length = 0;
+    conn->buf_size = CLIENT_SOCKET_BUF_SIZE;
+    conn->loop = NULL;
+    conn->queue_next = NULL;
+    conn->busy = false;
+    conn->parked = false;
+    conn->request = NULL;
+    conn->ws.active = false;
+    conn->ws.pull = false;
+    conn->ws.opcode = 0;
+    conn->ws.message_start = 0;
+    conn->ws.message_length = 0;
+    conn->ws.frame_end = 0;
+    conn->ws.saved_byte = '\0';
+    conn->ws.last_ping = 0;
+    conn->requests_served = 0;
+    conn->out = NULL;
+    conn->out_pos = 0;
+    conn->close_after_write = false;
+    conn->closed = false;
+    conn->last_active = get_monotonic_ms();
+    return conn;
+}
+
+void free_connection (connection_t* conn) {
+    if (conn->request != NULL)
+        free_request(conn->request);
+    if (conn->out != NULL)
+        string_builder_free(conn->out);
+    free(conn->buf);
+    free(conn);
+}
+
 request_t* create_request () {
     request_t* req = MALLOC_STRUCT(request_t);
+    req->buf = NULL;
+    req->p.byte_saved = false;
+    req->park_data = NULL;
+    reset_request(req);
+    return req;
+}
+
+void reset_request (request_t* req) {
+    if (req->p.byte_saved)
+        req->buf[req->p.end] = req->p.saved_byte;
+
     req->conn.client_sd = -1;
+    req->conn.connection = NULL;
+    req->keep_alive = false;
 
     req->p.buf_pos = 0;
-    req->p.word_pos = 0;
-    req->p.body = false;
-    req->p.crlf2 = false;
-    req->p.expected_breakpoint = ' ';
-    req->p.current_param = HTTP_N_METHOD;
-    req->p.last_header = NULL;
-
-    req->misc.content_length_header = NULL;
-    req->misc.content_length = 0;
+    req->p.word_start = 0;
+    req->p.body_start = 0;
+    req->p.end = 0;
+    req->p.colon = 0;
+    req->p.chunk_line_start = 0;
+    req->p.chunk_start = 0;
+    req->p.chunk_size = 0;
+    req->p.chunk_next = 0;
+    req->p.state = HTTP_N_METHOD;
+    req->p.saved_byte = '\0';
+    req->p.byte_saved = false;
 
+    req->buf = NULL;
     req->method = HTTP_METHOD_UNSET;
     req->method_name = NULL;
     req->uri = NULL;
     req->http_version = NULL;
     req->body = NULL;
     req->body_length = 0;
-    return req;
-}
-
-header_t* create_header () {
-    header_t* header = MALLOC_STRUCT(header_t);
-    header->name = NULL;
-    header->value = NULL;
-    header->next = NULL;
-    return header;
+    req->chunked = false;
+    req->chunk = NULL;
+    req->chunk_length = 0;
+    req->headers_count = 0;
+    for (int i = 0; i < HTTP_KNOWN_HEADERS; i++)
+        req->known_headers[i] = -1;
+    req->upgrade = false;
+    req->parked = false;
+    req->park_expired = false;
+    req->park_deadline = 0;
+    req->wake_generation = 0;
+    req->park_target = 0;
+    if (req->park_data != NULL)
+        req->park_data_free(req->park_data);
+    req->park_data = NULL;
 }
 
 void free_request (request_t* req) {
-    FREE_IF_NOTNULL(req, method_name);
-    FREE_IF_NOTNULL(req, uri);
-    FREE_IF_NOTNULL(req, http_version);
-    FREE_IF_NOTNULL(req, body);
-    header_t* next = req->header;
-    while (next != NULL) {
-        header_t* current = next;
-        next = current->next;
-        free(current);
-    }
+    reset_request(req);
     free(req);
 }
 
-int match_method_name (char* method_name) {
-    if (STREQUAL(method_name, "GET"))
+int match_method_name (const char* method_name, size_t length) {
+    if (length == 3 && memcmp(method_name, "GET", 3) == 0)
         return HTTP_METHOD_GET;
-    else if (STREQUAL(method_name, "POST"))
+    else if (length == 4 && memcmp(method_name, "POST", 4) == 0)
         return HTTP_METHOD_POST;
-    else if (STREQUAL(method_name, "OPTIONS"))
+    else if (length == 7 && memcmp(method_name, "OPTIONS", 7) == 0)
         return HTTP_METHOD_OPTIONS;
-    else if (STREQUAL(method_name, "HEAD"))
+    else if (length == 4 && memcmp(method_name, "HEAD", 4) == 0)
         return HTTP_METHOD_HEAD;
     else
         return HTTP_METHOD_UNSET;
@@ -1,16 +1,36 @@
 #ifndef NOTIFIER_SERVER_H_HEADER
 #define NOTIFIER_SERVER_H_HEADER
 
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 #include "main.h"
+#include "websocket.h"
 
 #define HTTP_MAX_CONTENT_LENGTH 8388608 // 8MiB
+#define HTTP_MAX_HEADERS_LENGTH 65536 // 64KiB
 #define CLIENT_SOCKET_BUF_SIZE 8192 // 8KiB
+#define CLIENT_MAX_BUF_SIZE (HTTP_MAX_HEADERS_LENGTH + HTTP_MAX_CONTENT_LENGTH + CLIENT_SOCKET_BUF_SIZE)
+#define SERVER_MAX_EVENTS 64
+#define SERVER_POLL_TIMEOUT_MS 500
+#define SERVER_KEEP_ALIVE_TIMEOUT 5 // seconds
+#define SERVER_KEEP_ALIVE_REQUESTS 1000
+#define SERVER_STREAM_TIMEOUT 300 // seconds
+#define SERVER_DEFAULT_WORKERS 4
+#define SERVER_PING_INTERVAL 30 // seconds
+#define SERVER_WEBSOCKET_BACKLOG 65536 // 64KiB of unsent frames stops reading and pushing
 #define HTTP_WORD_MAX_LENGTH 2048
-#define HTTP_N_METHOD   1
-#define HTTP_N_URI      2
-#define HTTP_N_VERSION  3
-#define HTTP_N_HEADERS  4
-#define HTTP_N_BODY     5
+#define HTTP_MAX_HEADERS 32
+#define HTTP_N_METHOD       1
+#define HTTP_N_URI          2
+#define HTTP_N_VERSION      3
+#define HTTP_N_HEADERS      4
+#define HTTP_N_BODY         5
+#define HTTP_N_DONE         6
+#define HTTP_N_CHUNK_SIZE   7
+#define HTTP_N_CHUNK_DATA   8
+#define HTTP_N_CHUNK_READY  9
+#define HTTP_N_TRAILERS     10
 
 #define HTTP_METHOD_UNSET (-1)
 #define HTTP_METHOD_GET     1
@@ -18,67 +38,195 @@
 #define HTTP_METHOD_OPTIONS 3
 #define HTTP_METHOD_HEAD    4
 
+/* Headers the server looks at, resolved to a slot while parsing */
+#define HTTP_HEADER_CONTENT_LENGTH      0
+#define HTTP_HEADER_CONNECTION          1
+#define HTTP_HEADER_CONTENT_TYPE        2
+#define HTTP_HEADER_TRANSFER_ENCODING   3
+#define HTTP_KNOWN_HEADERS              4
+
 enum http_parse_error {
-    ok, body_not_allocated, body_overflow, incomplete_header, header_value_without_name, large_word, large_content_length
+    ok, bad_request_line, incomplete_header, too_many_headers, large_word, large_content_length, invalid_content_length,
+    unsupported_transfer_encoding, invalid_chunk
 };
 
 typedef struct request_data request_t;
 typedef struct server_ctx server_ctx_t;
+typedef struct connection connection_t;
+typedef struct server_loop server_loop_t;
 
 typedef void(*request_callback_fun)(server_ctx_t* ctx, request_t*);
+typedef void(*chunk_callback_fun)(server_ctx_t* ctx, request_t*, char* chunk, size_t chunk_length);
+/*
+ * opcode is WEBSOCKET_OP_TEXT or WEBSOCKET_OP_BINARY. message is NULL and opcode 0 when the
+ * callback is asked to push whatever it has queued for the client.
+ */
+typedef void(*websocket_callback_fun)(server_ctx_t* ctx, request_t*, int opcode, char* message, size_t message_length);
+
+/* Location of a token inside the connection receive buffer */
+typedef struct http_string {
+    uint32_t offset;
+    uint32_t length;
+} http_string_t;
 
 typedef struct header {
-    char* name;
-    char* value;
-    struct header* next;
+    http_string_t name;
+    http_string_t value;
 } header_t;
 
 struct parser {
-    size_t word_pos;
     size_t buf_pos;
-    bool body;
-    bool crlf2;
-    char expected_breakpoint;
-    int current_param;
-    header_t* last_header;
+    size_t word_start;
+    size_t body_start;
+    size_t end;
+    size_t colon;
+    size_t chunk_line_start;
+    size_t chunk_start;
+    size_t chunk_size;
+    size_t chunk_next;
+    int state;
+    char saved_byte;
+    bool byte_saved;
 };
 
+/*
+ * Everything points into the receive buffer of the connection, nothing is allocated per request.
+ * The char* fields are null terminated in place right before the request callback runs and stay
+ * valid until the callback returns.
+ * A chunked body is never assembled: every chunk is passed to the chunk callback as soon as it is
+ * complete and dropped from the buffer afterwards, the request callback then runs with body NULL.
+ * A callback that calls server_park_request sends nothing, it runs again on server_wake_parked
+ * or with park_expired set once the deadline passes.
+ * After server_accept_websocket the request is reused for the messages of that connection, they are
+ * passed the same way as chunks.
+ */
 typedef struct request_data {
-    bool flag;
     struct {
         int client_sd;
+        connection_t* connection;
     } conn;
-    struct {
-        header_t* content_length_header;
-        size_t content_length;
-    } misc;
+    bool keep_alive;
     struct parser p;
+    char* buf;
     int method;
+    http_string_t method_view;
+    http_string_t uri_view;
+    http_string_t version_view;
     char* method_name;
     char* uri;
     char* http_version;
     char* body;
     size_t body_length;
-    header_t* header;
+    bool chunked;
+    char* chunk;
+    size_t chunk_length;
+    header_t headers[HTTP_MAX_HEADERS];
+    size_t headers_count;
+    int8_t known_headers[HTTP_KNOWN_HEADERS];
+    bool upgrade;
+    bool parked;
+    bool park_expired;
+    long long park_deadline;
+    unsigned int wake_generation;
+    // free for the callback and kept while the request is parked, park_data goes with the request
+    uint64_t park_target;
+    void* park_data;
+    void (*park_data_free) (void* data);
 } request_t;
 
+/* One accepted client socket, owned by the epoll loop that accepted it */
+typedef struct connection {
+    int sd;
+    server_loop_t* loop;
+    connection_t* queue_next;
+    bool busy;
+    bool parked;
+    char* buf;
+    size_t buf_length;
+    size_t buf_size;
+    request_t* request;
+    size_t requests_served;
+    string_builder_t* out;
+    size_t out_pos;
+    bool close_after_write;
+    bool closed;
+    long long last_active;
+    struct {
+        bool active;
+        bool pull;
+        int opcode;
+        size_t message_start;
+        size_t message_length;
+        size_t frame_end;
+        char saved_byte;
+        long long last_ping;
+    } ws;
+} connection_t;
+
+/* Acceptor thread with its own SO_REUSEPORT socket and epoll instance */
+typedef struct server_loop {
+    server_ctx_t* server;
+    int server_sd;
+    int epoll_fd;
+    int wake_fd;
+    pthread_t thread;
+    list_t* connections;
+    connection_t* completed;
+    mutex_t completed_mutex;
+    connection_t* parked;
+    unsigned int wake_generation;
+} server_loop_t;
+
 typedef struct server_ctx {
     global_ctx_t* global_ctx;
-    int server_sd;
-    int state;
+    volatile int state;
+    long long keep_alive_timeout;
+    long long stream_timeout;
+    long long ping_interval;
+    size_t keep_alive_requests;
     request_callback_fun request_callback;
-    pthread_t worker;
+    chunk_callback_fun chunk_callback;
+    websocket_callback_fun websocket_callback;
+    server_loop_t* loops;
+    size_t loops_count;
+    pthread_t* workers;
+    size_t workers_count;
+    connection_t* jobs_head;
+    connection_t* jobs_tail;
+    mutex_t jobs_mutex;
+    pthread_cond_t jobs_cond;
+    atomic_uint wake_generation;
 } server_ctx_t;
 
-int create_server (global_ctx_t* global_ctx, server_ctx_t *ctx, request_callback_fun req_callback, const char* ip, const char* port);
+int create_server (global_ctx_t* global_ctx, server_ctx_t *ctx, request_callback_fun req_callback,
+                   chunk_callback_fun chunk_callback, websocket_callback_fun websocket_callback,
+                   const char* ip, const char* port);
 void stop_server_loop (server_ctx_t* ctx);
-pthread_t run_server (server_ctx_t* ctx);
-void* server_listener (void* ctx);
-void serve_client (server_ctx_t* ctx, int client_sd);
+int run_server (server_ctx_t* ctx);
+void join_server (server_ctx_t* ctx);
+void* server_listener (void* loop);
+void* server_worker (void* ctx);
+void server_send (request_t* req, const char* data, size_t length);
+void server_sendv (request_t* req, struct iovec* iov, int count);
+void server_send_frame (request_t* req, int opcode, const char* payload, size_t length);
+bool server_accept_websocket (request_t* req);
+void server_park_request (request_t* req, long long timeout_ms);
+void server_wake_parked (server_ctx_t* ctx);
 enum http_parse_error parse_request (request_t* req, char* buf, size_t buf_len);
+bool request_is_complete (request_t* req);
+void request_terminate_strings (request_t* req, char* buf);
+void request_take_chunk (request_t* req, char* buf);
+size_t request_drop_chunk (request_t* req, char* buf, size_t buf_len);
+bool request_is_streaming (request_t* req);
+const char* request_get_header (request_t* req, const char* name);
+const char* request_get_known_header (request_t* req, int known_header);
+bool request_wants_keep_alive (request_t* req);
+connection_t* create_connection (int client_sd);
+void close_connection (server_ctx_t* ctx, connection_t* conn);
+void free_connection (connection_t* conn);
 request_t* create_request ();
-header_t* create_header ();
+void reset_request (request_t* req);
 void free_request (request_t* req);
-int match_method_name (char* method_name);
+int match_method_name (const char* method_name, size_t length);
 
 #endif
\ No newline at end of file
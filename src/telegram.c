@@ -4,6 +4,7 @@
 #include "util.h"
 #include "telegram.h"
 #include "config.h"
+#include "event-queue.h"
 
 telebot_error_e tg_init_context (global_ctx_t* global_ctx, tg_context_t* ctx, const char* token) {
     ctx->global_ctx = global_ctx;
@@ -91,11 +92,10 @@ void* run (void* _ctx) {
 void process_update (tg_context_t* ctx, telebot_update_t* update) {
     telebot_message_t message = update->message;
 
-    char* text = strdup(message.text);
+    arena_t* arena = arena_create();
+    char* text = arena_strdup(arena, message.text);
 //    printf("tg text: %s\n", text);
     eso_command_t* cmd = NULL;
-    ref_counter_t* ref = ref_counter_create();
-    ref_counter_add(ref, text);
 
     if (STREQUAL(text, "/start")) {
         if (ctx->bot_params->owner == 0) {
@@ -112,7 +112,7 @@ void process_update (tg_context_t* ctx, telebot_update_t* update) {
             tg_send_owner(ctx, "Вы уже владеете этим ботом.", false);
     }
     else if (STREQUAL(text, "/reconnect")) {
-        cmd = eso_command_create(ESO_CMD_RECONNECT, NULL, ref);
+        cmd = eso_command_create(ESO_CMD_RECONNECT, NULL, arena);
         tg_send_owner(ctx, "Reconnecting", false);
     }
     else if (STREQUAL(text, "/chat")) {
@@ -126,16 +126,15 @@ void process_update (tg_context_t* ctx, telebot_update_t* update) {
         }
     }
     else if (ctx->bot_params->chat_mod_enabled) {
-        eso_send_message_command_t* send_message_data = MALLOC_STRUCT(eso_send_message_command_t);
+        eso_send_message_command_t* send_message_data = arena_alloc(arena, sizeof(eso_send_message_command_t));
         send_message_data->text = text;
-        ref_counter_add(ref, send_message_data);
-        cmd = eso_command_create(ESO_CMD_SEND_MESSAGE, send_message_data, ref);
+        cmd = eso_command_create(ESO_CMD_SEND_MESSAGE, send_message_data, arena);
     }
 
     if (cmd != NULL)
         command_queue_add(ctx->global_ctx->command_queue, cmd);
     else
-        ref_counter_free(ref);
+        arena_release(arena);
 }
 
 void tg_pause_worker (tg_context_t* ctx) {
@@ -173,7 +172,7 @@ void print_bot_info (const tg_context_t* ctx) {
 }
 
 void tg_handle_event (global_ctx_t* ctx, eso_event_t* eso_event) {
-    string_builder_t* formatted = tg_format_eso_event(eso_event);
+    string_builder_t* formatted = eso_event_format(eso_event);
     char* time = get_format_time("%H:%M");
     printf("%s %s\n", time, string_builder_as_cstring(formatted));
     tg_send_owner(ctx->tg_ctx, string_builder_as_cstring(formatted), true);
@@ -182,82 +181,10 @@ void tg_handle_event (global_ctx_t* ctx, eso_event_t* eso_event) {
 }
 
 event_handler_t* tg_event_handler_create () {
-    event_handler_t* event_handler = MALLOC_STRUCT(event_handler_t);
-    event_handler->event = &tg_handle_event;
-    return event_handler;
+    // a slow Telegram API must not hold up the server
+    return event_handler_create("telegram", &tg_handle_event, ESO_EVENT_MASK_ALL, EVENT_POLICY_DROP);
 }
 
 void tg_event_handler_free (event_handler_t* handler) {
-    free(handler);
-}
-
-string_builder_t* tg_format_eso_event (eso_event_t* event) {
-    string_builder_t *result = string_builder_printf("[%s] ", event->game_data.node);
-
-    string_builder_t* str;
-    switch(event->event_type) {
-        case ESO_EVENT_CHAT: {
-            eso_event_chat_t *chat = (eso_event_chat_t *) event->data;
-            str = string_builder_printf("[%d] %s: %s", event->actor.id, event->actor.name, chat->message);
-            break;
-        }
-        case ESO_EVENT_BROADCAST: {
-            eso_event_broadcast_t *broadcast = (eso_event_broadcast_t *) event->data;
-            str = string_builder_printf("Блютекст: %s", broadcast->message);
-            break;
-        }
-        case ESO_EVENT_TRY: {
-            eso_event_try_t *try = (eso_event_try_t *) event->data;
-            str = string_builder_printf("[%d] [try] %s: %s %s",
-                                        event->actor.id, event->actor.name, try->success ? "успешно" : "безуспешно",
-                                        try->message);
-            break;
-        }
-        case ESO_EVENT_ROLL: {
-            eso_event_roll_t *roll = (eso_event_roll_t *) event->data;
-            str = string_builder_printf("[%d] [roll] %s rolled %d", event->actor.id, event->actor.name, roll->num);
-            break;
-        }
-        case ESO_EVENT_DICE: {
-            eso_event_dice_t* dice_data = (eso_event_dice_t*)event->data;
-            string_builder_t* dice_string = string_builder_create(64);
-            for (size_t i = 0; i < list_size(dice_data->list); i++) {
-                eso_dice_t* dice = list_get(dice_data->list, i, eso_dice_t*);
-                string_builder_t* s = string_builder_printf("%d/%d ", dice->num, dice->sides);
-                string_builder_append(dice_string, string_builder_as_cstring(s));
-                string_builder_free(s);
-            }
-            str = string_builder_printf("[%d] [dice] %s rolled %s", event->actor.id, event->actor.name,
-                                                               string_builder_as_cstring(dice_string));
-            string_builder_free(dice_string);
-            break;
-        }
-        case ESO_EVENT_MEDIA_TRACK: {
-            eso_media_track_t* media_event = (eso_media_track_t*) event->data;
-            string_builder_t * video_link = string_builder_create(128);
-            char* type = media_event->type;
-            char* id = media_event->id;
-            if (STREQUAL(type, "youtube")) {
-                string_builder_append(video_link, "https://www.youtube.com/watch?v=");
-                string_builder_append(video_link, id);
-            }
-            else
-                string_builder_append(video_link, id);
-            str = string_builder_printf("[%d] [yt-play] %s played %s", event->actor.id, event->actor.name,
-                                        string_builder_as_cstring(video_link));
-            string_builder_free(video_link);
-            break;
-        }
-        case ESO_EVENT_DISCONNECT: {
-            str = string_builder_copy("DISCONNECT");
-            break;
-        }
-        default: {
-            str = string_builder_printf("unimplemented event \'%s\'", event->event_code);
-        }
-    }
-    const char* s = string_builder_as_cstring(str);
-    string_builder_append(result, s);
-    string_builder_free(str);
-    return result;
+    event_handler_free(handler);
 }
\ No newline at end of file
@@ -38,7 +38,6 @@ void tg_pause_worker (tg_context_t* ctx);
 void tg_send_message (tg_context_t* ctx, long long int recipient, const char* text, bool silent);
 void tg_send_owner (tg_context_t* ctx, const char* text, bool silent);
 void print_bot_info (const tg_context_t* ctx);
-string_builder_t* tg_format_eso_event (eso_event_t* event);
 
 event_handler_t* tg_event_handler_create ();
 void tg_event_handler_free (event_handler_t* handler);
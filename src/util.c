@@ -2,44 +2,90 @@
 #include <time.h>
 #include "util.h"
 
-ref_counter_t* ref_counter_create () {
-    ref_counter_t* rc = MALLOC_STRUCT(ref_counter_t);
-    list_t* list = list_create(void*);
-    rc->ref_list = list;
-    return rc;
-}
-
-void ref_counter_add (ref_counter_t* rc, const void* ref) {
-    for (size_t i = 0; i < list_size(rc->ref_list); i++)
-        if (ref == list_get(rc->ref_list, i, void*))
-            return;
-    list_push(rc->ref_list, ref);
-}
-
-void ref_counter_free_ref (ref_counter_t* rc, void* ref) {
-    void* elem;
-    for (size_t i = 0; i < list_size(rc->ref_list); i++) {
-        elem = list_get(rc->ref_list, i, void*);
-        if (ref == elem) {
-            free(elem);
-            list_remove_index(rc->ref_list, i);
-            break;
-        }
+typedef struct arena_block {
+    arena_block_t* next;
+    max_align_t data[];
+} arena_block_t;
+
+#define ARENA_ALIGN(size) (((size) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+static mutex_t arena_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static arena_t* arena_pool = NULL;
+static size_t arena_pool_size = 0;
+
+arena_t* arena_create () {
+    mutex_lock(&arena_pool_mutex);
+    arena_t* arena = arena_pool;
+    if (arena != NULL) {
+        arena_pool = arena->next_free;
+        arena_pool_size--;
+    }
+    mutex_unlock(&arena_pool_mutex);
+
+    if (arena == NULL)
+        arena = MALLOC_STRUCT(arena_t);
+    arena->position = arena->data;
+    arena->end = arena->data + ARENA_BLOCK_SIZE;
+    arena->blocks = NULL;
+    arena->next_free = NULL;
+    return arena;
+}
+
+void* arena_alloc (arena_t* arena, size_t size) {
+    size = ARENA_ALIGN(size);
+    if (size <= (size_t)(arena->end - arena->position)) {
+        void* result = arena->position;
+        arena->position += size;
+        return result;
+    }
+    // a big object gets a block of its own, the current one stays in use
+    bool dedicated = size > ARENA_BLOCK_SIZE / 2;
+    size_t block_size = dedicated ? size : ARENA_BLOCK_SIZE;
+    arena_block_t* block = malloc(sizeof(arena_block_t) + block_size);
+    block->next = arena->blocks;
+    arena->blocks = block;
+    char* data = (char*)block->data;
+    if (!dedicated) {
+        arena->position = data + size;
+        arena->end = data + block_size;
     }
+    return data;
 }
 
-void ref_counter_free_all (ref_counter_t* rc) {
-    for (size_t i = list_size(rc->ref_list); i > 0; i--) {
-        void* ref = list_get(rc->ref_list, i - 1, void*);
-        free(ref);
+char* arena_strdup (arena_t* arena, const char* string) {
+    size_t length = strlen(string) + 1;
+    char* copy = arena_alloc(arena, length);
+    memcpy(copy, string, length);
+    return copy;
+}
+
+/* Frees everything allocated from the arena at once */
+void arena_release (arena_t* arena) {
+    while (arena->blocks != NULL) {
+        arena_block_t* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    mutex_lock(&arena_pool_mutex);
+    if (arena_pool_size < ARENA_FREE_LIST_MAX) {
+        arena->next_free = arena_pool;
+        arena_pool = arena;
+        arena_pool_size++;
+        arena = NULL;
     }
-    list_clear(rc->ref_list);
+    mutex_unlock(&arena_pool_mutex);
+    free(arena);
 }
 
-void ref_counter_free (ref_counter_t* rc) {
-    ref_counter_free_all(rc);
-    free(rc->ref_list);
-    free(rc);
+void arena_pool_free () {
+    mutex_lock(&arena_pool_mutex);
+    while (arena_pool != NULL) {
+        arena_t* next = arena_pool->next_free;
+        free(arena_pool);
+        arena_pool = next;
+    }
+    arena_pool_size = 0;
+    mutex_unlock(&arena_pool_mutex);
 }
 
 
@@ -172,6 +218,34 @@ string_builder_t* string_builder_printf (const char* format, ...) {
     return builder;
 }
 
+/* Appends formatted text, growing the builder at most once */
+void string_builder_append_printf (string_builder_t* builder, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t available = builder->length - builder->size;
+    size_t would_write = vsnprintf(builder->value_null, available, format, args);
+    va_end(args);
+    if (would_write >= available) {
+        size_t new_size = builder->length * 2 > builder->size + would_write + 1
+                          ? builder->length * 2 : builder->size + would_write + 1;
+        char* new_value = (char*) realloc(builder->value, new_size);
+        builder->value = new_value;
+        builder->value_null = new_value + builder->size;
+        builder->length = new_size;
+        va_start(args, format);
+        vsnprintf(builder->value_null, new_size - builder->size, format, args);
+        va_end(args);
+    }
+    builder->size += would_write;
+    builder->value_null += would_write;
+}
+
+void string_builder_clear (string_builder_t* builder) {
+    builder->size = 0;
+    builder->value_null = builder->value;
+    builder->value[0] = '\0';
+}
+
 void string_builder_free(string_builder_t* builder) {
     free(builder->value);
     free(builder);
@@ -179,7 +253,9 @@ void string_builder_free(string_builder_t* builder) {
 
 void string_builder_append_string (string_builder_t* builder, const char* string, size_t string_size) {
     if (builder->length - 1 - builder->size < string_size) {
-        size_t new_size = builder->size + string_size + 1;
+        // doubles like append_printf, encoders append a few bytes at a time
+        size_t new_size = builder->length * 2 > builder->size + string_size + 1
+                          ? builder->length * 2 : builder->size + string_size + 1;
         char* new_value = (char*) realloc(builder->value, new_size);
         builder->value = new_value;
         builder->value_null = new_value + builder->size;
@@ -255,4 +331,100 @@ char* get_format_time (const char* format) {
     char* buf = malloc(sizeof(char) * 256);
     strftime(buf, 256, format, &ltm);
     return buf;
-}
\ No newline at end of file
+}
+
+long long get_monotonic_ms () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define SHA1_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+void sha1_block (uint32_t state[5], const uint8_t block[64]) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+             | (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    for (int i = 16; i < 80; i++)
+        w[i] = SHA1_ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t temp = SHA1_ROTL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = SHA1_ROTL(b, 30);
+        b = a;
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/* Only used for the websocket handshake, not meant for anything security related */
+void sha1 (const void* data, size_t length, uint8_t digest[SHA1_DIGEST_LENGTH]) {
+    uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t offset = 0;
+    for (; offset + 64 <= length; offset += 64)
+        sha1_block(state, bytes + offset);
+
+    uint8_t tail[128] = {0};
+    size_t rest = length - offset;
+    memcpy(tail, bytes + offset, rest);
+    tail[rest] = 0x80;
+    size_t tail_length = rest + 9 <= 64 ? 64 : 128;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++)
+        tail[tail_length - 1 - i] = (uint8_t)(bits >> (i * 8));
+    sha1_block(state, tail);
+    if (tail_length == 128)
+        sha1_block(state, tail + 64);
+
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = (uint8_t)(state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+/* out needs BASE64_LENGTH(length) + 1 bytes, returns the length without the terminator */
+size_t base64_encode (const uint8_t* data, size_t length, char* out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t written = 0;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < length)
+            group |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < length)
+            group |= data[i + 2];
+        out[written++] = alphabet[group >> 18 & 0x3f];
+        out[written++] = alphabet[group >> 12 & 0x3f];
+        out[written++] = i + 1 < length ? alphabet[group >> 6 & 0x3f] : '=';
+        out[written++] = i + 2 < length ? alphabet[group & 0x3f] : '=';
+    }
+    out[written] = '\0';
+    return written;
+}
@@ -1,17 +1,35 @@
 #ifndef NOTIFIER_UTIL_H_HEADER
 #define NOTIFIER_UTIL_H_HEADER
 
+#include <stdint.h>
+#include <stddef.h>
+
 typedef void(*destructor_t)(void*);
 typedef struct list list_t;
 typedef struct string_builder string_builder_t;
+typedef struct arena arena_t;
 
 #include "main.h"
 
 #define LIST_DEFAULT_SIZE 10
 
-typedef struct ref_counter {
-    list_t* ref_list;
-} ref_counter_t;
+#define ARENA_BLOCK_SIZE 1024
+#define ARENA_FREE_LIST_MAX 256
+
+typedef struct arena_block arena_block_t;
+
+/*
+ * Bump allocator owning everything of one event or command.
+ * The first block is inline, larger objects go to chained blocks.
+ * Released arenas are kept on a free list and reused.
+ */
+typedef struct arena {
+    char* position;
+    char* end;
+    arena_block_t* blocks;
+    arena_t* next_free;
+    _Alignas(max_align_t) char data[ARENA_BLOCK_SIZE];
+} arena_t;
 
 typedef struct list {
     char* values;
@@ -32,12 +50,15 @@ typedef struct file {
     size_t length;
 } file_t;
 
-ref_counter_t* ref_counter_create ();
-void ref_counter_add (ref_counter_t* rc, const void* ref);
-void ref_counter_free_ref (ref_counter_t* rc, void* ref);
-void ref_counter_free_all (ref_counter_t* rc);
+arena_t* arena_create ();
+void* arena_alloc (arena_t* arena, size_t size);
+char* arena_strdup (arena_t* arena, const char* string);
+void arena_release (arena_t* arena);
+void arena_pool_free ();
+
 string_builder_t* string_builder_printf (const char* format, ...);
-void ref_counter_free (ref_counter_t* rc);
+void string_builder_append_printf (string_builder_t* builder, const char* format, ...);
+void string_builder_clear (string_builder_t* builder);
 
 void string_builder_free(string_builder_t* builder);
 string_builder_t* string_builder_create (size_t length);
@@ -72,5 +93,12 @@ void* list_get_index (list_t* list, size_t position);
 int read_file (file_t* file, const char* file_name);
 
 char* get_format_time (const char* format);
+long long get_monotonic_ms ();
+
+#define SHA1_DIGEST_LENGTH 20
+#define BASE64_LENGTH(n) (((n) + 2) / 3 * 4)
+
+void sha1 (const void* data, size_t length, uint8_t digest[SHA1_DIGEST_LENGTH]);
+size_t base64_encode (const uint8_t* data, size_t length, char* out);
 
 #endif
\ No newline at end of file
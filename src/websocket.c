@@ -0,0 +1,97 @@
+#include <string.h>
+#include "websocket.h"
+#include "util.h"
+
+void websocket_accept_key (const char* key, size_t key_length, char accept[WEBSOCKET_ACCEPT_LENGTH + 1]) {
+    char buf[256];
+    size_t guid_length = sizeof(WEBSOCKET_GUID) - 1;
+    if (key_length > sizeof(buf) - guid_length)
+        key_length = sizeof(buf) - guid_length;
+    memcpy(buf, key, key_length);
+    memcpy(buf + key_length, WEBSOCKET_GUID, guid_length);
+    uint8_t digest[SHA1_DIGEST_LENGTH];
+    sha1(buf, key_length + guid_length, digest);
+    base64_encode(digest, SHA1_DIGEST_LENGTH, accept);
+}
+
+/*
+ * Reads the frame header at the start of buf. When the frame is incomplete header_length and
+ * payload_length tell how much is known to be needed so far.
+ */
+int websocket_parse_frame (const char* buf, size_t length, size_t max_payload, websocket_frame_t* frame) {
+    frame->header_length = 2;
+    frame->payload_length = 0;
+    if (length < 2)
+        return WEBSOCKET_FRAME_INCOMPLETE;
+
+    uint8_t first = (uint8_t)buf[0];
+    uint8_t second = (uint8_t)buf[1];
+    // no extension is negotiated, reserved bits must be clear
+    if (first & 0x70)
+        return WEBSOCKET_FRAME_INVALID;
+    frame->fin = first & 0x80;
+    frame->opcode = first & 0x0f;
+    frame->masked = second & 0x80;
+
+    size_t short_length = second & 0x7f;
+    size_t length_bytes = short_length == 126 ? 2 : short_length == 127 ? 8 : 0;
+    frame->header_length = 2 + length_bytes + (frame->masked ? 4 : 0);
+    if (WEBSOCKET_IS_CONTROL(frame->opcode) && (!frame->fin || short_length > 125))
+        return WEBSOCKET_FRAME_INVALID;
+    if (length < frame->header_length)
+        return WEBSOCKET_FRAME_INCOMPLETE;
+
+    uint64_t payload_length = short_length;
+    if (length_bytes > 0) {
+        payload_length = 0;
+        for (size_t i = 0; i < length_bytes; i++)
+            payload_length = payload_length << 8 | (uint8_t)buf[2 + i];
+    }
+    if (payload_length > max_payload)
+        return WEBSOCKET_FRAME_TOO_LARGE;
+    frame->payload_length = (size_t)payload_length;
+    if (frame->masked)
+        memcpy(frame->mask, buf + 2 + length_bytes, 4);
+
+    if (length - frame->header_length < frame->payload_length)
+        return WEBSOCKET_FRAME_INCOMPLETE;
+    return WEBSOCKET_FRAME_READY;
+}
+
+/* XORs in place eight bytes at a time, the mask phase does not change between words */
+void websocket_unmask (char* payload, size_t length, const uint8_t mask[4]) {
+    uint64_t word_mask;
+    uint8_t mask_bytes[8];
+    for (int i = 0; i < 8; i++)
+        mask_bytes[i] = mask[i & 3];
+    memcpy(&word_mask, mask_bytes, 8);
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, payload + i, 8);
+        word ^= word_mask;
+        memcpy(payload + i, &word, 8);
+    }
+    for (; i < length; i++)
+        payload[i] ^= mask[i & 3];
+}
+
+/* Server frames are never masked or fragmented, returns the header length */
+size_t websocket_frame_header (uint8_t* header, int opcode, size_t payload_length) {
+    header[0] = 0x80 | (uint8_t)opcode;
+    if (payload_length <= 125) {
+        header[1] = (uint8_t)payload_length;
+        return 2;
+    }
+    if (payload_length <= 0xffff) {
+        header[1] = 126;
+        header[2] = (uint8_t)(payload_length >> 8);
+        header[3] = (uint8_t)payload_length;
+        return 4;
+    }
+    header[1] = 127;
+    for (int i = 0; i < 8; i++)
+        header[2 + i] = (uint8_t)((uint64_t)payload_length >> ((7 - i) * 8));
+    return 10;
+}
@@ -0,0 +1,42 @@
+#ifndef NOTIFIER_WEBSOCKET_H_HEADER
+#define NOTIFIER_WEBSOCKET_H_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_ACCEPT_LENGTH 28
+#define WEBSOCKET_MAX_HEADER_LENGTH 14
+
+#define WEBSOCKET_OP_CONTINUATION   0x0
+#define WEBSOCKET_OP_TEXT           0x1
+#define WEBSOCKET_OP_BINARY         0x2
+#define WEBSOCKET_OP_CLOSE          0x8
+#define WEBSOCKET_OP_PING           0x9
+#define WEBSOCKET_OP_PONG           0xa
+
+#define WEBSOCKET_IS_CONTROL(opcode) ((opcode) & 0x8)
+
+#define WEBSOCKET_FRAME_INCOMPLETE  0
+#define WEBSOCKET_FRAME_READY       1
+#define WEBSOCKET_FRAME_INVALID     (-1)
+#define WEBSOCKET_FRAME_TOO_LARGE   (-2)
+
+#define WEBSOCKET_CLOSE_TOO_BIG     1009
+
+typedef struct websocket_frame {
+    bool fin;
+    int opcode;
+    bool masked;
+    uint8_t mask[4];
+    size_t header_length;
+    size_t payload_length;
+} websocket_frame_t;
+
+void websocket_accept_key (const char* key, size_t key_length, char accept[WEBSOCKET_ACCEPT_LENGTH + 1]);
+int websocket_parse_frame (const char* buf, size_t length, size_t max_payload, websocket_frame_t* frame);
+void websocket_unmask (char* payload, size_t length, const uint8_t mask[4]);
+size_t websocket_frame_header (uint8_t* header, int opcode, size_t payload_length);
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <json.h>
+#include "../src/eso.h"
+#include "../src/eso-json.h"
+
+/*
+ * Parses a corpus of events, one JSON object per line, with the schema parser and with the
+ * json-c tree the server falls back to. Every event the schema parser takes has to come out
+ * the same as through json-c, then both are timed over the whole corpus.
+ * Usage: eso-json-bench corpus.ndjson [rounds]
+ */
+
+#define BENCH_DEFAULT_ROUNDS 2000
+
+static eso_event_t* parse_schema (const char* line, size_t length) {
+    const char* pos = line;
+    const char* end = line + length;
+    eso_event_t* event = eso_json_parse_event(&pos, end);
+    if (event == NULL)
+        return NULL;
+    // the same trailing check parse_eso_event makes
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n'))
+        pos++;
+    if (pos == end)
+        return event;
+    eso_event_release(event);
+    return NULL;
+}
+
+static eso_event_t* parse_tree (const char* line) {
+    json_object* root = json_tokener_parse(line);
+    if (root == NULL)
+        return NULL;
+    eso_event_t* event = eso_event_from_json(root);
+    json_object_put(root);
+    return event;
+}
+
+static bool same_string (const char* what, const char* a, const char* b) {
+    if (a == b || (a != NULL && b != NULL && strcmp(a, b) == 0))
+        return true;
+    printf("  %s: \"%s\" and \"%s\"\n", what, a != NULL ? a : "(null)", b != NULL ? b : "(null)");
+    return false;
+}
+
+static bool same_int (const char* what, long long a, long long b) {
+    if (a == b)
+        return true;
+    printf("  %s: %lld and %lld\n", what, a, b);
+    return false;
+}
+
+static bool same_event (eso_event_t* a, eso_event_t* b) {
+    bool same = same_string("code", a->event_code, b->event_code)
+        & same_int("type", a->event_type, b->event_type)
+        & same_int("actor.id", a->actor.id, b->actor.id)
+        & same_string("actor.name", a->actor.name, b->actor.name)
+        & same_string("node", a->game_data.node, b->game_data.node);
+    if (!same || a->event_type != b->event_type)
+        return false;
+    if ((a->data == NULL) != (b->data == NULL)) {
+        printf("  data: %p and %p\n", a->data, b->data);
+        return false;
+    }
+    if (a->data == NULL)
+        return true;
+    switch (a->event_type) {
+        case ESO_EVENT_CHAT:
+            return same_string("message", ((eso_event_chat_t*)a->data)->message, ((eso_event_chat_t*)b->data)->message);
+        case ESO_EVENT_BROADCAST:
+            return same_string("message", ((eso_event_broadcast_t*)a->data)->message,
+                               ((eso_event_broadcast_t*)b->data)->message);
+        case ESO_EVENT_TRY: {
+            eso_event_try_t* x = a->data;
+            eso_event_try_t* y = b->data;
+            return same_string("message", x->message, y->message) & same_int("success", x->success, y->success);
+        }
+        case ESO_EVENT_ROLL:
+            return same_int("num", ((eso_event_roll_t*)a->data)->num, ((eso_event_roll_t*)b->data)->num);
+        case ESO_EVENT_DICE: {
+            list_t* x = ((eso_event_dice_t*)a->data)->list;
+            list_t* y = ((eso_event_dice_t*)b->data)->list;
+            if (!same_int("rolls", list_size(x), list_size(y)))
+                return false;
+            for (size_t i = 0; i < list_size(x); i++) {
+                eso_dice_t* p = list_get(x, i, eso_dice_t*);
+                eso_dice_t* q = list_get(y, i, eso_dice_t*);
+                same = same & same_int("dice.num", p->num, q->num) & same_int("dice.sides", p->sides, q->sides);
+            }
+            return same;
+        }
+        case ESO_EVENT_MEDIA_TRACK: {
+            eso_media_track_t* x = a->data;
+            eso_media_track_t* y = b->data;
+            return same_string("track.id", x->id, y->id) & same_string("track.type", x->type, y->type);
+        }
+    }
+    return true;
+}
+
+static double elapsed_ms (struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1000 + (double)(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int main (int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage: %s corpus.ndjson [rounds]\n", argv[0]);
+        return 2;
+    }
+    long rounds = argc > 2 ? strtol(argv[2], NULL, 10) : BENCH_DEFAULT_ROUNDS;
+    file_t corpus;
+    if (read_file(&corpus, argv[1]) != 0) {
+        printf("couldn't read %s\n", argv[1]);
+        return 2;
+    }
+    if (eso_event_types_init() != 0)
+        return 2;
+
+    // lines are cut in place, json-c wants them terminated
+    list_t* lines = list_create(char*);
+    char* line = corpus.data;
+    char* end = corpus.data + corpus.length;
+    while (line < end) {
+        char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL)
+            line_end = end;
+        *line_end = '\0';
+        if (line_end > line)
+            list_push(lines, line);
+        line = line_end + 1;
+    }
+
+    int failed = 0, schema = 0;
+    for (size_t i = 0; i < list_size(lines); i++) {
+        char* text = list_get(lines, i, char*);
+        eso_event_t* fast = parse_schema(text, strlen(text));
+        eso_event_t* tree = parse_tree(text);
+        if (fast != NULL) {
+            schema++;
+            if (tree == NULL || !same_event(fast, tree)) {
+                printf("line %zu differs from json-c: %s\n", i + 1, text);
+                failed++;
+            }
+        }
+        if (fast != NULL)
+            eso_event_release(fast);
+        if (tree != NULL)
+            eso_event_release(tree);
+    }
+    printf("%zu events, %d taken by the schema parser, %d differ\n", list_size(lines), schema, failed);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < list_size(lines); i++) {
+            char* text = list_get(lines, i, char*);
+            eso_event_t* event = parse_schema(text, strlen(text));
+            if (event != NULL)
+                eso_event_release(event);
+        }
+    }
+    double schema_ms = elapsed_ms(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < list_size(lines); i++) {
+            eso_event_t* event = parse_tree(list_get(lines, i, char*));
+            if (event != NULL)
+                eso_event_release(event);
+        }
+    }
+    double tree_ms = elapsed_ms(&start);
+    double events = (double)rounds * (double)list_size(lines);
+    if (events > 0)
+        printf("schema parser %.0f ns/event, json-c %.0f ns/event\n",
+               schema_ms * 1000000 / events, tree_ms * 1000000 / events);
+
+    list_free(lines);
+    free(corpus.data);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include "../src/server.h"
+
+/*
+ * parse_request works on the receive buffer in place, a pipelined run of /event requests
+ * must not allocate once the request is created. malloc is counted while the parser runs.
+ */
+
+extern void* __libc_malloc (size_t size);
+extern void* __libc_calloc (size_t count, size_t size);
+extern void* __libc_realloc (void* memory, size_t size);
+
+static bool counting = false;
+static long allocations = 0;
+
+void* malloc (size_t size) {
+    if (counting)
+        allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc (size_t count, size_t size) {
+    if (counting)
+        allocations++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc (void* memory, size_t size) {
+    if (counting)
+        allocations++;
+    return __libc_realloc(memory, size);
+}
+
+#define PIPELINED_REQUESTS 64
+
+static const char event_request[] =
+    "POST /event HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9673\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 92\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+    "{\"eventType\":\"chat\",\"actor\":{\"id\":1,\"name\":\"a\"},\"gameData\":{\"node\":\"n\"},\"eventData\":{\"m\":1}}";
+
+int main () {
+    size_t request_length = strlen(event_request);
+    size_t buf_length = request_length * PIPELINED_REQUESTS;
+    char* buf = malloc(buf_length + 1);
+    for (int i = 0; i < PIPELINED_REQUESTS; i++)
+        memcpy(buf + request_length * i, event_request, request_length);
+    request_t* req = create_request();
+
+    int parsed = 0;
+    counting = true;
+    while (buf_length > 0) {
+        enum http_parse_error status = parse_request(req, buf, buf_length);
+        if (status != ok || !request_is_complete(req))
+            break;
+        request_terminate_strings(req, buf);
+        const char* content_type = request_get_known_header(req, HTTP_HEADER_CONTENT_TYPE);
+        if (req->method != HTTP_METHOD_POST || strcmp(req->uri, "/event") != 0 || req->body_length != 92
+            || content_type == NULL || strcmp(content_type, "application/json") != 0)
+            break;
+        // what finish_request does with the buffer
+        size_t consumed = req->p.end;
+        reset_request(req);
+        memmove(buf, buf + consumed, buf_length - consumed);
+        buf_length -= consumed;
+        parsed++;
+    }
+    counting = false;
+
+    free_request(req);
+    free(buf);
+    if (parsed != PIPELINED_REQUESTS) {
+        printf("parsed %d of %d pipelined requests\n", parsed, PIPELINED_REQUESTS);
+        return 1;
+    }
+    if (allocations != 0) {
+        printf("%ld allocations while parsing %d requests\n", allocations, parsed);
+        return 1;
+    }
+    printf("%d requests parsed without allocating\n", parsed);
+    return 0;
+}